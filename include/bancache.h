@@ -37,14 +37,18 @@ class CoreExport BanCacheHit
 	/** Reason, shown as quit message
 	 */
 	std::string Reason;
-	/** IP to match against, no wildcards here (of course)
+	/** Addresses to match against; a single IP, or an IPv6 prefix
+	 * if the hit was aggregated (see ServerConfig::BanCachePrefix6)
 	 */
-	std::string IP;
+	irc::sockets::cidr_mask IP;
 	/** Time that the ban expires at
 	 */
 	time_t Expiry;
+	/** Position of this hit in the least recently used list
+	 */
+	std::list<BanCacheHit*>::iterator LRUPos;
 
-	BanCacheHit(const std::string &ip, const std::string &type, const std::string &reason)
+	BanCacheHit(const irc::sockets::cidr_mask &ip, const std::string &type, const std::string &reason)
 	{
 		this->Type = type;
 		this->Reason = reason;
@@ -53,7 +57,7 @@ class CoreExport BanCacheHit
 	}
 
 	// overridden to allow custom time
-	BanCacheHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds)
+	BanCacheHit(const irc::sockets::cidr_mask &ip, const std::string &type, const std::string &reason, time_t seconds)
 	{
 		this->Type = type;
 		this->Reason = reason;
@@ -62,10 +66,21 @@ class CoreExport BanCacheHit
 	}
 };
 
+/** Hashes the raw bits of a cidr_mask, for use as a ban cache key
+ */
+struct CoreExport BanCacheKeyHash
+{
+	size_t operator()(const irc::sockets::cidr_mask& mask) const;
+};
+
 /* A container of ban cache items.
  * must be defined after class BanCacheHit.
  */
-typedef nspace::hash_map<std::string, BanCacheHit*, nspace::hash<std::string> > BanCacheHash;
+typedef nspace::hash_map<irc::sockets::cidr_mask, BanCacheHit*, BanCacheKeyHash> BanCacheHash;
+
+/** Ban cache items, most recently used first
+ */
+typedef std::list<BanCacheHit*> BanCacheLRU;
 
 /** A manager for ban cache, which allocates and deallocates and checks cached bans.
  */
@@ -73,18 +88,44 @@ class CoreExport BanCacheManager
 {
  private:
 	BanCacheHash* BanHash;
+	BanCacheLRU LRU;
+
+	/** Remove a hit from the hash and the LRU list, and delete it
+	 */
+	void EraseHit(BanCacheHash::iterator i);
+
  public:
+	/** Number of lookups which found an entry */
+	unsigned long Hits;
+	/** Number of lookups which found nothing */
+	unsigned long Misses;
+	/** Number of entries dropped to stay within <performance:bancachesize> */
+	unsigned long Evictions;
 
 	/** Creates and adds a Ban Cache item.
 	 * @param ip The IP the item is for.
 	 * @param type The type of ban cache item. std::string. .empty() means it's a negative match (user is allowed freely).
 	 * @param reason The reason for the ban. Left .empty() if it's a negative match.
 	 */
-	BanCacheHit *AddHit(const std::string &ip, const std::string &type, const std::string &reason);
+	BanCacheHit *AddHit(const irc::sockets::sockaddrs &ip, const std::string &type, const std::string &reason);
 
 	// Overridden to allow an optional number of seconds before expiry
-	BanCacheHit *AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds);
-	BanCacheHit *GetHit(const std::string &ip);
+	BanCacheHit *AddHit(const irc::sockets::sockaddrs &ip, const std::string &type, const std::string &reason, time_t seconds);
+
+	/** Creates and adds a positive Ban Cache item covering a range of addresses.
+	 * @param range The addresses the item is for
+	 * @param type The type of ban cache item
+	 * @param reason The reason for the ban
+	 * @param seconds Number of seconds before the item expires, or 0 for the default of a day
+	 */
+	BanCacheHit *AddHit(const irc::sockets::cidr_mask &range, const std::string &type, const std::string &reason, time_t seconds);
+
+	/** Find the cached entry for an address, trying an exact match before
+	 * an aggregated IPv6 prefix.
+	 * @param ip The address to look up
+	 * @return The entry, or NULL if there is none
+	 */
+	BanCacheHit *GetHit(const irc::sockets::sockaddrs &ip);
 	bool RemoveHit(BanCacheHit *b);
 
 	/** Removes all entries of a given type, either positive or negative. Returns the number of hits removed.
@@ -93,11 +134,17 @@ class CoreExport BanCacheManager
 	 */
 	unsigned int RemoveEntries(const std::string &type, bool positive);
 
-	BanCacheManager()
+	/** Get the number of entries in the cache */
+	size_t Size() const { return BanHash->size(); }
+
+	BanCacheManager() : Hits(0), Misses(0), Evictions(0)
 	{
 		this->BanHash = new BanCacheHash();
 	}
 	~BanCacheManager();
+
+	/** Remove all expired entries
+	 */
 	void RehashCache();
 };
 
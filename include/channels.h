@@ -50,6 +50,11 @@ class HostItem
  */
 class BanItem : public HostItem
 {
+ public:
+	/** The CIDR range of the host part of the ban, if it is one, so that it
+	 * can be matched against a user's address without parsing the mask again
+	 */
+	irc::sockets::cidr_match cidr;
 };
 
 /** Holds all relevent information for a channel.
@@ -120,6 +125,11 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	BanList bans;
 
+	/** Incremented whenever a list mode on the channel changes, invalidating
+	 * the ban verdicts cached in its memberships
+	 */
+	unsigned int banepoch;
+
 	/** Sets or unsets a custom mode in the channels info
 	 * @param mode The mode character to set or unset
 	 * @param value True if you want to set the mode or false if you want to remove it
@@ -385,6 +395,10 @@ class CoreExport Channel : public Extensible, public InviteBase
 	 */
 	bool CheckBan(User* user, const std::string& banmask);
 
+	/** Check a single ban for match, with the CIDR part of the mask already parsed
+	 */
+	bool CheckBan(User* user, const std::string& banmask, const irc::sockets::cidr_match& cidr);
+
 	/** Get the status of an "action" type extban
 	 */
 	ModResult GetExtBanStatus(User *u, char type);
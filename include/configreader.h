@@ -334,10 +334,25 @@ class CoreExport ServerConfig
 	 */
 	std::string FixedPart;
 
-	/** The DNS server to use for DNS queries
+	/** The DNS servers to use for DNS queries, separated by spaces
 	 */
 	std::string DNSServer;
 
+	/** The maximum number of entries in the DNS cache; the least
+	 * recently used entries are dropped beyond this.
+	 */
+	unsigned int DNSCacheSize;
+
+	/** How long, in seconds, to remember that a name or address does
+	 * not resolve, or 0 to not cache failed lookups.
+	 */
+	unsigned int DNSNegativeTTL;
+
+	/** How long, in milliseconds, to wait for a nameserver to answer before
+	 * also sending the query to the next fastest one, or 0 to not do this.
+	 */
+	unsigned int DNSHedgeDelay;
+
 	/** Pretend disabled commands don't exist.
 	 */
 	bool DisabledDontExist;
@@ -402,6 +417,22 @@ class CoreExport ServerConfig
 	 */
 	unsigned int SoftLimit;
 
+	/** The number of threads which perform socket I/O for
+	 * registered users, or 0 to do it all in the main thread.
+	 * Can only be set at startup.
+	 */
+	unsigned int IOThreads;
+
+	/** The maximum number of entries in the ban cache; the least
+	 * recently used entries are dropped beyond this.
+	 */
+	unsigned int BanCacheSize;
+
+	/** If nonzero, a cached ban on an IPv6 address covers the whole
+	 * prefix of this length, when the line which caused it does too.
+	 */
+	unsigned int BanCachePrefix6;
+
 	/** Maximum number of targets for a multi target command
 	 * such as PRIVMSG or KICK
 	 */
@@ -32,6 +32,13 @@ class CoreExport CullList
 {
 	std::vector<classbase*> list;
 	std::vector<LocalUser*> SQlist;
+	/** Items which are deleted a slice at a time by Apply() */
+	std::deque<classbase*> deferred;
+
+	/** Culls and deletes a batch of objects, each only once, along with
+	 * anything added to the cull list while they are being culled
+	 */
+	void Delete(std::vector<classbase*>& items);
 
  public:
 	/** Adds an item to the cull list
@@ -39,9 +46,23 @@ class CoreExport CullList
 	void AddItem(classbase* item) { list.push_back(item); }
 	void AddSQItem(LocalUser* item) { SQlist.push_back(item); }
 
-	/** Applies the cull list (deletes the contents)
+	/** Adds an item which nothing refers to any more, and which may be left
+	 * for a later main loop iteration when a lot of them go at once
+	 */
+	void AddDeferredItem(classbase* item) { deferred.push_back(item); }
+
+	/** Applies the cull list (deletes the contents), and deletes the next
+	 * slice of the deferred items
 	 */
 	void Apply();
+
+	/** Deletes all the deferred items now
+	 */
+	void ApplyDeferred();
+
+	/** Returns true if there are deferred items left to delete
+	 */
+	bool HasDeferred() const { return !deferred.empty(); }
 };
 
 class CoreExport ActionList
@@ -87,12 +87,19 @@ class CoreExport CachedQuery
 	/** The time when the item is due to expire
 	 */
 	time_t expires;
+	/** True if this caches a failed lookup, in which case data is the error message
+	 */
+	bool negative;
+	/** Position of this item in the cache's list of least recently used items
+	 */
+	std::list<irc::string>::iterator LRUPos;
 
 	/** Build a cached query
-	 * @param res The result data, an IP or hostname
+	 * @param res The result data, an IP or hostname, or the error message of a failed lookup
 	 * @param ttl The time-to-live value of the query result
+	 * @param neg True if the lookup failed
 	 */
-	CachedQuery(const std::string &res, unsigned int ttl);
+	CachedQuery(const std::string &res, unsigned int ttl, bool neg = false);
 
 	/** Returns the number of seconds remaining before this
 	 * cache item has expired and should be removed.
@@ -100,7 +107,8 @@ class CoreExport CachedQuery
 	int CalcTTLRemaining();
 };
 
-/** DNS cache information. Holds IPs mapped to hostnames, and hostnames mapped to IPs.
+/** DNS cache information. Holds IPs mapped to hostnames, and hostnames mapped to IPs,
+ * keyed on the query type and the name or IP which was looked up.
  */
 typedef nspace::hash_map<irc::string, CachedQuery, irc::hash> dnscache;
 
@@ -273,7 +281,8 @@ class CoreExport Resolver
 
 	/**
 	 * If the result is a cached result, this triggers the objects
-	 * OnLookupComplete. This is done because it is not safe to call
+	 * OnLookupComplete, or OnError if the cached lookup failed.
+	 * This is done because it is not safe to call
 	 * the abstract virtual method from the constructor.
 	 */
 	void TriggerCachedResult();
@@ -299,11 +308,27 @@ class CoreExport DNS : public EventHandler
 	 */
 	dnscache* cache;
 
-	/** A timer which ticks every hour to remove expired
+	/** Keys of the cached items, most recently used first
+	 */
+	std::list<irc::string> cachelru;
+
+	/** Keys of the cached items, ordered by the time they expire
+	 */
+	std::set<std::pair<time_t, irc::string> > cacheexpiry;
+
+	/** Number of cached items which are failed lookups
+	 */
+	size_t cachenegative;
+
+	/** A timer which ticks every minute to remove expired
 	 * items from the DNS cache.
 	 */
 	class CacheTimer* PruneTimer;
 
+	/** Remove an item from the cache and its indexes
+	 */
+	void EraseCache(dnscache::iterator item);
+
 	/**
 	 * Build a dns packet payload
 	 */
@@ -311,7 +336,29 @@ class CoreExport DNS : public EventHandler
 
  public:
 
-	irc::sockets::sockaddrs myserver;
+	/** A nameserver from <dns:server>, and how well it has been answering
+	 */
+	struct NameServer
+	{
+		/** The address queries are sent to */
+		irc::sockets::sockaddrs addr;
+		/** Smoothed round trip time in milliseconds, or 0 if not known yet */
+		unsigned long srtt;
+		/** Number of queries in a row which it failed to answer */
+		unsigned int failures;
+		/** After too many failures, the server isn't used again until this time */
+		time_t downuntil;
+		/** Number of queries sent to it */
+		unsigned long sent;
+		/** Number of replies received from it */
+		unsigned long answered;
+
+		NameServer(const irc::sockets::sockaddrs& sa) : addr(sa), srtt(0), failures(0), downuntil(0), sent(0), answered(0) { }
+	};
+
+	/** The nameservers queries can be sent to, in the order they were configured
+	 */
+	std::vector<NameServer> servers;
 
 	/**
 	 * Currently active Resolver classes
@@ -323,6 +370,26 @@ class CoreExport DNS : public EventHandler
 	 */
 	DNSRequest* requests[MAX_REQUEST_ID];
 
+	/**
+	 * Resolvers which asked for the same thing as the one in Classes while
+	 * its request was in flight, and are waiting on that request, by id
+	 */
+	std::map<int, std::vector<Resolver*> > Coalesced;
+
+	/**
+	 * Ids of the requests that are in flight, by query type and name,
+	 * so that identical lookups can share a request
+	 */
+	nspace::hash_map<irc::string, int, irc::hash> PendingQueries;
+
+	/**
+	 * Ids of the requests which have been sent to a nameserver and are
+	 * sent on to the next one if it doesn't answer within its share of
+	 * <dns:timeout>, or <dns:hedgedelay> if that is shorter, with the time
+	 * they were last sent, oldest first
+	 */
+	std::deque<std::pair<int, timespec> > hedgequeue;
+
 	/**
 	 * The port number DNS requests are made on,
 	 * and replies have as a source-port number.
@@ -383,6 +450,44 @@ class CoreExport DNS : public EventHandler
 	 */
 	bool AddResolverClass(Resolver* r);
 
+	/** Find a request which is in flight for the given query
+	 * @param source The IP or hostname being looked up
+	 * @param qt The type of the query
+	 * @return The id of the request, or -1 if there is none
+	 */
+	int FindPending(const std::string &source, QueryType qt);
+
+	/** Remove every Resolver waiting on a request, so that they can be
+	 * given its result or error and deleted
+	 * @param id The id of the request
+	 * @return The Resolvers, the one which started the request first
+	 */
+	std::vector<Resolver*> TakeResolvers(int id);
+
+	/** Find the nameserver with the given address
+	 * @return The nameserver, or NULL if it isn't one of ours
+	 */
+	NameServer* FindServer(const irc::sockets::sockaddrs& addr);
+
+	/** Choose the nameserver to send a query to: the fastest of those which
+	 * haven't failed recently, skipping the ones the query was already sent to
+	 * @param request The query being sent
+	 * @return The nameserver, or NULL if there are none left to try
+	 */
+	NameServer* PickServer(DNSRequest* request);
+
+	/** Record that a nameserver failed to answer a query, and stop using it
+	 * for a while if it has failed too many times in a row
+	 * @param ns The nameserver
+	 * @param waited How long the query was waited on, in milliseconds
+	 */
+	void ServerFailed(NameServer* ns, unsigned long waited);
+
+	/** Send queries which the last nameserver they were sent to has not
+	 * answered in time to the next one. Called from the main loop.
+	 */
+	void CheckHedges();
+
 	/**
 	 * Add a query to the list to be sent
 	 */
@@ -416,25 +521,47 @@ class CoreExport DNS : public EventHandler
 	 */
 	void CleanResolvers(Module* module);
 
-	/** Return the cached value of an IP or hostname
+	/** Number of lookups answered from the cache */
+	unsigned long CacheHits;
+	/** Number of lookups which were not in the cache */
+	unsigned long CacheMisses;
+	/** Number of items dropped from the cache to stay within <dns:cachesize> */
+	unsigned long CacheEvictions;
+
+	/** Return the cached value of an IP or hostname, and mark it as recently used
 	 * @param source An IP or hostname to find in the cache.
+	 * @param qt The type of the query
 	 * @return A pointer to a CachedQuery if the item exists,
 	 * otherwise NULL.
 	 */
-	CachedQuery* GetCache(const std::string &source);
+	CachedQuery* GetCache(const std::string &source, QueryType qt);
+
+	/** Add an item to the DNS cache, replacing any existing item for the
+	 * same query, and evicting the least recently used items if the cache is full.
+	 * @param source The IP or hostname which was looked up
+	 * @param qt The type of the query
+	 * @param item The result to cache
+	 */
+	void AddCache(const std::string &source, QueryType qt, const CachedQuery& item);
 
 	/** Delete a cached item from the DNS cache.
 	 * @param source An IP or hostname to remove
+	 * @param qt The type of the query
+	 */
+	void DelCache(const std::string &source, QueryType qt);
+
+	/** Return the number of items in the DNS cache
+	 * @param negative Set to the number of items which cache failed lookups
 	 */
-	void DelCache(const std::string &source);
+	size_t CacheSize(size_t& negative);
 
 	/** Clear all items from the DNS cache immediately.
 	 */
 	int ClearCache();
 
-	/** Prune the DNS cache, e.g. remove all expired
-	 * items and rehash the cache buckets, but leave
-	 * items in the hash which are still valid.
+	/** Prune the DNS cache, removing all expired items and, if
+	 * <dns:cachesize> was lowered, the least recently used ones.
+	 * @return The number of items removed
 	 */
 	int PruneCache();
 };
@@ -56,6 +56,12 @@
  */
 CoreExport extern unsigned const char *national_case_insensitive_map;
 
+/** Bumped by modules whenever they change national_case_insensitive_map, including
+ * when they rewrite the table it points at in place, so that anything which was
+ * built from the old mapping (such as a CompiledMask) knows to rebuild itself.
+ */
+CoreExport extern unsigned int national_case_insensitive_generation;
+
 /** A mapping of uppercase to lowercase, including scandinavian
  * 'oddities' as specified by RFC1459, e.g. { -> [, and | -> \
  */
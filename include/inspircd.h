@@ -79,6 +79,7 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "extensible.h"
 #include "numerics.h"
 #include "uid.h"
+#include "wildcard.h"
 #include "users.h"
 #include "channels.h"
 #include "timer.h"
@@ -94,6 +95,7 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "filelogger.h"
 #include "modules.h"
 #include "threadengine.h"
+#include "iothreads.h"
 #include "configreader.h"
 #include "inspstring.h"
 #include "protocol.h"
@@ -397,6 +399,10 @@ class CoreExport InspIRCd
 	 */
 	ThreadEngine* Threads;
 
+	/** I/O threads for registered users, or NULL if <performance:iothreads> is 0
+	 */
+	IOThreadPool* IOThreads;
+
 	/** The thread/class used to read config files in REHASH and on startup
 	 */
 	ConfigReaderThread* ConfigThread;
@@ -96,6 +96,19 @@ class CoreExport SocketTimeout : public Timer
 	virtual void Tick(time_t now);
 };
 
+/** A block of data in a socket's send queue. A segment can be queued on
+ * many sockets at once (for example, a line sent to every member of a
+ * channel), so its data must not be changed while GetReferenceCount() is
+ * greater than one.
+ */
+class CoreExport SendQueueSegment : public refcountbase
+{
+ public:
+	std::string data;
+	SendQueueSegment() {}
+	SendQueueSegment(const std::string& text) : data(text) {}
+};
+
 /**
  * StreamSocket is a class that wraps a TCP socket and handles send
  * and receive queues, including passing them to IO hooks
@@ -104,17 +117,49 @@ class CoreExport StreamSocket : public EventHandler
 {
 	/** Module that handles raw I/O for this socket, or NULL */
 	reference<Module> IOHook;
-	/** Private send queue. Note that individual strings may be shared
+	/** Private send queue. Note that individual segments may be shared
 	 */
-	std::deque<std::string> sendq;
-	/** Length, in bytes, of the sendq */
+	std::deque<reference<SendQueueSegment> > sendq;
+	/** Number of bytes of the first segment which have already been sent */
+	size_t sendq_pos;
+	/** Length, in bytes, of the unsent part of the sendq */
 	size_t sendq_len;
+	/** Bytes at the start of the sendq which the socket engine is still sending */
+	size_t sendq_sending;
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
 	std::string error;
+
+	/** Drop the given number of sent bytes from the start of the sendq */
+	void ConsumeSendQ(size_t length);
  protected:
 	std::string recvq;
+	/** Offset of the first unprocessed byte in recvq. Lines before this
+	 * have already been handed out, and are dropped in one go later.
+	 */
+	std::string::size_type recvq_pos;
+
+	/** Mark the given number of bytes of recvq as processed */
+	void ConsumeRecvQ(std::string::size_type length)
+	{
+		recvq_pos += length;
+		if (recvq_pos >= recvq.length())
+		{
+			recvq.clear();
+			recvq_pos = 0;
+		}
+	}
+
+	/** Drop the processed part of recvq */
+	void CompactRecvQ()
+	{
+		if (recvq_pos)
+		{
+			recvq.erase(0, recvq_pos);
+			recvq_pos = 0;
+		}
+	}
  public:
-	StreamSocket() : sendq_len(0) {}
+	StreamSocket() : sendq_pos(0), sendq_len(0), sendq_sending(0), recvq_pos(0) {}
 	inline Module* GetIOHook();
 	inline void AddIOHook(Module* m);
 	inline void DelIOHook();
@@ -126,6 +171,15 @@ class CoreExport StreamSocket : public EventHandler
 	virtual void DoRead();
 	/** Dispatched from HandleEvent */
 	virtual void DoWrite();
+	/** The socket engine may do the I/O of this socket unless it has an IOHook */
+	virtual bool EngineIO();
+	/** Called by the socket engine whenever the kernel has taken data of a send
+	 * started by SocketEngine::SendSegments(); the data is dropped from the sendq
+	 * @param sent The number of bytes the kernel has taken
+	 * @param finished True if the send is over, false if the engine sends the rest
+	 * @return True if the send is over and there is more data to send
+	 */
+	bool SendDone(size_t sent, bool finished);
 
 	/** Sets the error message for this socket. Once set, the socket is dead. */
 	void SetError(const std::string& err) { if (error.empty()) error = err; }
@@ -141,6 +195,10 @@ class CoreExport StreamSocket : public EventHandler
 	/** Send the given data out the socket, either now or when writes unblock
 	 */
 	void WriteData(const std::string& data);
+	/** Queue a segment which may also be queued on other sockets. The data
+	 * is not copied.
+	 */
+	void WriteData(const reference<SendQueueSegment>& segment);
 	/** Convenience function: read a line from the socket
 	 * @param line The line read
 	 * @param delim The line delimiter
@@ -148,7 +206,11 @@ class CoreExport StreamSocket : public EventHandler
 	 */
 	bool GetNextLine(std::string& line, char delim = '\n');
 	/** Useful for implementing sendq exceeded */
-	inline size_t getSendQSize() const { return sendq_len; }
+	virtual size_t getSendQSize() const { return sendq_len; }
+	/** Returns true if writes to this socket should be held back until the
+	 * socket engine flushes corked output, see SocketEngine::FlushCorked()
+	 */
+	virtual bool IsCorked() { return false; }
 
 	/**
 	 * Close the socket, remove from socket engine, etc
@@ -0,0 +1,163 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef IOTHREADS_H
+#define IOTHREADS_H
+
+#include "threadengine.h"
+
+class IOThread;
+class UserIOHandler;
+
+/** A client connection whose socket reads and writes are performed by an
+ * I/O thread instead of the main socket engine. Command processing for the
+ * user still happens in the main thread; the two sides only communicate
+ * through the owning IOThread's message queues and the queued counter.
+ */
+class CoreExport IOConnection
+{
+ public:
+	/** The I/O thread which owns the socket */
+	IOThread* const thread;
+
+	/** The socket itself. Closed by the I/O thread. */
+	const int fd;
+
+	/** Bytes handed to the I/O thread which it has not yet written.
+	 * Updated by both threads with atomic operations.
+	 */
+	volatile size_t queued;
+
+	/* ---- Main thread only ---- */
+
+	/** The user this connection belongs to, or NULL once it is closing */
+	UserIOHandler* owner;
+
+	/** Complete lines received from the I/O thread, each terminated by a
+	 * single '\n' and already stripped of CR and NUL characters.
+	 */
+	std::string inbuf;
+
+	/** Offset of the first unprocessed line in inbuf */
+	std::string::size_type inpos;
+
+	/** Output which will be handed to the I/O thread at the next flush */
+	std::string pending_out;
+
+	/** True if this connection is in the pool's list of connections to flush */
+	bool dirty;
+
+	/* ---- I/O thread only ---- */
+
+	/** Data waiting to be written to the socket */
+	std::string outbuf;
+
+	/** Offset of the first unwritten byte in outbuf */
+	std::string::size_type outpos;
+
+	/** The line currently being received */
+	std::string partial;
+
+	/** Raw bytes received since the last message to the main thread */
+	size_t rawin;
+
+	/** True once a read or write error has been reported */
+	bool dead;
+
+	/** True if this connection has more data to read than was read
+	 * in the last loop iteration
+	 */
+	bool busy;
+
+	IOConnection(IOThread* t, int sockfd, UserIOHandler* eh)
+		: thread(t), fd(sockfd), queued(0), owner(eh), inpos(0), dirty(false)
+		, outpos(0), rawin(0), dead(false), busy(false)
+	{
+	}
+
+	/** Size of the lines which are waiting to be processed */
+	size_t GetRecvQSize() const { return inbuf.length() - inpos; }
+
+	/** Take the next received line, if there is one.
+	 * @param line Set to the line, without its terminator
+	 * @return True if a line was available
+	 */
+	bool GetLine(std::string& line)
+	{
+		std::string::size_type eol = inbuf.find('\n', inpos);
+		if (eol == std::string::npos)
+			return false;
+		line.assign(inbuf, inpos, eol - inpos);
+		inpos = eol + 1;
+		if (inpos == inbuf.length())
+		{
+			inbuf.clear();
+			inpos = 0;
+		}
+		return true;
+	}
+};
+
+/** Manages the threads which perform socket I/O for registered local users,
+ * set by <performance:iothreads>. Users are moved onto an I/O thread once
+ * they have registered; connections with an IOHook (such as SSL) always
+ * stay in the main socket engine.
+ */
+class CoreExport IOThreadPool
+{
+	/** The I/O threads */
+	std::vector<IOThread*> threads;
+
+	/** UUIDs of users waiting to be moved onto an I/O thread */
+	std::vector<std::string> adopting;
+
+	/** Connections with output waiting to be handed to their thread */
+	std::vector<IOConnection*> dirty;
+
+	/** Try to move a user onto an I/O thread.
+	 * @return False if the user should be tried again later
+	 */
+	bool Migrate(LocalUser* user);
+
+ public:
+	/** Start the given number of I/O threads. Throws CoreException on failure. */
+	IOThreadPool(unsigned int count);
+
+	/** Closes all connections and joins the threads */
+	~IOThreadPool();
+
+	/** Returns the number of I/O threads */
+	size_t GetThreadCount() const { return threads.size(); }
+
+	/** Queue a newly registered user to be moved onto an I/O thread */
+	void Adopt(LocalUser* user);
+
+	/** Append output for a connection; it is sent at the next Flush() */
+	void Write(IOConnection* conn, const std::string& data);
+
+	/** Close a connection. Any pending output is written first. The
+	 * IOConnection is freed once the I/O thread has closed the socket.
+	 */
+	void Release(IOConnection* conn);
+
+	/** Move pending users onto threads and hand all pending output to the
+	 * I/O threads. Called once per main loop iteration.
+	 */
+	void Flush();
+};
+
+#endif
@@ -27,12 +27,32 @@ class CoreExport Membership : public Extensible
 	Channel* const chan;
 	// mode list, sorted by prefix rank, higest first
 	std::string modes;
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	/** Ban verdicts cached for this member, keyed by extban type or 0 for the
+	 * ban list itself. They are only valid while banchanepoch and banuserepoch
+	 * equal the banepoch of the channel and of the user.
+	 */
+	std::map<char, int> banverdicts;
+	unsigned int banchanepoch;
+	unsigned int banuserepoch;
+	Membership(User* u, Channel* c) : user(u), chan(c), banchanepoch(0), banuserepoch(0) {}
 	inline bool hasMode(char m) const
 	{
 		return modes.find(m) != std::string::npos;
 	}
 	unsigned int getRank();
+
+	/** Look up a cached ban verdict, discarding all of them if they are out of date
+	 * @param type The extban type, or 0 for the ban list itself
+	 * @param result Set to the cached ModResult value if there is one
+	 * @return True if a valid verdict was found
+	 */
+	bool GetBanVerdict(char type, int& result);
+
+	/** Cache a ban verdict for this member
+	 * @param type The extban type, or 0 for the ban list itself
+	 * @param result The ModResult value to cache
+	 */
+	void SetBanVerdict(char type, int result) { banverdicts[type] = result; }
 };
 
 class CoreExport InviteBase
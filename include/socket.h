@@ -96,6 +96,23 @@ namespace irc
 			std::string str() const;
 		};
 
+		/** The CIDR part of a ban or connect mask, parsed once so that binary
+		 * addresses can be checked against it without any string handling.
+		 */
+		struct CoreExport cidr_match
+		{
+			/** False if the mask has no valid CIDR part, in which case nothing matches */
+			bool valid;
+			/** The parsed range, if valid */
+			cidr_mask mask;
+
+			cidr_match() : valid(false) {}
+			/** Parse the part of a mask after its last '@', if that is an address followed by '/' and a prefix length */
+			cidr_match(const std::string& mask);
+			/** Match within this CIDR? */
+			bool match(const irc::sockets::sockaddrs& addr) const { return valid && mask.match(addr); }
+		};
+
 		/** Match CIDR, including an optional username/nickname part.
 		 *
 		 * This function will compare a human-readable address (plus
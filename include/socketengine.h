@@ -26,6 +26,7 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <deque>
 #include "inspircd_config.h"
 #include "socket.h"
 #include "base.h"
@@ -208,6 +209,13 @@ class CoreExport EventHandler : public classbase
 	 */
 	virtual void HandleEvent(EventType et, int errornum = 0) = 0;
 
+	/** Whether the socket engine may receive and send data for this handler
+	 * on its own, handing it over through SocketEngine::Recv() and taking it
+	 * through SocketEngine::SendSegments(). Only handlers which do all of their
+	 * reads through SocketEngine::Recv() may return true.
+	 */
+	virtual bool EngineIO() { return false; }
+
 	friend class SocketEngine;
 };
 
@@ -218,7 +226,7 @@ class CoreExport EventHandler : public classbase
  * should be treated as blackboxed, and vary
  * from system to system and upon the config
  * settings chosen by the server admin. The current
- * version supports select, epoll and kqueue.
+ * version supports select, poll, epoll, io_uring and kqueue.
  * The configure script will enable a socket engine
  * based upon what OS is detected, and will derive
  * a class from SocketEngine based upon what it finds.
@@ -241,6 +249,15 @@ class CoreExport SocketEngine
 	/** List of handlers that want a trial read/write
 	 */
 	std::set<int> trials;
+	/** List of handlers with corked output, see FlushCorked()
+	 */
+	std::set<int> corked;
+	/** Corked handlers whose write was deferred when they became writable
+	 */
+	std::set<int> corked_events;
+	/** True while FlushCorked() is running
+	 */
+	bool flushing_corked;
 
 	int MAX_DESCRIPTORS;
 
@@ -258,6 +275,17 @@ public:
 	unsigned long ReadEvents;
 	unsigned long WriteEvents;
 	unsigned long ErrorEvents;
+	/** Number of write syscalls saved by corking: a socket which is written
+	 * to after its write on becoming writable was deferred would otherwise
+	 * have needed a second write for the new data
+	 */
+	unsigned long CorkedWrites;
+
+	/** If true, DispatchEvents() only collects the events which are already
+	 * waiting, instead of waiting up to a second for more. The main loop
+	 * sets this while it has unfinished work for the next iteration.
+	 */
+	bool NoWait;
 
 	/** Constructor.
 	 * The constructor transparently initializes
@@ -346,6 +374,21 @@ public:
 	 */
 	virtual void DispatchTrialWrites();
 
+	/** Defer a write on a corked socket until the next FlushCorked().
+	 * @param eh The handler which has output to write
+	 * @param event True if the handler has become writable, false if it has
+	 * queued more output
+	 * @return False if the write should happen right away, because the
+	 * corked output is being flushed now
+	 */
+	bool CorkWrite(EventHandler* eh, bool event = false);
+
+	/** Write out the output of all corked sockets, with one
+	 * EVENT_WRITE per socket. Called after the socket events of a main
+	 * loop iteration have been dispatched, and before waiting for more.
+	 */
+	void FlushCorked();
+
 	/** Returns the socket engines name.  This returns the name of the
 	 * engine for use in /VERSION responses.
 	 * @return The socket engine name
@@ -388,7 +431,7 @@ public:
 	 * @param flags A flag value that controls the sending of the data.
 	 * @return This method should return exactly the same values as the system call it emulates.
 	 */
-	int Send(EventHandler* fd, const void *buf, size_t len, int flags);
+	virtual int Send(EventHandler* fd, const void *buf, size_t len, int flags);
 
 	/** Abstraction for BSD sockets recv(2).
 	 * This function should emulate its namesake system call exactly.
@@ -398,7 +441,20 @@ public:
 	 * @param flags A flag value that controls the reception of the data.
 	 * @return This method should return exactly the same values as the system call it emulates.
 	 */
-	int Recv(EventHandler* fd, void *buf, size_t len, int flags);
+	virtual int Recv(EventHandler* fd, void *buf, size_t len, int flags);
+
+	/** Start sending part of the send queue of a socket without waiting for
+	 * the kernel to take it, see EventHandler::EngineIO(). The engine keeps
+	 * references to the segments, which therefore stay unchanged, until the
+	 * send is done, and reports the bytes the kernel takes through
+	 * StreamSocket::SendDone().
+	 * @param sock The socket the send queue belongs to
+	 * @param segments The send queue
+	 * @param pos Number of bytes of the first segment which have already been sent
+	 * @return The number of bytes which are being sent, or 0 if the socket
+	 * has to write the data itself
+	 */
+	virtual size_t SendSegments(StreamSocket* sock, const std::deque<reference<SendQueueSegment> >& segments, size_t pos) { return 0; }
 
 	/** Abstraction for BSD sockets recvfrom(2).
 	 * This function should emulate its namesake system call exactly.
@@ -451,7 +507,7 @@ public:
 	 * @param how What part of the socket to shut down
 	 * @return This method should return exactly the same values as the system call it emulates.
 	 */
-	int Shutdown(EventHandler* fd, int how);
+	virtual int Shutdown(EventHandler* fd, int how);
 
 	/** Abstraction for BSD sockets shutdown(2).
 	 * This function should emulate its namesake system call exactly.
@@ -28,6 +28,7 @@ class TestSuite
 
 	bool DoThreadTests();
 	bool DoWildTests();
+	bool DoWildBenchmark();
 	bool DoCommaSepStreamTests();
 	bool DoSpaceSepStreamTests();
 	bool DoGenerateUIDTests();
@@ -44,6 +44,15 @@ class CoreExport Timer
 	/** True if this is a repeating timer
 	 */
 	bool repeat;
+	/** The link pointing at this timer in the TimerManager's slot list,
+	 * or NULL if the timer is not queued
+	 */
+	Timer** pprev;
+	/** The next timer in the same slot list
+	 */
+	Timer* next;
+
+	friend class TimerManager;
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
@@ -51,6 +60,7 @@ class CoreExport Timer
 	 * @param repeating Repeat this timer every secs_from_now seconds if set to true
 	 */
 	Timer(long secs_from_now, time_t now, bool repeating = false)
+		: pprev(NULL), next(NULL)
 	{
 		trigger = now + secs_from_now;
 		secs = secs_from_now;
@@ -116,13 +126,65 @@ class CoreExport Timer
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hierarchical timing wheel: the first level has one slot
+ * for each of the next 256 seconds, and each further level has 64 slots which
+ * each cover a whole turn of the level below. Adding and deleting a timer is
+ * O(1); the slots of a higher level are redistributed into the level below
+ * when the lower level wraps around.
  */
 class CoreExport TimerManager
 {
  protected:
-	/** A list of all pending timers
+	enum
+	{
+		/** log2 of the number of one second slots in the first level */
+		WHEEL_ROOT_BITS = 8,
+		/** log2 of the number of slots in each higher level */
+		WHEEL_LEVEL_BITS = 6,
+		/** Number of levels above the first one */
+		WHEEL_LEVELS = 3,
+		WHEEL_ROOT_SIZE = 1 << WHEEL_ROOT_BITS,
+		WHEEL_LEVEL_SIZE = 1 << WHEEL_LEVEL_BITS
+	};
+
+	/** The slot lists: WHEEL_ROOT_SIZE slots of the first level, followed
+	 * by WHEEL_LEVEL_SIZE slots for each higher level
+	 */
+	Timer* Wheel[WHEEL_ROOT_SIZE + WHEEL_LEVELS * WHEEL_LEVEL_SIZE];
+
+	/** Timers being ticked by TickTimers()
+	 */
+	Timer* Due;
+
+	/** The second which the wheel will process next; all timers which
+	 * trigger before this time are due
+	 */
+	time_t Current;
+
+	/** True while TickTimers() is processing the Due list
+	 */
+	bool Ticking;
+
+	/** Link a timer into the given slot list */
+	static void Link(Timer** slot, Timer* T);
+
+	/** Unlink a timer from whichever slot list it is in */
+	static void Unlink(Timer* T);
+
+	/** Put a timer into the slot for its trigger time */
+	void Place(Timer* T);
+
+	/** Redistribute the timers of a slot, relative to the current time
+	 * @return True if the slot was the first one of its level, so the next
+	 * level must also be cascaded
+	 */
+	bool Cascade(unsigned int level);
+
+	/** Re-place every timer after the clock has jumped
+	 * @param TIME The new current time
 	 */
-	std::vector<Timer *> Timers;
+	void Rebuild(time_t TIME);
 
  public:
 	/** Constructor
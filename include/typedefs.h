@@ -36,13 +36,17 @@ class FakeUser;
 class InspIRCd;
 class Invitation;
 class InviteBase;
+class IOConnection;
+class IOThreadPool;
 class LocalUser;
 class Membership;
 class Module;
 class OperInfo;
 class RemoteUser;
+class SendQueueSegment;
 class ServerConfig;
 class ServerLimits;
+class StreamSocket;
 class Thread;
 class User;
 class UserResolver;
@@ -31,6 +31,12 @@ class CoreExport UserManager
 	/** Map of local ip addresses for clone counting
 	 */
 	clonemap local_clones;
+
+	/** UUIDs of the local users to be checked by InspIRCd::DoBackgroundUserStuff(),
+	 * by the second from which they are due. A user may be listed more than once;
+	 * only the entry matching LocalUser::nextcheck is live.
+	 */
+	std::map<time_t, std::vector<std::string> > checks;
  public:
 	~UserManager()
 	{
@@ -70,6 +76,20 @@ class CoreExport UserManager
 	 */
 	clonemap global_clones;
 
+	/** Make sure a local user is checked by InspIRCd::DoBackgroundUserStuff()
+	 * no later than the given time. Does nothing if an earlier check is
+	 * already scheduled.
+	 * @param user The user to check
+	 * @param when The time from which the check is due
+	 */
+	void ScheduleCheck(LocalUser* user, time_t when);
+
+	/** Take all scheduled checks which are due.
+	 * @param now The current time
+	 * @param users Filled with the users to check, which are then no longer scheduled
+	 */
+	void GetDueChecks(time_t now, std::vector<LocalUser*>& users);
+
 	/** Add a client to the system.
 	 * This will create a new User, insert it into the user_hash,
 	 * initialize it as not yet registered, and add it to the socket engine.
@@ -89,6 +109,17 @@ class CoreExport UserManager
 	 */
 	void QuitUser(User *user, const std::string &quitreason, const char* operreason = "");
 
+	/** Disconnect many users at once, such as those lost in a netsplit.
+	 * Remote users are removed from their channels straight away, every local
+	 * user who shares a channel with any of them gets all their QUIT lines in
+	 * one write, and they are deleted over the next few main loop iterations.
+	 * Local users are quit one at a time by QuitUser().
+	 * @param users The users to remove
+	 * @param quitreason The quit reason to show to normal users
+	 * @param operreason The quit reason to show to opers
+	 */
+	void QuitUsers(const std::vector<User*>& users, const std::string &quitreason, const char* operreason = "");
+
 	/** Add a user to the local clone map
 	 * @param user The user to add
 	 */
@@ -100,6 +100,14 @@ struct CoreExport ConnectClass : public refcountbase
 	 */
 	std::string host;
 
+	/** The host mask, compiled for matching
+	 */
+	CompiledMask hostmatch;
+
+	/** The CIDR range of the host mask, if it is one
+	 */
+	irc::sockets::cidr_match hostcidr;
+
 	/** Number of seconds between pings for this line
 	 */
 	unsigned int pingtime;
@@ -146,6 +154,11 @@ struct CoreExport ConnectClass : public refcountbase
 	 */
 	unsigned long limit;
 
+	/** True if output to users in this class is only written once per
+	 * main loop iteration, see SocketEngine::FlushCorked()
+	 */
+	bool cork;
+
 	/** Create a new connect class with no settings.
 	 */
 	ConnectClass(ConfigTag* tag, char type, const std::string& mask);
@@ -159,6 +172,12 @@ struct CoreExport ConnectClass : public refcountbase
 	const std::string& GetName() { return name; }
 	const std::string& GetHost() { return host; }
 
+	/** Check whether a user's address or hostname matches the host mask of this class
+	 * @param user The user to check
+	 * @return True if their address is within the CIDR range of the mask, or their IP or hostname matches it as a glob
+	 */
+	bool MatchesHost(LocalUser* user);
+
 	/** Returns the registration timeout
 	 */
 	time_t GetRegTimeout()
@@ -302,6 +321,12 @@ class CoreExport User : public Extensible
 	 */
 	std::string fullname;
 
+	/** Incremented whenever something channel bans can match against changes,
+	 * such as the user's nick, ident, host, gecos, oper type or channels.
+	 * This invalidates the ban verdicts cached in their memberships.
+	 */
+	unsigned int banepoch;
+
 	/** The user's mode list.
 	 * NOT a null terminated string.
 	 * Also NOT an array.
@@ -425,6 +450,7 @@ class CoreExport User : public Extensible
 
 	/** This clears any cached results that are used for GetFullRealHost() etc.
 	 * The results of these calls are cached as generating them can be generally expensive.
+	 * Ban verdicts cached for the user are also invalidated.
 	 */
 	void InvalidateCache();
 
@@ -723,11 +749,27 @@ class CoreExport User : public Extensible
 
 class CoreExport UserIOHandler : public StreamSocket
 {
+	friend class IOThreadPool;
  public:
 	LocalUser* const user;
-	UserIOHandler(LocalUser* me) : user(me) {}
+
+	/** The I/O thread connection which handles this socket, or NULL if it is
+	 * handled by the main socket engine
+	 */
+	IOConnection* ioconn;
+
+	/** True if OnDataReady() stopped at the penalty or sendq limit, so lines
+	 * may be left over; they are retried when the user is next checked
+	 */
+	bool lines_held;
+
+	UserIOHandler(LocalUser* me) : user(me), ioconn(NULL), lines_held(false) {}
 	void OnDataReady();
 	void OnError(BufferedSocketError error);
+	void Close();
+	size_t getSendQSize() const;
+	bool IsCorked();
+	bool EngineIO();
 
 	/** Adds to the user's write buffer.
 	 * You may add any amount of text up to this users sendq value, if you exceed the
@@ -735,6 +777,18 @@ class CoreExport UserIOHandler : public StreamSocket
 	 * @param data The data to add to the write buffer
 	 */
 	void AddWriteBuf(const std::string &data);
+
+	/** Adds a segment which may be shared with other users to the write buffer.
+	 * The same sendq limits apply as for AddWriteBuf(const std::string&).
+	 * @param segment The data to add to the write buffer
+	 */
+	void AddWriteBuf(const reference<SendQueueSegment>& segment);
+
+ private:
+	/** Check that data of the given length can be added to the sendq, and
+	 * schedule the user to be quit if it cannot.
+	 */
+	bool CheckSendQ(size_t length);
 };
 
 typedef unsigned int already_sent_t;
@@ -796,6 +850,11 @@ class CoreExport LocalUser : public User, public InviteBase
 	 */
 	time_t nping;
 
+	/** The time from which InspIRCd::DoBackgroundUserStuff() next checks
+	 * this user, or 0 if no check is scheduled. See UserManager::ScheduleCheck()
+	 */
+	time_t nextcheck;
+
 	/** This value contains how far into the penalty threshold the user is.
 	 * This is used either to enable fake lag or for excess flood quits
 	 */
@@ -833,6 +892,19 @@ class CoreExport LocalUser : public User, public InviteBase
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write a line prepared by PrepareLine(). The line is shared with every
+	 * other user it is written to instead of being copied.
+	 * @param line The line to write
+	 */
+	void Write(const reference<SendQueueSegment>& line);
+
+	/** Prepare a line to be written to many local users, such as a channel
+	 * message. The line is cropped to the maximum length and terminated.
+	 * @param text The line to prepare, without a CR/LF
+	 * @return A segment to pass to Write(const reference<SendQueueSegment>&)
+	 */
+	static reference<SendQueueSegment> PrepareLine(const std::string& text);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
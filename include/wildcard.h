@@ -0,0 +1,92 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef WILDCARD_H
+#define WILDCARD_H
+
+/** A glob pattern which has been compiled for matching against many strings.
+ * Matches exactly the same strings as InspIRCd::Match() with the same mask
+ * and map, but the mask is only parsed once: it is split at each run of '*'
+ * into case folded segments, the first and last of which are compared
+ * directly against the start and end of the string. The longest literal
+ * run in between is searched for with memchr() before anything else is done.
+ */
+class CoreExport CompiledMask
+{
+	/** A part of the mask between two runs of '*', case folded.
+	 * A '?' matches any character.
+	 */
+	struct Segment
+	{
+		std::string chars;
+		/** Offset of a character in chars which only one byte folds to,
+		 * to look for with memchr(), or -1 if there is none
+		 */
+		int anchor;
+		/** The byte which folds to the anchor character */
+		unsigned char anchorbyte;
+		Segment() : anchor(-1), anchorbyte(0) { }
+	};
+
+	/** The mask as given */
+	std::string mask;
+
+	/** The map the mask is compiled with, or NULL for national_case_insensitive_map */
+	const unsigned char* givenmap;
+
+	/** The compiled form; rebuilt if the national case map changes */
+	mutable const unsigned char* map;
+	/** national_case_insensitive_generation when this was compiled */
+	mutable unsigned int generation;
+	mutable std::vector<Segment> segments;
+	mutable bool leadingstar;
+	mutable bool trailingstar;
+	/** True if the map folds something other than '?' to '?', which the segments can't represent */
+	mutable bool fallback;
+	/** Sum of the lengths of the segments, the shortest string which can match */
+	mutable size_t minlength;
+	/** Index of the middle segment with the longest literal run, or -1 */
+	mutable int prefilter;
+	mutable Segment prefilterrun;
+
+	void Compile() const;
+	bool MatchSegment(const Segment& seg, const unsigned char* str) const;
+	const unsigned char* FindSegment(const Segment& seg, const unsigned char* begin, const unsigned char* end) const;
+
+ public:
+	/** Create an empty mask, which only matches an empty string */
+	CompiledMask();
+
+	/** Compile a mask
+	 * @param mask The glob pattern
+	 * @param map The character map to use when matching, or NULL for the national one
+	 */
+	CompiledMask(const std::string& mask, const unsigned char* map = NULL);
+
+	/** Check whether a string matches this mask
+	 * @param str The literal string to match against
+	 * @return True if the string matches
+	 */
+	bool Match(const std::string& str) const { return Match(str.c_str(), str.length()); }
+	bool Match(const char* str) const;
+	bool Match(const char* str, size_t length) const;
+
+	/** Get the mask this was compiled from */
+	const std::string& str() const { return mask; }
+};
+
+#endif
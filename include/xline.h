@@ -116,6 +116,22 @@ class CoreExport XLine : public classbase
 	 */
 	virtual void OnAdd() { }
 
+	/** If this line can only match users whose IP address (or host, when that
+	 * is an IP address) is inside a CIDR range, get that range. Lines with an
+	 * IP mask are kept in an XLineIPTree so they can be looked up by address.
+	 * @param mask Set to the range covered by the line
+	 * @return True if the line has an IP mask
+	 */
+	virtual bool GetIPMask(irc::sockets::cidr_mask& mask) { return false; }
+
+	/** If this line matches users by a glob on their host and IP address,
+	 * get that host mask. Masks which are a literal host, or a literal
+	 * domain after "*." or before ".*", are kept in an XLineHostIndex.
+	 * @param mask Set to the host mask of the line
+	 * @return True if the line has a host mask
+	 */
+	virtual bool GetHostMask(std::string& mask) { return false; }
+
 	/** The time the line was added.
 	 */
 	time_t set_time;
@@ -159,10 +175,12 @@ class CoreExport KLine : public XLine
 	 * @param host Host to match
 	 */
 	KLine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
-		: XLine(s_time, d, src, re, "K"), identmask(ident), hostmask(host)
+		: XLine(s_time, d, src, re, "K"), identmask(ident), hostmask(host),
+		identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map), hostcidr(host)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
+		textmatch = CompiledMask(matchtext);
 	}
 
 	/** Destructor
@@ -183,6 +201,10 @@ class CoreExport KLine : public XLine
 
 	virtual bool IsBurstable();
 
+	virtual bool GetIPMask(irc::sockets::cidr_mask& mask);
+
+	virtual bool GetHostMask(std::string& mask);
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -191,6 +213,15 @@ class CoreExport KLine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** The masks above, compiled for matching
+	 */
+	CompiledMask identmatch;
+	CompiledMask hostmatch;
+	CompiledMask textmatch;
+	/** The CIDR range of the host mask, if it is one, for matching against the binary address
+	 */
+	irc::sockets::cidr_match hostcidr;
 };
 
 /** GLine class
@@ -207,10 +238,12 @@ class CoreExport GLine : public XLine
 	 * @param host Host to match
 	 */
 	GLine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
-		: XLine(s_time, d, src, re, "G"), identmask(ident), hostmask(host)
+		: XLine(s_time, d, src, re, "G"), identmask(ident), hostmask(host),
+		identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map), hostcidr(host)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
+		textmatch = CompiledMask(matchtext);
 	}
 
 	/** Destructor
@@ -229,6 +262,10 @@ class CoreExport GLine : public XLine
 
 	virtual const char* Displayable();
 
+	virtual bool GetIPMask(irc::sockets::cidr_mask& mask);
+
+	virtual bool GetHostMask(std::string& mask);
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -237,6 +274,15 @@ class CoreExport GLine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** The masks above, compiled for matching
+	 */
+	CompiledMask identmatch;
+	CompiledMask hostmatch;
+	CompiledMask textmatch;
+	/** The CIDR range of the host mask, if it is one, for matching against the binary address
+	 */
+	irc::sockets::cidr_match hostcidr;
 };
 
 /** ELine class
@@ -253,10 +299,12 @@ class CoreExport ELine : public XLine
 	 * @param host Host to match
 	 */
 	ELine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
-		: XLine(s_time, d, src, re, "E"), identmask(ident), hostmask(host)
+		: XLine(s_time, d, src, re, "E"), identmask(ident), hostmask(host),
+		identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map), hostcidr(host)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
+		textmatch = CompiledMask(matchtext);
 	}
 
 	~ELine()
@@ -271,10 +319,12 @@ class CoreExport ELine : public XLine
 
 	virtual void DisplayExpiry();
 
-	virtual void OnAdd();
-
 	virtual const char* Displayable();
 
+	virtual bool GetIPMask(irc::sockets::cidr_mask& mask);
+
+	virtual bool GetHostMask(std::string& mask);
+
 	/** Ident mask (ident part only)
 	 */
 	std::string identmask;
@@ -283,6 +333,15 @@ class CoreExport ELine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** The masks above, compiled for matching
+	 */
+	CompiledMask identmatch;
+	CompiledMask hostmatch;
+	CompiledMask textmatch;
+	/** The CIDR range of the host mask, if it is one, for matching against the binary address
+	 */
+	irc::sockets::cidr_match hostcidr;
 };
 
 /** ZLine class
@@ -298,7 +357,7 @@ class CoreExport ZLine : public XLine
 	 * @param ip IP to match
 	 */
 	ZLine(time_t s_time, long d, std::string src, std::string re, std::string ip)
-		: XLine(s_time, d, src, re, "Z"), ipaddr(ip)
+		: XLine(s_time, d, src, re, "Z"), ipaddr(ip), ipmatch(ip), ipcidr(ip)
 	{
 	}
 
@@ -318,9 +377,18 @@ class CoreExport ZLine : public XLine
 
 	virtual const char* Displayable();
 
+	virtual bool GetIPMask(irc::sockets::cidr_mask& mask);
+
+	virtual bool GetHostMask(std::string& mask);
+
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
+
+	/** The IP mask, compiled for matching
+	 */
+	CompiledMask ipmatch;
+	irc::sockets::cidr_match ipcidr;
 };
 
 /** QLine class
@@ -336,7 +404,7 @@ class CoreExport QLine : public XLine
 	 * @param nickname Nickname to match
 	 */
 	QLine(time_t s_time, long d, std::string src, std::string re, std::string nickname)
-		: XLine(s_time, d, src, re, "Q"), nick(nickname)
+		: XLine(s_time, d, src, re, "Q"), nick(nickname), nickmatch(nickname)
 	{
 	}
 
@@ -358,6 +426,10 @@ class CoreExport QLine : public XLine
 	/** Nickname mask
 	 */
 	std::string nick;
+
+	/** The nickname mask, compiled for matching
+	 */
+	CompiledMask nickmatch;
 };
 
 /** XLineFactory is used to generate an XLine pointer, given just the
@@ -402,6 +474,113 @@ class CoreExport XLineFactory
 	virtual ~XLineFactory() { }
 };
 
+/** A binary prefix tree of IPv4 and IPv6 CIDR masks. Each node holds the
+ * lines whose mask is exactly the prefix of that node, so all of the lines
+ * which cover an address are found with one walk down the tree, taking
+ * O(address bits). Chains of nodes without lines are collapsed.
+ */
+class CoreExport XLineIPTree
+{
+	struct Node
+	{
+		/** Prefix of every mask below this node */
+		irc::sockets::cidr_mask prefix;
+		/** The subtrees for a 0 and a 1 bit following the prefix */
+		Node* child[2];
+		/** Lines whose mask is exactly this prefix */
+		std::vector<XLine*> lines;
+
+		Node(const irc::sockets::cidr_mask& p) : prefix(p)
+		{
+			child[0] = child[1] = NULL;
+		}
+	};
+
+	/** Roots of the IPv4 and IPv6 trees, or NULL if empty */
+	Node* root4;
+	Node* root6;
+
+	static void DeleteNode(Node* node);
+
+ public:
+	XLineIPTree() : root4(NULL), root6(NULL) { }
+	~XLineIPTree();
+
+	/** Add a line
+	 * @param mask The IP mask of the line
+	 * @param line The line to add
+	 */
+	void Add(const irc::sockets::cidr_mask& mask, XLine* line);
+
+	/** Remove a line
+	 * @param mask The IP mask the line was added with
+	 * @param line The line to remove
+	 */
+	void Remove(const irc::sockets::cidr_mask& mask, XLine* line);
+
+	/** Find all lines whose mask contains an address
+	 * @param addr The address to look up
+	 * @param lines The lines are appended to this
+	 */
+	void Find(const irc::sockets::sockaddrs& addr, std::vector<XLine*>& lines) const;
+};
+
+/** An index of host masks without CIDR ranges or complex wildcards.
+ * Literal masks are kept in a hash, "*.domain" masks in a trie of the
+ * domain's labels in reverse order and "prefix.*" masks in a trie of the
+ * prefix's labels, so looking up a host costs one probe per label rather
+ * than a glob match per line. Keys are folded with rfc_case_insensitive_map,
+ * which is at least as loose as the maps lines are matched with, so the
+ * lines found for a host are a superset of those which match it.
+ */
+class CoreExport XLineHostIndex
+{
+	struct Node
+	{
+		/** The nodes for each following label */
+		std::map<std::string, Node*> children;
+		/** Lines whose mask ends (or starts) with exactly the labels on the path to this node */
+		std::vector<XLine*> lines;
+	};
+
+	typedef nspace::hash_map<std::string, std::vector<XLine*>, nspace::hash<std::string> > LiteralMap;
+
+	/** Lines with a literal host mask */
+	LiteralMap literals;
+
+	/** Root of the trie of "*.domain" masks, walked from the last label */
+	Node suffixes;
+
+	/** Root of the trie of "prefix.*" masks, walked from the first label */
+	Node prefixes;
+
+	static void DeleteChildren(Node* node);
+
+ public:
+	~XLineHostIndex();
+
+	/** Add a line, if its mask can be indexed
+	 * @param mask The host mask of the line
+	 * @param line The line to add
+	 * @return True if the line was added, false if its mask is too complex
+	 */
+	bool Add(const std::string& mask, XLine* line);
+
+	/** Remove a line
+	 * @param mask The host mask the line was added with
+	 * @param line The line to remove
+	 */
+	void Remove(const std::string& mask, XLine* line);
+
+	/** Find all lines whose mask may match a host
+	 * @param host The host or IP address to look up
+	 * @param lines The lines are appended to this
+	 */
+	void Find(const std::string& host, std::vector<XLine*>& lines) const;
+};
+
+class XLineBatch;
+
 /** XLineManager is a class used to manage glines, klines, elines, zlines and qlines,
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
@@ -424,6 +603,46 @@ class CoreExport XLineManager
 	 */
 	XLineContainer lookup_lines;
 
+	/** Lines of each type which have an IP mask, see XLine::GetIPMask()
+	 */
+	std::map<std::string, XLineIPTree*> ip_lines;
+
+	/** Lines of each type which have an indexable host mask, see XLine::GetHostMask()
+	 */
+	std::map<std::string, XLineHostIndex*> host_lines;
+
+	/** Lines with a duration, ordered by the time they expire at
+	 */
+	typedef std::set<std::pair<time_t, XLine*> > ExpiryQueue;
+	ExpiryQueue expiries;
+
+	/** Lines which ApplyLines() is still applying, a slice of users at a time
+	 */
+	std::deque<XLineBatch*> apply_batches;
+
+	/** Lines of each type which are in no index; lookups try these one by one
+	 */
+	XLineContainer unindexed_lines;
+
+	/** Add a line to the lookup indexes */
+	void IndexLine(XLine* line);
+
+	/** Remove a line from the lookup indexes */
+	void UnindexLine(XLine* line);
+
+	/** Add a line without touching the ban cache, see AddLine() */
+	bool InsertLine(XLine* line, User* user);
+
+	/** Find the first of the given lines, in lookup order, which matches
+	 * either a user or a pattern.
+	 * @param type The type of the lines
+	 * @param candidates The lines to try, may contain duplicates
+	 * @param unindexed True to also try the unindexed lines of the type
+	 * @param user The user to match, or NULL to match pattern
+	 * @param pattern The pattern to match if user is NULL
+	 */
+	XLine* MatchCandidates(const std::string& type, std::vector<XLine*>& candidates, bool unindexed, User* user, const std::string& pattern);
+
  public:
 
 	/** Constructor
@@ -443,6 +662,12 @@ class CoreExport XLineManager
 	 */
 	void CheckELines();
 
+	/** Checks whether one user matches an e:line and sets their ban exempt flag
+	 * accordingly. Unlike MatchesLine(), this never expires lines.
+	 * @param user The user to check
+	 */
+	void CheckELines(User* user);
+
 	/** Get all lines of a certain type to an XLineLookup (std::map<std::string, XLine*>).
 	 * NOTE: When this function runs any expired items are removed from the list before it
 	 * is returned to the caller.
@@ -467,6 +692,15 @@ class CoreExport XLineManager
 	 */
 	bool AddLine(XLine* line, User* user);
 
+	/** Add many XLines at once, e.g. when loading them from a database.
+	 * This is equivalent to calling AddLine() on each line, but cheaper.
+	 * Lines which can not be added are deleted.
+	 * @param lines The lines to be added; the vector is emptied
+	 * @param user The user adding the lines or NULL for the local server
+	 * @return The number of lines which were added
+	 */
+	unsigned int AddLines(std::vector<XLine*>& lines, User* user);
+
 	/** Delete an XLine
 	 * @param hostmask The xline-specific string identifying the line, e.g. "*@foo"
 	 * @param type The type of xline
@@ -520,12 +754,25 @@ class CoreExport XLineManager
 	 */
 	void ExpireLine(ContainerIter container, LookupIter item);
 
+	/** Expire all lines whose time is up. This is called once a second
+	 * and before every lookup, so lookups only ever see live lines.
+	 */
+	void ExpireLines();
+
 	/** Apply any new lines that are pending to be applied.
 	 * This will only apply lines in the pending_lines list, to save on
-	 * CPU time.
+	 * CPU time. All pending lines are applied in one pass over the local
+	 * users; if there are many users, only the first slice of them is
+	 * checked here and ContinueApplying() checks the rest.
 	 */
 	void ApplyLines();
 
+	/** Check the next slice of users against the lines which ApplyLines()
+	 * has not finished applying. Called by the main loop every iteration.
+	 * @return True if there are still users left to check
+	 */
+	bool ContinueApplying();
+
 	/** Handle /STATS for a given type.
 	 * NOTE: Any items in the list for this particular line type which have expired
 	 * will be expired and removed before the list is displayed.
@@ -24,6 +24,7 @@ use warnings;
 use POSIX qw(getcwd);
 
 sub find_output;
+sub socketengine_used($);
 sub gendep($);
 sub dep_cpp($$$);
 sub dep_so($);
@@ -78,7 +79,7 @@ END
 	for my $file (<*.cpp>, <modes/*.cpp>, <socketengines/*.cpp>, "threadengines/threadengine_pthread.cpp") {
 		my $out = find_output $file;
 		dep_cpp $file, $out, 'gen-o';
-		next if $file =~ m#^socketengines/# && $file ne "socketengines/$ENV{SOCKETENGINE}.cpp";
+		next if $file =~ m#^socketengines/# && !socketengine_used($file);
 		push @core_deps, $out;
 	}
 
@@ -148,7 +149,7 @@ END
 			mkdir "$ENV{BUILDPATH}/obj/$1";
 		}
 		dep_cpp $file, $out, 'gen-o';
-		next if $file =~ m#^socketengines/# && $file ne "socketengines/$ENV{SOCKETENGINE}.cpp";
+		next if $file =~ m#^socketengines/# && !socketengine_used($file);
 		push @deps, $out;
 		push @srcs, $file;
 	}
@@ -184,6 +185,13 @@ sub find_output {
 	}
 }
 
+sub socketengine_used($) {
+	my $file = shift;
+	return 1 if $file eq "socketengines/$ENV{SOCKETENGINE}.cpp";
+	# The io_uring engine falls back to epoll when io_uring can't be used
+	return $ENV{SOCKETENGINE} eq 'socketengine_uring' && $file eq 'socketengines/socketengine_epoll.cpp';
+}
+
 sub gendep($) {
 	my $f = shift;
 	my $basedir = $f =~ m#(.*)/# ? $1 : '.';
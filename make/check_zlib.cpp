@@ -0,0 +1,28 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <zlib.h>
+#include <string.h>
+
+int main() {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	int rv = deflateInit(&zs, Z_DEFAULT_COMPRESSION);
+	deflateEnd(&zs);
+	return (rv != Z_OK);
+}
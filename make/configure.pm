@@ -271,9 +271,12 @@ InspIRCd 1.0.x, are also allowed.
   --enable-gnutls              Enable GnuTLS module [no]
   --enable-openssl             Enable OpenSSL module [no]
   --enable-epoll               Enable epoll() where supported [set]
+  --enable-uring               Enable io_uring where supported [set]
   --enable-kqueue              Enable kqueue() where supported [set]
   --disable-epoll              Do not enable epoll(), fall back
                                to select() [not set]
+  --disable-uring              Do not enable io_uring, fall back
+                               to epoll() [not set]
   --disable-kqueue             Do not enable kqueue(), fall back
                                to select() [not set]
   --disable-ipv6               Do not build IPv6 native InspIRCd [not set]
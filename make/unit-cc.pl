@@ -85,7 +85,13 @@ sub do_core_link {
 }
 
 sub do_link_dir {
-	my $execstr = "$ENV{RUNLD} -o $out $ENV{PICLDFLAGS} @_";
+	my @libs;
+	for my $obj (@_) {
+		if ($obj =~ m#(?:^|/)(m_[^/]+)/([^/]+)\.o$#) {
+			push @libs, getlinkerflags("$ENV{SOURCEPATH}/src/modules/$1/$2.cpp");
+		}
+	}
+	my $execstr = "$ENV{RUNLD} -o $out $ENV{PICLDFLAGS} @_ @libs";
 	print "$execstr\n" if $verbose;
 	exec $execstr;
 }
@@ -23,51 +23,89 @@
 #include "inspircd.h"
 #include "bancache.h"
 
-BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason)
+size_t BanCacheKeyHash::operator()(const irc::sockets::cidr_mask& mask) const
 {
-	BanCacheHit *b;
-
-	if (this->BanHash->find(ip) != this->BanHash->end()) // can't have two cache entries on the same IP, sorry..
-		return NULL;
+	size_t hash = mask.type * 31 + mask.length;
+	for (unsigned int i = 0; i < sizeof(mask.bits); i++)
+		hash = hash * 31 + mask.bits[i];
+	return hash;
+}
 
-	b = new BanCacheHit(ip, type, reason);
+BanCacheHit *BanCacheManager::AddHit(const irc::sockets::sockaddrs &ip, const std::string &type, const std::string &reason)
+{
+	return AddHit(irc::sockets::cidr_mask(ip, 128), type, reason, 0);
+}
 
-	this->BanHash->insert(std::make_pair(ip, b));
-	return b;
+BanCacheHit *BanCacheManager::AddHit(const irc::sockets::sockaddrs &ip, const std::string &type, const std::string &reason, time_t seconds)
+{
+	return AddHit(irc::sockets::cidr_mask(ip, 128), type, reason, seconds);
 }
 
-BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds)
+BanCacheHit *BanCacheManager::AddHit(const irc::sockets::cidr_mask &range, const std::string &type, const std::string &reason, time_t seconds)
 {
 	BanCacheHit *b;
 
-	if (this->BanHash->find(ip) != this->BanHash->end()) // can't have two cache entries on the same IP, sorry..
+	if (this->BanHash->find(range) != this->BanHash->end()) // can't have two cache entries on the same IP, sorry..
 		return NULL;
 
-	b = new BanCacheHit(ip, type, reason, seconds);
+	if (seconds)
+		b = new BanCacheHit(range, type, reason, seconds);
+	else
+		b = new BanCacheHit(range, type, reason);
+
+	this->BanHash->insert(std::make_pair(range, b));
+	LRU.push_front(b);
+	b->LRUPos = LRU.begin();
 
-	this->BanHash->insert(std::make_pair(ip, b));
+	while (BanHash->size() > ServerInstance->Config->BanCacheSize)
+	{
+		BanCacheHit* oldest = LRU.back();
+		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCache: Cache is full, evicting hit on " + oldest->IP.str());
+		EraseHit(this->BanHash->find(oldest->IP));
+		Evictions++;
+	}
 	return b;
 }
 
-BanCacheHit *BanCacheManager::GetHit(const std::string &ip)
+BanCacheHit *BanCacheManager::GetHit(const irc::sockets::sockaddrs &ip)
 {
-	BanCacheHash::iterator i = this->BanHash->find(ip);
+	BanCacheHash::iterator i = this->BanHash->find(irc::sockets::cidr_mask(ip, 128));
+
+	/* Only positive hits are aggregated, so a hit on the whole prefix is checked
+	 * after any negative hit on the address itself.
+	 */
+	if (i == this->BanHash->end() && ip.sa.sa_family == AF_INET6 && ServerInstance->Config->BanCachePrefix6)
+		i = this->BanHash->find(irc::sockets::cidr_mask(ip, ServerInstance->Config->BanCachePrefix6));
 
 	if (i == this->BanHash->end())
+	{
+		Misses++;
 		return NULL; // free and safe
+	}
 	else
 	{
 		if (ServerInstance->Time() > i->second->Expiry)
 		{
-			ServerInstance->Logs->Log("BANCACHE", DEBUG, "Hit on " + ip + " is out of date, removing!");
-			RemoveHit(i->second);
+			ServerInstance->Logs->Log("BANCACHE", DEBUG, "Hit on " + i->first.str() + " is out of date, removing!");
+			EraseHit(i);
+			Misses++;
 			return NULL; // out of date
 		}
 
+		LRU.splice(LRU.begin(), LRU, i->second->LRUPos);
+		Hits++;
 		return i->second; // hit.
 	}
 }
 
+void BanCacheManager::EraseHit(BanCacheHash::iterator i)
+{
+	BanCacheHit* b = i->second;
+	LRU.erase(b->LRUPos);
+	this->BanHash->erase(i);
+	delete b;
+}
+
 bool BanCacheManager::RemoveHit(BanCacheHit *b)
 {
 	BanCacheHash::iterator i;
@@ -77,17 +115,17 @@ bool BanCacheManager::RemoveHit(BanCacheHit *b)
 
 	i = this->BanHash->find(b->IP);
 
-	if (i == this->BanHash->end())
+	if (i == this->BanHash->end() || i->second != b)
 	{
 		// err..
 		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveHit(): I got asked to remove a hit that wasn't in the hash(?)");
+		delete b;
 	}
 	else
 	{
-		this->BanHash->erase(i);
+		EraseHit(i);
 	}
 
-	delete b;
 	return true;
 }
 
@@ -115,9 +153,8 @@ unsigned int BanCacheManager::RemoveEntries(const std::string &type, bool positi
 			if ((positive && !b->Reason.empty()) || b->Reason.empty())
 			{
 				/* we need to remove this one. */
-				ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + b->IP);
-				delete b;
-				BanHash->erase(n); // WORD TO THE WISE: don't use RemoveHit here, because we MUST remove the iterator in a safe way.
+				ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + b->IP.str());
+				EraseHit(n);
 				removed++;
 			}
 		}
@@ -132,36 +169,17 @@ unsigned int BanCacheManager::RemoveEntries(const std::string &type, bool positi
 
 void BanCacheManager::RehashCache()
 {
-	BanCacheHash* NewHash = new BanCacheHash();
-
-	BanCacheHash::iterator safei;
+	/* Entries are dropped in place, the hash is not rebuilt */
 	for (BanCacheHash::iterator n = BanHash->begin(); n != BanHash->end(); )
 	{
-		safei = n;
+		BanCacheHash::iterator safei = n;
 		safei++;
 
-		/* Safe to delete items here through iterator 'n' */
-		BanCacheHit *b = n->second;
-
-		if (ServerInstance->Time() > b->Expiry)
-		{
-			/* we need to remove this one. */
-			delete b;
-			BanHash->erase(n); // WORD TO THE WISE: don't use RemoveHit here, because we MUST remove the iterator in a safe way.
-		}
-		else
-		{
-			/* Actually inserts a std::pair */
-			NewHash->insert(*n);
-		}
-
-		/* End of safe section */
+		if (ServerInstance->Time() > n->second->Expiry)
+			EraseHit(n);
 
 		n = safei;
 	}
-
-	delete BanHash;
-	BanHash = NewHash;
 }
 
 BanCacheManager::~BanCacheManager()
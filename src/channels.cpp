@@ -40,6 +40,7 @@ Channel::Channel(const std::string &cname, time_t ts)
 	this->age = ts ? ts : ServerInstance->Time();
 
 	maxbans = topicset = 0;
+	banepoch = 0;
 	modes.reset();
 }
 
@@ -145,6 +146,8 @@ Membership* Channel::AddUser(User* user)
 {
 	Membership* memb = new Membership(user, this);
 	userlist[user] = memb;
+	/* Bans such as j:#chan can depend on which channels the user is in */
+	user->banepoch++;
 	return memb;
 }
 
@@ -157,6 +160,7 @@ void Channel::DelUser(User* user)
 		a->second->cull();
 		delete a->second;
 		userlist.erase(a);
+		user->banepoch++;
 	}
 
 	if (userlist.empty())
@@ -427,21 +431,43 @@ Channel* Channel::ForceChan(Channel* Ptr, User* user, const std::string &privs,
 
 bool Channel::IsBanned(User* user)
 {
+	Membership* memb = GetUser(user);
+	int cached;
+	if (memb && memb->GetBanVerdict(0, cached))
+		return (cached == MOD_RES_DENY.res);
+
+	bool banned = false;
 	ModResult result;
 	FIRST_MOD_RESULT(OnCheckChannelBan, result, (user, this));
 
 	if (result != MOD_RES_PASSTHRU)
-		return (result == MOD_RES_DENY);
-
-	for (BanList::iterator i = this->bans.begin(); i != this->bans.end(); i++)
+		banned = (result == MOD_RES_DENY);
+	else
 	{
-		if (CheckBan(user, i->data))
-			return true;
+		for (BanList::iterator i = this->bans.begin(); i != this->bans.end(); i++)
+		{
+			if (CheckBan(user, i->data, i->cidr))
+			{
+				banned = true;
+				break;
+			}
+		}
 	}
-	return false;
+
+	if (memb)
+		memb->SetBanVerdict(0, banned ? MOD_RES_DENY.res : MOD_RES_ALLOW.res);
+	return banned;
 }
 
 bool Channel::CheckBan(User* user, const std::string& mask)
+{
+	std::string::size_type at = mask.find('@');
+	if (at == std::string::npos)
+		return CheckBan(user, mask, irc::sockets::cidr_match());
+	return CheckBan(user, mask, irc::sockets::cidr_match(mask.substr(at + 1)));
+}
+
+bool Channel::CheckBan(User* user, const std::string& mask, const irc::sockets::cidr_match& cidr)
 {
 	ModResult result;
 	FIRST_MOD_RESULT(OnCheckBan, result, (user, this, mask));
@@ -462,9 +488,10 @@ bool Channel::CheckBan(User* user, const std::string& mask)
 	if (InspIRCd::Match(tomatch, prefix, NULL))
 	{
 		std::string suffix = mask.substr(at + 1);
-		if (InspIRCd::Match(user->host, suffix, NULL) ||
-			InspIRCd::Match(user->dhost, suffix, NULL) ||
-			InspIRCd::MatchCIDR(user->GetIPString(), suffix, NULL))
+		if (cidr.match(user->client_sa) ||
+			InspIRCd::Match(user->GetIPString(), suffix, NULL) ||
+			InspIRCd::Match(user->host, suffix, NULL) ||
+			InspIRCd::Match(user->dhost, suffix, NULL))
 			return true;
 	}
 	return false;
@@ -472,20 +499,32 @@ bool Channel::CheckBan(User* user, const std::string& mask)
 
 ModResult Channel::GetExtBanStatus(User *user, char type)
 {
+	Membership* memb = GetUser(user);
+	int cached;
+	if (memb && memb->GetBanVerdict(type, cached))
+		return ModResult(cached);
+
 	ModResult rv;
 	FIRST_MOD_RESULT(OnExtBanCheck, rv, (user, this, type));
-	if (rv != MOD_RES_PASSTHRU)
-		return rv;
-	for (BanList::iterator i = this->bans.begin(); i != this->bans.end(); i++)
+	if (rv == MOD_RES_PASSTHRU)
 	{
-		if (i->data[0] == type && i->data[1] == ':')
+		for (BanList::iterator i = this->bans.begin(); i != this->bans.end(); i++)
 		{
-			std::string val = i->data.substr(2);
-			if (CheckBan(user, val))
-				return MOD_RES_DENY;
+			if (i->data[0] == type && i->data[1] == ':')
+			{
+				std::string val = i->data.substr(2);
+				if (CheckBan(user, val, i->cidr))
+				{
+					rv = MOD_RES_DENY;
+					break;
+				}
+			}
 		}
 	}
-	return MOD_RES_PASSTHRU;
+
+	if (memb)
+		memb->SetBanVerdict(type, rv.res);
+	return rv;
 }
 
 /* Channel::PartUser
@@ -598,12 +637,13 @@ void Channel::WriteChannel(User* user, const std::string &text)
 		return;
 
 	snprintf(tb,MAXBUF,":%s %s", user->GetFullHost().c_str(), text.c_str());
-	std::string out = tb;
+	reference<SendQueueSegment> line = LocalUser::PrepareLine(tb);
 
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(out);
+		LocalUser* u = IS_LOCAL(i->first);
+		if (u)
+			u->Write(line);
 	}
 }
 
@@ -627,12 +667,13 @@ void Channel::WriteChannelWithServ(const std::string& ServName, const std::strin
 	char tb[MAXBUF];
 
 	snprintf(tb,MAXBUF,":%s %s", ServName.empty() ? ServerInstance->Config->ServerName.c_str() : ServName.c_str(), text.c_str());
-	std::string out = tb;
+	reference<SendQueueSegment> line = LocalUser::PrepareLine(tb);
 
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(out);
+		LocalUser* u = IS_LOCAL(i->first);
+		if (u)
+			u->Write(line);
 	}
 }
 
@@ -689,15 +730,20 @@ void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CULi
 		if (mh)
 			minrank = mh->GetPrefixRank();
 	}
+	reference<SendQueueSegment> line;
 	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
 	{
-		if (IS_LOCAL(i->first) && (except_list.find(i->first) == except_list.end()))
+		LocalUser* u = IS_LOCAL(i->first);
+		if (u && (except_list.find(u) == except_list.end()))
 		{
 			/* User doesn't have the status we're after */
 			if (minrank && i->second->getRank() < minrank)
 				continue;
 
-			i->first->Write(out);
+			/* Prepared once, on the first local recipient, and shared by all of them */
+			if (!line)
+				line = LocalUser::PrepareLine(out);
+			u->Write(line);
 		}
 	}
 }
@@ -897,6 +943,23 @@ const char* Channel::GetPrefixChar(User *user)
 	return pf;
 }
 
+bool Membership::GetBanVerdict(char type, int& result)
+{
+	if (banchanepoch != chan->banepoch || banuserepoch != user->banepoch)
+	{
+		banverdicts.clear();
+		banchanepoch = chan->banepoch;
+		banuserepoch = user->banepoch;
+		return false;
+	}
+
+	std::map<char, int>::const_iterator i = banverdicts.find(type);
+	if (i == banverdicts.end())
+		return false;
+	result = i->second;
+	return true;
+}
+
 unsigned int Membership::getRank()
 {
 	char mchar = modes.c_str()[0];
@@ -947,6 +1010,7 @@ bool Channel::SetPrefix(User* user, char prefix, bool adding)
 	UserMembIter m = userlist.find(user);
 	if (m == userlist.end())
 		return false;
+	user->banepoch++;
 	for(unsigned int i=0; i < m->second->modes.length(); i++)
 	{
 		char mchar = m->second->modes[i];
@@ -95,4 +95,21 @@ bool irc::sockets::MatchCIDR(const std::string &address, const std::string &cidr
 	return mask == mask2;
 }
 
+irc::sockets::cidr_match::cidr_match(const std::string& str) : valid(false)
+{
+	std::string::size_type at = str.rfind('@');
+	std::string host = (at == std::string::npos) ? str : str.substr(at + 1);
+
+	std::string::size_type slash = host.rfind('/');
+	if (slash == std::string::npos || slash == 0 || slash + 1 == host.length())
+		return;
+	if (host[0] == '*' || host.find_first_not_of("0123456789", slash + 1) != std::string::npos)
+		return;
 
+	irc::sockets::sockaddrs sa;
+	if (!irc::sockets::aptosa(host.substr(0, slash), 0, sa))
+		return;
+
+	mask = irc::sockets::cidr_mask(host);
+	valid = true;
+}
@@ -21,6 +21,7 @@
 
 #include "inspircd.h"
 #include "xline.h"
+#include "bancache.h"
 #include "commands/cmd_whowas.h"
 
 #ifdef _WIN32
@@ -192,10 +193,12 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			ServerInstance->XLines->InvokeStats("E",223,user,results);
 		break;
 		case 'E':
+			results.push_back(sn+" 249 "+user->nick+" :Socket engine: "+ServerInstance->SE->GetName());
 			results.push_back(sn+" 249 "+user->nick+" :Total events: "+ConvToStr(ServerInstance->SE->TotalEvents));
 			results.push_back(sn+" 249 "+user->nick+" :Read events:  "+ConvToStr(ServerInstance->SE->ReadEvents));
 			results.push_back(sn+" 249 "+user->nick+" :Write events: "+ConvToStr(ServerInstance->SE->WriteEvents));
 			results.push_back(sn+" 249 "+user->nick+" :Error events: "+ConvToStr(ServerInstance->SE->ErrorEvents));
+			results.push_back(sn+" 249 "+user->nick+" :Corked writes saved: "+ConvToStr(ServerInstance->SE->CorkedWrites));
 		break;
 
 		/* stats m (list number of times each command has been used, plus bytecount) */
@@ -216,6 +219,8 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :Users: "+ConvToStr(ServerInstance->Users->clientlist->size()));
 			results.push_back(sn+" 249 "+user->nick+" :Channels: "+ConvToStr(ServerInstance->chanlist->size()));
 			results.push_back(sn+" 249 "+user->nick+" :Commands: "+ConvToStr(ServerInstance->Parser->cmdlist.size()));
+			results.push_back(sn+" 249 "+user->nick+" :Ban cache: "+ConvToStr(ServerInstance->BanCache->Size())+" entries, "+ConvToStr(ServerInstance->BanCache->Hits)+" hits, "+
+				ConvToStr(ServerInstance->BanCache->Misses)+" misses, "+ConvToStr(ServerInstance->BanCache->Evictions)+" evictions");
 
 			if (!ServerInstance->Config->WhoWasGroupSize == 0 && !ServerInstance->Config->WhoWasMaxGroups == 0)
 			{
@@ -318,6 +323,15 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			results.push_back(sn+" 249 "+user->nick+" :unknown commands "+ConvToStr(ServerInstance->stats->statsUnknown));
 			results.push_back(sn+" 249 "+user->nick+" :nick collisions "+ConvToStr(ServerInstance->stats->statsCollisions));
 			results.push_back(sn+" 249 "+user->nick+" :dns requests "+ConvToStr(ServerInstance->stats->statsDnsGood+ServerInstance->stats->statsDnsBad)+" succeeded "+ConvToStr(ServerInstance->stats->statsDnsGood)+" failed "+ConvToStr(ServerInstance->stats->statsDnsBad));
+			size_t dnsnegative;
+			size_t dnscached = ServerInstance->Res->CacheSize(dnsnegative);
+			results.push_back(sn+" 249 "+user->nick+" :dns cache "+ConvToStr(dnscached)+" entries ("+ConvToStr(dnsnegative)+" negative) hits "+ConvToStr(ServerInstance->Res->CacheHits)+
+				" misses "+ConvToStr(ServerInstance->Res->CacheMisses)+" evictions "+ConvToStr(ServerInstance->Res->CacheEvictions));
+			for (std::vector<DNS::NameServer>::const_iterator i = ServerInstance->Res->servers.begin(); i != ServerInstance->Res->servers.end(); ++i)
+			{
+				results.push_back(sn+" 249 "+user->nick+" :dns server "+i->addr.addr()+" rtt "+ConvToStr(i->srtt)+"ms sent "+ConvToStr(i->sent)+
+					" answered "+ConvToStr(i->answered)+(i->downuntil > ServerInstance->Time() ? " (not in use)" : ""));
+			}
 			results.push_back(sn+" 249 "+user->nick+" :connection count "+ConvToStr(ServerInstance->stats->statsConnects));
 			snprintf(buffer,MAXBUF," 249 %s :bytes sent %5.2fK recv %5.2fK",
 				user->nick.c_str(),ServerInstance->stats->statsSent / 1024.0,ServerInstance->stats->statsRecv / 1024.0);
@@ -40,6 +40,10 @@ class CommandWho : public Command
 	bool opt_far;
 	bool opt_time;
 
+	/** The mask being looked for, compiled with each case map it is matched with */
+	CompiledMask nationalmatch;
+	CompiledMask asciimatch;
+
  public:
 	/** Constructor for who.
 	 */
@@ -114,15 +118,15 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 			match = false;
 			const Extensible::ExtensibleStore& list = user->GetExtList();
 			for(Extensible::ExtensibleStore::const_iterator i = list.begin(); i != list.end(); ++i)
-				if (InspIRCd::Match(i->first->name, matchtext))
+				if (nationalmatch.Match(i->first->name))
 					match = true;
 		}
 		else if (opt_realname)
-			match = InspIRCd::Match(user->fullname, matchtext);
+			match = nationalmatch.Match(user->fullname);
 		else if (opt_showrealhost)
-			match = InspIRCd::Match(user->host, matchtext, ascii_case_insensitive_map);
+			match = asciimatch.Match(user->host);
 		else if (opt_ident)
-			match = InspIRCd::Match(user->ident, matchtext, ascii_case_insensitive_map);
+			match = asciimatch.Match(user->ident);
 		else if (opt_port)
 		{
 			irc::portparser portrange(matchtext, false);
@@ -135,7 +139,7 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 				}
 		}
 		else if (opt_away)
-			match = InspIRCd::Match(user->awaymsg, matchtext);
+			match = nationalmatch.Match(user->awaymsg);
 		else if (opt_time)
 		{
 			long seconds = ServerInstance->Duration(matchtext);
@@ -153,14 +157,14 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 		 * -- w00t
 		 */
 		if (!match)
-			match = InspIRCd::Match(user->dhost, matchtext, ascii_case_insensitive_map);
+			match = asciimatch.Match(user->dhost);
 
 		if (!match)
-			match = InspIRCd::Match(user->nick, matchtext);
+			match = nationalmatch.Match(user->nick);
 
 		/* Don't allow server name matches if HideWhoisServer is enabled, unless the command user has the priv */
 		if (!match && (ServerInstance->Config->HideWhoisServer.empty() || cuser->HasPrivPermission("users/auspex")))
-			match = InspIRCd::Match(user->server, matchtext);
+			match = nationalmatch.Match(user->server);
 
 		return match;
 	}
@@ -262,6 +266,9 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 	else
 		strlcpy(matchtext, parameters[0].c_str(), MAXBUF);
 
+	nationalmatch = CompiledMask(matchtext);
+	asciimatch = CompiledMask(matchtext, ascii_case_insensitive_map);
+
 	for (const char* check = matchtext; *check; check++)
 	{
 		if (*check == '*' || *check == '?')
@@ -40,9 +40,15 @@ ServerConfig::ServerConfig()
 	RawLog = NoUserDns = HideBans = HideSplits = UndernetMsgPrefix = false;
 	WildcardIPv6 = CycleHosts = InvBypassModes = true;
 	dns_timeout = 5;
+	DNSCacheSize = 16384;
+	DNSNegativeTTL = 60;
+	DNSHedgeDelay = 0;
 	MaxTargets = 20;
 	NetBufferSize = 10240;
 	SoftLimit = ServerInstance->SE->GetMaxFds();
+	IOThreads = 0;
+	BanCacheSize = 65536;
+	BanCachePrefix6 = 0;
 	MaxConn = SOMAXCONN;
 	MaxChans = 20;
 	OperMaxChans = 30;
@@ -184,20 +190,25 @@ static void FindDNS(std::string& server)
 	ServerInstance->Logs->Log("CONFIG",DEFAULT,"WARNING: <dns:server> not defined, attempting to find working server in /etc/resolv.conf...");
 
 	std::ifstream resolv("/etc/resolv.conf");
+	std::string word;
 
-	while (resolv >> server)
+	/* Use every resolver listed, they are tried in order of how fast they answer */
+	while (resolv >> word)
 	{
-		if (server == "nameserver")
+		if (word == "nameserver")
 		{
-			resolv >> server;
-			if (server.find_first_not_of("0123456789.") == std::string::npos)
-			{
-				ServerInstance->Logs->Log("CONFIG",DEFAULT,"<dns:server> set to '%s' as first resolver in /etc/resolv.conf.",server.c_str());
-				return;
-			}
+			resolv >> word;
+			if (word.find_first_not_of("0123456789.") == std::string::npos)
+				server.append(server.empty() ? "" : " ").append(word);
 		}
 	}
 
+	if (!server.empty())
+	{
+		ServerInstance->Logs->Log("CONFIG",DEFAULT,"<dns:server> set to '%s' from the resolvers in /etc/resolv.conf.",server.c_str());
+		return;
+	}
+
 	ServerInstance->Logs->Log("CONFIG",DEFAULT,"/etc/resolv.conf contains no viable nameserver entries! Defaulting to nameserver '127.0.0.1'!");
 #endif
 	server = "127.0.0.1";
@@ -419,6 +430,7 @@ void ServerConfig::CrossCheckConnectBlocks(ServerConfig* current)
 			me->maxchans = tag->getInt("maxchans", me->maxchans);
 			me->maxconnwarn = tag->getBool("maxconnwarn", me->maxconnwarn);
 			me->limit = tag->getInt("limit", me->limit);
+			me->cork = tag->getBool("cork", me->cork);
 
 			ClassMap::iterator oldMask = oldBlocksByMask.find(typeMask);
 			if (oldMask != oldBlocksByMask.end())
@@ -505,6 +517,9 @@ void ServerConfig::Fill()
 	FixedPart = options->getString("fixedpart");
 	SoftLimit = ConfValue("performance")->getInt("softlimit", ServerInstance->SE->GetMaxFds());
 	MaxConn = ConfValue("performance")->getInt("somaxconn", SOMAXCONN);
+	IOThreads = ConfValue("performance")->getInt("iothreads", 0);
+	BanCacheSize = ConfValue("performance")->getInt("bancachesize", 65536);
+	BanCachePrefix6 = ConfValue("performance")->getInt("bancacheprefix6", 0);
 	MoronBanner = options->getString("moronbanner", "You're banned!");
 	ServerDesc = ConfValue("server")->getString("description", "Configure Me");
 	Network = ConfValue("server")->getString("network", "Network");
@@ -514,6 +529,9 @@ void ServerConfig::Fill()
 	ModPath = ConfValue("path")->getString("moduledir", MOD_PATH);
 	NetBufferSize = ConfValue("performance")->getInt("netbuffersize", 10240);
 	dns_timeout = ConfValue("dns")->getInt("timeout", 5);
+	DNSCacheSize = ConfValue("dns")->getInt("cachesize", 16384);
+	DNSNegativeTTL = ConfValue("dns")->getInt("negativettl", 60);
+	DNSHedgeDelay = ConfValue("dns")->getInt("hedgedelay", 0);
 	DisabledCommands = ConfValue("disabled")->getString("commands", "");
 	DisabledDontExist = ConfValue("disabled")->getBool("fakenonexistant");
 	UserStats = security->getString("userstats");
@@ -555,13 +573,22 @@ void ServerConfig::Fill()
 
 	range(SoftLimit, 10, ServerInstance->SE->GetMaxFds(), ServerInstance->SE->GetMaxFds(), "<performance:softlimit>");
 	range(MaxConn, 0, SOMAXCONN, SOMAXCONN, "<performance:somaxconn>");
+	range(IOThreads, 0, 64, 0, "<performance:iothreads>");
+	range(BanCacheSize, 1, 10000000, 65536, "<performance:bancachesize>");
+	range(BanCachePrefix6, 0, 128, 0, "<performance:bancacheprefix6>");
+	range(DNSCacheSize, 1, 10000000, 16384, "<dns:cachesize>");
+	range(DNSNegativeTTL, 0, 86400, 60, "<dns:negativettl>");
+	range(DNSHedgeDelay, 0, 60000, 0, "<dns:hedgedelay>");
 	range(MaxTargets, 1, 31, 20, "<security:maxtargets>");
 	range(NetBufferSize, 1024, 65534, 10240, "<performance:netbuffersize>");
 	range(WhoWasGroupSize, 0, 10000, 10, "<whowas:groupsize>");
 	range(WhoWasMaxGroups, 0, 1000000, 10240, "<whowas:maxgroups>");
 	range(WhoWasMaxKeep, 3600, INT_MAX, 3600, "<whowas:maxkeep>");
 
-	ValidIP(DNSServer, "<dns:server>");
+	irc::spacesepstream nameservers(DNSServer);
+	std::string nameserver;
+	while (nameservers.GetToken(nameserver))
+		ValidIP(nameserver, "<dns:server>");
 
 	std::string defbind = options->getString("defaultbind");
 	if (assign(defbind) == "ipv4")
@@ -684,6 +711,7 @@ void ServerConfig::Apply(ServerConfig* old, const std::string &useruid)
 		this->ServerName = old->ServerName;
 		this->sid = old->sid;
 		this->cmdline = old->cmdline;
+		this->IOThreads = old->IOThreads;
 	}
 
 	/* The stuff in here may throw CoreException, be sure we're in a position to catch it. */
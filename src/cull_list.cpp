@@ -23,27 +23,18 @@
 #include "inspircd.h"
 #include <typeinfo>
 
-void CullList::Apply()
+/** The number of deferred items Apply() deletes in one main loop iteration
+ */
+static const size_t DEFERRED_SLICE = 1000;
+
+void CullList::Delete(std::vector<classbase*>& items)
 {
-	std::vector<LocalUser *> working;
-	while (!SQlist.empty())
-	{
-		working.swap(SQlist);
-		for(std::vector<LocalUser *>::iterator a = working.begin(); a != working.end(); a++)
-		{
-			LocalUser *u = *a;
-			ServerInstance->SNO->WriteGlobalSno('a', "User %s SendQ exceeds connect class maximum of %lu",
-				u->nick.c_str(), u->MyClass->GetSendqHardMax());
-			ServerInstance->Users->QuitUser(u, "SendQ exceeded");
-		}
-		working.clear();
-	}
 	std::set<classbase*> gone;
 	std::vector<classbase*> queue;
-	queue.reserve(list.size() + 32);
-	for(unsigned int i=0; i < list.size(); i++)
+	queue.reserve(items.size() + 32);
+	for(unsigned int i=0; i < items.size(); i++)
 	{
-		classbase* c = list[i];
+		classbase* c = items[i];
 		if (gone.insert(c).second)
 		{
 			ServerInstance->Logs->Log("CULLLIST", DEBUG, "Deleting %s @%p", typeid(*c).name(),
@@ -56,13 +47,45 @@ void CullList::Apply()
 			ServerInstance->Logs->Log("CULLLIST",DEBUG, "WARNING: Object @%p culled twice!",
 				(void*)c);
 		}
+		/* cull() may add more objects (or the same one again); take them into
+		 * this batch so nothing is culled after it has been deleted
+		 */
+		if (!list.empty())
+		{
+			items.insert(items.end(), list.begin(), list.end());
+			list.clear();
+		}
 	}
-	list.clear();
 	for(unsigned int i=0; i < queue.size(); i++)
 	{
 		classbase* c = queue[i];
 		delete c;
 	}
+}
+
+void CullList::Apply()
+{
+	std::vector<LocalUser *> working;
+	while (!SQlist.empty())
+	{
+		working.swap(SQlist);
+		for(std::vector<LocalUser *>::iterator a = working.begin(); a != working.end(); a++)
+		{
+			LocalUser *u = *a;
+			ServerInstance->SNO->WriteGlobalSno('a', "User %s SendQ exceeds connect class maximum of %lu",
+				u->nick.c_str(), u->MyClass->GetSendqHardMax());
+			ServerInstance->Users->QuitUser(u, "SendQ exceeded");
+		}
+		working.clear();
+	}
+
+	std::vector<classbase*> items;
+	items.swap(list);
+	size_t slice = std::min(deferred.size(), DEFERRED_SLICE);
+	items.insert(items.end(), deferred.begin(), deferred.begin() + slice);
+	deferred.erase(deferred.begin(), deferred.begin() + slice);
+	Delete(items);
+
 	if (list.size())
 	{
 		ServerInstance->Logs->Log("CULLLIST",DEBUG, "WARNING: Objects added to cull list in a destructor");
@@ -70,6 +93,13 @@ void CullList::Apply()
 	}
 }
 
+void CullList::ApplyDeferred()
+{
+	std::vector<classbase*> items(deferred.begin(), deferred.end());
+	deferred.clear();
+	Delete(items);
+}
+
 void ActionList::Run()
 {
 	for(unsigned int i=0; i < list.size(); i++)
@@ -108,20 +108,61 @@ class DNSRequest
 	DNS*            dnsobj;		/* DNS caller (where we get our FD from) */
 	unsigned long	ttl;		/* Time to live */
 	std::string     orig;		/* Original requested name/ip */
+	bool		negative;	/* Failed because the name or record doesn't exist */
+	std::string	packet;		/* The query as sent, to send to another nameserver */
+	/* A nameserver the query was sent to */
+	struct Attempt
+	{
+		irc::sockets::sockaddrs server;
+		timespec sent;
+		bool failed;	/* Already counted as a failure of the nameserver */
+		bool done;	/* Answered, or never sent, so no answer is still to come */
+	};
+	std::vector<Attempt> sentto;	/* Nameservers it was sent to, in order */
 
 	DNSRequest(DNS* dns, int id, const std::string &original);
 	~DNSRequest();
 	DNSInfo ResultIsReady(DNSHeader &h, unsigned length);
 	int SendRequests(const DNSHeader *header, const int length, QueryType qt);
+	bool SendNext();
+	long WaitedFor(const irc::sockets::sockaddrs& server);
+	void CountUnanswered(long minwait);
 };
 
+/* Milliseconds from the given time until the start of this main loop iteration */
+static long MillisSince(const timespec& when)
+{
+	return (ServerInstance->Time() - when.tv_sec) * 1000 + (ServerInstance->Time_ns() - when.tv_nsec) / 1000000;
+}
+
+/* How long to wait for an answer from one nameserver before also sending
+ * the query to the next one, so that with several nameservers each of them
+ * gets a share of <dns:timeout>
+ */
+static long RetryInterval(size_t servers)
+{
+	long timeout = (ServerInstance->Config->dns_timeout ? ServerInstance->Config->dns_timeout : 5) * 1000L;
+	return servers > 1 ? timeout / servers : timeout;
+}
+
+/* Build the key of a query in the DNS cache and the table of pending queries.
+ * A and AAAA lookups of the same name must not find each other's results, so
+ * the type is part of the key.
+ */
+static irc::string CacheKey(const std::string &source, QueryType qt)
+{
+	if (qt == DNS_QUERY_PTR4 || qt == DNS_QUERY_PTR6)
+		qt = DNS_QUERY_PTR;
+	return irc::string((ConvToStr(qt) + " " + source).c_str());
+}
+
 class CacheTimer : public Timer
 {
  private:
 	DNS* dns;
  public:
 	CacheTimer(DNS* thisdns)
-		: Timer(3600, ServerInstance->Time(), true), dns(thisdns) { }
+		: Timer(60, ServerInstance->Time(), true), dns(thisdns) { }
 
 	virtual void Tick(time_t)
 	{
@@ -148,19 +189,21 @@ class RequestTimeout : public Timer
 		if (ServerInstance->Res->requests[watchid] == watch)
 		{
 			/* Still exists, whack it */
-			if (ServerInstance->Res->Classes[watchid])
-			{
-				ServerInstance->Res->Classes[watchid]->OnError(RESOLVER_TIMEOUT, "Request timed out");
-				delete ServerInstance->Res->Classes[watchid];
-				ServerInstance->Res->Classes[watchid] = NULL;
-			}
 			ServerInstance->Res->requests[watchid] = NULL;
+			watch->CountUnanswered(0);
 			delete watch;
+
+			std::vector<Resolver*> waiting = ServerInstance->Res->TakeResolvers(watchid);
+			for (std::vector<Resolver*>::iterator i = waiting.begin(); i != waiting.end(); ++i)
+			{
+				(*i)->OnError(RESOLVER_TIMEOUT, "Request timed out");
+				delete *i;
+			}
 		}
 	}
 };
 
-CachedQuery::CachedQuery(const std::string &res, unsigned int ttl) : data(res)
+CachedQuery::CachedQuery(const std::string &res, unsigned int ttl, bool neg) : data(res), negative(neg)
 {
 	expires = ServerInstance->Time() + ttl;
 }
@@ -180,6 +223,8 @@ DNSRequest::DNSRequest(DNS* dns, int rid, const std::string &original) : dnsobj(
 	res = new unsigned char[sizeof(DNSHeader) * 2];
 	*res = 0;
 	orig = original;
+	type = DNS_QUERY_NONE;
+	negative = false;
 	RequestTimeout* RT = new RequestTimeout(ServerInstance->Config->dns_timeout ? ServerInstance->Config->dns_timeout : 5, this, rid);
 	ServerInstance->Timers->AddTimer(RT); /* The timer manager frees this */
 }
@@ -188,6 +233,11 @@ DNSRequest::DNSRequest(DNS* dns, int rid, const std::string &original) : dnsobj(
 DNSRequest::~DNSRequest()
 {
 	delete[] res;
+
+	/* Later lookups of the same thing can no longer join this request */
+	nspace::hash_map<irc::string, int, irc::hash>::iterator pending = dnsobj->PendingQueries.find(CacheKey(orig, type));
+	if (pending != dnsobj->PendingQueries.end() && pending->second == (id[0] << 8) + id[1])
+		dnsobj->PendingQueries.erase(pending);
 }
 
 /** Fill a ResourceRecord class based on raw data input */
@@ -242,14 +292,75 @@ int DNSRequest::SendRequests(const DNSHeader *header, const int length, QueryTyp
 	this->type = qt;
 
 	DNS::EmptyHeader(payload,header,length);
+	packet.assign((const char*)payload, length + 12);
 
-	if (ServerInstance->SE->SendTo(dnsobj, payload, length + 12, 0, &(dnsobj->myserver.sa), sa_size(dnsobj->myserver)) != length+12)
+	if (!SendNext())
 		return -1;
 
 	ServerInstance->Logs->Log("RESOLVER",DEBUG,"Sent OK");
+	dnsobj->PendingQueries[CacheKey(orig, qt)] = (id[0] << 8) + id[1];
 	return 0;
 }
 
+/** Send the query to the fastest nameserver it hasn't been sent to yet */
+bool DNSRequest::SendNext()
+{
+	DNS::NameServer* ns;
+	while ((ns = dnsobj->PickServer(this)) != NULL)
+	{
+		Attempt attempt;
+		attempt.server = ns->addr;
+		attempt.sent.tv_sec = ServerInstance->Time();
+		attempt.sent.tv_nsec = ServerInstance->Time_ns();
+		attempt.failed = false;
+		attempt.done = false;
+		sentto.push_back(attempt);
+
+		if (ServerInstance->SE->SendTo(dnsobj, packet.data(), packet.length(), 0, &ns->addr.sa, sa_size(ns->addr)) == (int)packet.length())
+		{
+			ns->sent++;
+			/* Send it on to the next nameserver if this one doesn't answer */
+			if (dnsobj->servers.size() > 1)
+				dnsobj->hedgequeue.push_back(std::make_pair((id[0] << 8) + id[1], attempt.sent));
+			return true;
+		}
+
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"Can't send to nameserver %s: %s", ns->addr.str().c_str(), strerror(errno));
+		sentto.back().failed = true;
+		sentto.back().done = true;
+		dnsobj->ServerFailed(ns, 0);
+	}
+	return false;
+}
+
+/** How long the query has been waiting on a nameserver, or -1 if it wasn't sent there */
+long DNSRequest::WaitedFor(const irc::sockets::sockaddrs& server)
+{
+	for (std::vector<Attempt>::iterator i = sentto.begin(); i != sentto.end(); ++i)
+	{
+		if (i->server == server)
+			return std::max(MillisSince(i->sent), 0L);
+	}
+	return -1;
+}
+
+/** Count the nameservers which have left the query unanswered for at least
+ * minwait milliseconds as having failed, each only once
+ */
+void DNSRequest::CountUnanswered(long minwait)
+{
+	for (std::vector<Attempt>::iterator i = sentto.begin(); i != sentto.end(); ++i)
+	{
+		long waited = std::max(MillisSince(i->sent), 0L);
+		if (i->failed || waited < minwait)
+			continue;
+		i->failed = true;
+		DNS::NameServer* ns = dnsobj->FindServer(i->server);
+		if (ns)
+			dnsobj->ServerFailed(ns, waited);
+	}
+}
+
 /** Add a query with a predefined header, and allocate an ID for it. */
 DNSRequest* DNS::AddQuery(DNSHeader *header, int &id, const char* original)
 {
@@ -308,25 +419,146 @@ int DNS::ClearCache()
 	int rv = this->cache->size();
 	delete this->cache;
 	this->cache = new dnscache();
+	cachelru.clear();
+	cacheexpiry.clear();
+	cachenegative = 0;
 	return rv;
 }
 
+void DNS::EraseCache(dnscache::iterator item)
+{
+	if (item->second.negative)
+		cachenegative--;
+	cachelru.erase(item->second.LRUPos);
+	cacheexpiry.erase(std::make_pair(item->second.expires, item->first));
+	cache->erase(item);
+}
+
 int DNS::PruneCache()
 {
 	int n = 0;
-	dnscache* newcache = new dnscache();
-	for (dnscache::iterator i = this->cache->begin(); i != this->cache->end(); i++)
-		/* Dont include expired items (theres no point) */
-		if (i->second.CalcTTLRemaining())
-			newcache->insert(*i);
-		else
-			n++;
 
-	delete this->cache;
-	this->cache = newcache;
+	/* Expired items are at the front of the expiry queue */
+	while (!cacheexpiry.empty() && cacheexpiry.begin()->first <= ServerInstance->Time())
+	{
+		dnscache::iterator x = cache->find(cacheexpiry.begin()->second);
+		if (x == cache->end())
+		{
+			cacheexpiry.erase(cacheexpiry.begin());
+			continue;
+		}
+		EraseCache(x);
+		n++;
+	}
+
+	/* The cache may have been made smaller on rehash */
+	while (cache->size() > ServerInstance->Config->DNSCacheSize && !cachelru.empty())
+	{
+		dnscache::iterator x = cache->find(cachelru.back());
+		if (x == cache->end())
+		{
+			cachelru.pop_back();
+			continue;
+		}
+		EraseCache(x);
+		CacheEvictions++;
+		n++;
+	}
+
 	return n;
 }
 
+DNS::NameServer* DNS::FindServer(const irc::sockets::sockaddrs& addr)
+{
+	for (std::vector<NameServer>::iterator i = servers.begin(); i != servers.end(); ++i)
+	{
+		if (i->addr == addr)
+			return &*i;
+	}
+	return NULL;
+}
+
+/* Whether nameserver a should be used in preference to b */
+static bool PreferServer(const DNS::NameServer& a, const DNS::NameServer& b)
+{
+	time_t now = ServerInstance->Time();
+	bool adown = (a.downuntil > now);
+	bool bdown = (b.downuntil > now);
+	if (adown != bdown)
+		return bdown;
+	/* If they're all failing, use the one which was put out of use first */
+	if (adown)
+		return a.downuntil < b.downuntil;
+	/* Then avoid the ones which didn't answer last time */
+	if (a.failures != b.failures)
+		return a.failures < b.failures;
+	/* Servers which haven't answered yet come after those which have, in the
+	 * order they were configured, so that the first one is used to begin with
+	 */
+	if (!a.srtt || !b.srtt)
+		return a.srtt && !b.srtt;
+	return a.srtt < b.srtt;
+}
+
+DNS::NameServer* DNS::PickServer(DNSRequest* request)
+{
+	NameServer* best = NULL;
+	for (std::vector<NameServer>::iterator i = servers.begin(); i != servers.end(); ++i)
+	{
+		if (request->WaitedFor(i->addr) != -1)
+			continue;
+		if (!best || PreferServer(*i, *best))
+			best = &*i;
+	}
+	return best;
+}
+
+void DNS::ServerFailed(NameServer* ns, unsigned long waited)
+{
+	/* It takes at least this long to answer, if it answers at all */
+	if (ns->srtt && waited > ns->srtt)
+		ns->srtt = waited;
+
+	if (++ns->failures >= 3)
+	{
+		ServerInstance->Logs->Log("RESOLVER",DEFAULT,"Nameserver %s failed to answer %u queries in a row, not using it for 30 seconds",
+			ns->addr.str().c_str(), ns->failures);
+		ns->downuntil = ServerInstance->Time() + 30;
+		/* Measure it again when it is back in use */
+		ns->failures = 0;
+		ns->srtt = 0;
+	}
+}
+
+void DNS::CheckHedges()
+{
+	long retry = RetryInterval(servers.size());
+	long delay = retry;
+	if (ServerInstance->Config->DNSHedgeDelay && (long)ServerInstance->Config->DNSHedgeDelay < delay)
+		delay = ServerInstance->Config->DNSHedgeDelay;
+
+	while (!hedgequeue.empty() && MillisSince(hedgequeue.front().second) >= delay)
+	{
+		std::pair<int, timespec> item = hedgequeue.front();
+		hedgequeue.pop_front();
+
+		/* Skip requests which have been answered, or already sent again */
+		DNSRequest* req = requests[item.first];
+		if (!req || req->sentto.empty() || req->sentto.back().sent.tv_sec != item.second.tv_sec || req->sentto.back().sent.tv_nsec != item.second.tv_nsec)
+			continue;
+
+		/* A query left unanswered for a nameserver's whole share of the
+		 * timeout counts against it now, so that a dead nameserver is put
+		 * out of use while the queries sent to it are still in flight
+		 */
+		req->CountUnanswered(retry);
+
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"No answer to request %d from %s after %ldms, also sending it to another nameserver",
+			item.first, req->sentto.back().server.str().c_str(), MillisSince(item.second));
+		req->SendNext();
+	}
+}
+
 void DNS::Rehash()
 {
 	if (this->GetFd() > -1)
@@ -335,20 +567,52 @@ void DNS::Rehash()
 		ServerInstance->SE->Shutdown(this, 2);
 		ServerInstance->SE->Close(this);
 		this->SetFd(-1);
-
-		/* Rehash the cache */
-		this->PruneCache();
 	}
+
+	/* The socket may have been left closed by an earlier rehash, so the
+	 * cache is only created once and pruned on every later rehash
+	 */
+	if (!this->cache)
+		this->cache = new dnscache();
 	else
+		this->PruneCache();
+
+	/* Keep what we know about the nameservers which are still configured */
+	std::vector<NameServer> oldservers;
+	oldservers.swap(servers);
+
+	irc::spacesepstream nameservers(ServerInstance->Config->DNSServer);
+	std::string nameserver;
+	while (nameservers.GetToken(nameserver))
 	{
-		/* Create initial dns cache */
-		this->cache = new dnscache();
+		irc::sockets::sockaddrs addr;
+		if (!irc::sockets::aptosa(nameserver, DNS::QUERY_PORT, addr) || FindServer(addr))
+			continue;
+
+		/* All queries go out of one socket */
+		if (!servers.empty() && addr.sa.sa_family != servers[0].addr.sa.sa_family)
+		{
+			ServerInstance->Logs->Log("RESOLVER",DEFAULT,"Not using nameserver %s, it is not the same address family as %s",
+				nameserver.c_str(), servers[0].addr.addr().c_str());
+			continue;
+		}
+
+		servers.push_back(NameServer(addr));
+		for (std::vector<NameServer>::iterator i = oldservers.begin(); i != oldservers.end(); ++i)
+		{
+			if (i->addr == addr)
+				servers.back() = *i;
+		}
 	}
 
-	irc::sockets::aptosa(ServerInstance->Config->DNSServer, DNS::QUERY_PORT, myserver);
+	if (servers.empty())
+	{
+		ServerInstance->Logs->Log("RESOLVER",SPARSE,"No usable nameservers - hostnames will NOT resolve");
+		return;
+	}
 
 	/* Initialize mastersocket */
-	int s = socket(myserver.sa.sa_family, SOCK_DGRAM, 0);
+	int s = socket(servers[0].addr.sa.sa_family, SOCK_DGRAM, 0);
 	this->SetFd(s);
 
 	/* Have we got a socket and is it nonblocking? */
@@ -358,7 +622,7 @@ void DNS::Rehash()
 		ServerInstance->SE->NonBlocking(s);
 		irc::sockets::sockaddrs bindto;
 		memset(&bindto, 0, sizeof(bindto));
-		bindto.sa.sa_family = myserver.sa.sa_family;
+		bindto.sa.sa_family = servers[0].addr.sa.sa_family;
 		if (ServerInstance->SE->Bind(this->GetFd(), bindto) < 0)
 		{
 			/* Failed to bind */
@@ -394,6 +658,8 @@ DNS::DNS()
 	/* DNS::Rehash() sets this to a valid ptr
 	 */
 	this->cache = NULL;
+	cachenegative = 0;
+	CacheHits = CacheMisses = CacheEvictions = 0;
 
 	/* Again, DNS::Rehash() sets this to a
 	 * valid value
@@ -601,8 +867,26 @@ DNSResult DNS::GetResult()
 		return DNSResult(-1,"",0,"");
 	}
 
+	/* Put the read header info into a header class */
+	DNS::FillHeader(&header,buffer,length - 12);
+
+	/* Get the id of this request.
+	 * Its a 16 bit value stored in two char's,
+	 * so we use logic shifts to create the value.
+	 */
+	unsigned long this_id = header.id[1] + (header.id[0] << 8);
+
+	/* Do we have a pending request matching this id? */
+	if (!requests[this_id])
+	{
+		/* Somehow we got a DNS response for a request we never made... */
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"Hmm, got a result that we didn't ask for (id=%lx). Ignoring.", this_id);
+		return DNSResult(-1,"",0,"");
+	}
+	req = requests[this_id];
+
 	/* Check wether the reply came from a different DNS
-	 * server to the one we sent it to, or the source-port
+	 * server to the ones we sent it to, or the source-port
 	 * is not 53.
 	 * A user could in theory still spoof dns packets anyway
 	 * but this is less trivial than just sending garbage
@@ -610,38 +894,70 @@ DNSResult DNS::GetResult()
 	 *
 	 * -- Thanks jilles for pointing this one out.
 	 */
-	if (from != myserver)
+	long rtt = req->WaitedFor(from);
+	NameServer* ns = FindServer(from);
+	if (rtt == -1 || !ns)
 	{
 		std::string server1 = from.str();
-		std::string server2 = myserver.str();
-		ServerInstance->Logs->Log("RESOLVER",DEBUG,"Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s' != '%s'",
-			server1.c_str(), server2.c_str());
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s' was not asked for id %lx",
+			server1.c_str(), this_id);
 		return DNSResult(-1,"",0,"");
 	}
 
-	/* Put the read header info into a header class */
-	DNS::FillHeader(&header,buffer,length - 12);
+	ns->answered++;
+	ns->srtt = ns->srtt ? (ns->srtt * 7 + rtt) / 8 : rtt;
+	if (!ns->srtt)
+		ns->srtt = 1;
 
-	/* Get the id of this request.
-	 * Its a 16 bit value stored in two char's,
-	 * so we use logic shifts to create the value.
-	 */
-	unsigned long this_id = header.id[1] + (header.id[0] << 8);
+	/* The other nameservers it was sent to are slower, this time at least */
+	for (std::vector<DNSRequest::Attempt>::iterator i = req->sentto.begin(); i != req->sentto.end(); ++i)
+	{
+		NameServer* other = FindServer(i->server);
+		long waited = MillisSince(i->sent);
+		if (other && other != ns && other->srtt && waited > (long)other->srtt)
+			other->srtt = waited;
+	}
 
-	/* Do we have a pending request matching this id? */
-	if (!requests[this_id])
+	/* A server failure or refusal says nothing about the name, so ask another nameserver */
+	unsigned int rcode = header.flags2 & FLAGS_MASK_RCODE;
+	if (rcode == 2 || rcode == 5)
 	{
-		/* Somehow we got a DNS response for a request we never made... */
-		ServerInstance->Logs->Log("RESOLVER",DEBUG,"Hmm, got a result that we didn't ask for (id=%lx). Ignoring.", this_id);
-		return DNSResult(-1,"",0,"");
+		for (std::vector<DNSRequest::Attempt>::iterator i = req->sentto.begin(); i != req->sentto.end(); ++i)
+		{
+			if (i->server != from)
+				continue;
+			i->done = true;
+			if (!i->failed)
+			{
+				i->failed = true;
+				ServerFailed(ns, 0);
+			}
+		}
+		if (req->SendNext())
+			return DNSResult(-1,"",0,"");
+
+		/* A nameserver it was sent to earlier may still answer; if none
+		 * does, the request times out
+		 */
+		for (std::vector<DNSRequest::Attempt>::iterator i = req->sentto.begin(); i != req->sentto.end(); ++i)
+		{
+			if (!i->done)
+			{
+				ServerInstance->Logs->Log("RESOLVER",DEBUG,"Nameserver %s could not answer request %lx, still waiting for %s",
+					from.str().c_str(), this_id, i->server.str().c_str());
+				return DNSResult(-1,"",0,"");
+			}
+		}
 	}
 	else
 	{
-		/* Remove the query from the list of pending queries */
-		req = requests[this_id];
-		requests[this_id] = NULL;
+		ns->failures = 0;
+		ns->downuntil = 0;
 	}
 
+	/* Remove the query from the list of pending queries */
+	requests[this_id] = NULL;
+
 	/* Inform the DNSRequest class that it has a result to be read.
 	 * When its finished it will return a DNSInfo which is a pair of
 	 * unsigned char* resource record data, and an error message.
@@ -659,6 +975,11 @@ DNSResult DNS::GetResult()
 		 * Put the error message in the second field.
 		 */
 		std::string ro = req->orig;
+		/* Remember that the name doesn't exist, so that a flood of
+		 * connections from the same address doesn't look it up again
+		 */
+		if (req->negative && ServerInstance->Config->DNSNegativeTTL)
+			this->AddCache(ro, req->type, CachedQuery(data.second, ServerInstance->Config->DNSNegativeTTL, true));
 		delete req;
 		return DNSResult(this_id | ERROR_MASK, data.second, 0, ro);
 	}
@@ -716,6 +1037,8 @@ DNSResult DNS::GetResult()
 
 		/* Build the reply with the id and hostname/ip in it */
 		std::string ro = req->orig;
+		if (ttl)
+			this->AddCache(ro, req->type, CachedQuery(resultstr, ttl));
 		delete req;
 		return DNSResult(this_id,resultstr,ttl,ro);
 	}
@@ -743,10 +1066,17 @@ DNSInfo DNSRequest::ResultIsReady(DNSHeader &header, unsigned length)
 		return std::make_pair((unsigned char*)NULL,"Unexpected value in DNS reply packet");
 
 	if (header.flags2 & FLAGS_MASK_RCODE)
+	{
+		/* Only NXDOMAIN says anything about the name; other errors such as SERVFAIL may be transient */
+		negative = ((header.flags2 & FLAGS_MASK_RCODE) == 3);
 		return std::make_pair((unsigned char*)NULL,"Domain name not found");
+	}
 
 	if (header.ancount < 1)
+	{
+		negative = true;
 		return std::make_pair((unsigned char*)NULL,"No resource records returned");
+	}
 
 	/* Subtract the length of the header from the length of the packet */
 	length -= 12;
@@ -812,7 +1142,10 @@ DNSInfo DNSRequest::ResultIsReady(DNSHeader &header, unsigned length)
 		break;
 	}
 	if ((unsigned int)curanswer == header.ancount)
+	{
+		negative = true;
 		return std::make_pair((unsigned char*)NULL,"No A, AAAA or PTR type answers (" + ConvToStr(header.ancount) + " answers)");
+	}
 
 	if (i + rr.rdlength > (unsigned int)length)
 		return std::make_pair((unsigned char*)NULL,"Resource record larger than stated");
@@ -911,23 +1244,64 @@ DNS::~DNS()
 		delete cache;
 }
 
-CachedQuery* DNS::GetCache(const std::string &source)
+CachedQuery* DNS::GetCache(const std::string &source, QueryType qt)
 {
-	dnscache::iterator x = cache->find(source.c_str());
-	if (x != cache->end())
-		return &(x->second);
-	else
+	dnscache::iterator x = cache->find(CacheKey(source, qt));
+	if (x == cache->end())
 		return NULL;
+
+	cachelru.splice(cachelru.begin(), cachelru, x->second.LRUPos);
+	return &(x->second);
+}
+
+void DNS::AddCache(const std::string &source, QueryType qt, const CachedQuery& item)
+{
+	irc::string key = CacheKey(source, qt);
+	dnscache::iterator old = cache->find(key);
+	if (old != cache->end())
+		EraseCache(old);
+
+	cachelru.push_front(key);
+	CachedQuery& entry = cache->insert(std::make_pair(key, item)).first->second;
+	entry.LRUPos = cachelru.begin();
+	cacheexpiry.insert(std::make_pair(entry.expires, key));
+	if (entry.negative)
+		cachenegative++;
+
+	while (cache->size() > ServerInstance->Config->DNSCacheSize && !cachelru.empty())
+	{
+		dnscache::iterator x = cache->find(cachelru.back());
+		if (x == cache->end())
+		{
+			cachelru.pop_back();
+			continue;
+		}
+		EraseCache(x);
+		CacheEvictions++;
+	}
+}
+
+void DNS::DelCache(const std::string &source, QueryType qt)
+{
+	dnscache::iterator x = cache->find(CacheKey(source, qt));
+	if (x != cache->end())
+		EraseCache(x);
 }
 
-void DNS::DelCache(const std::string &source)
+size_t DNS::CacheSize(size_t& negative)
 {
-	cache->erase(source.c_str());
+	negative = cachenegative;
+	return cache->size();
 }
 
 void Resolver::TriggerCachedResult()
 {
-	if (CQ)
+	if (!CQ)
+		return;
+
+	if (CQ->negative)
+		OnError(RESOLVER_NXDOMAIN, CQ->data);
+	else
 		OnLookupComplete(CQ->data, time_left, true);
 }
 
@@ -937,20 +1311,33 @@ Resolver::Resolver(const std::string &source, QueryType qt, bool &cached, Module
 	ServerInstance->Logs->Log("RESOLVER",DEBUG,"Resolver::Resolver");
 	cached = false;
 
-	CQ = ServerInstance->Res->GetCache(source);
+	CQ = ServerInstance->Res->GetCache(source, querytype);
 	if (CQ)
 	{
 		time_left = CQ->CalcTTLRemaining();
 		if (!time_left)
 		{
-			ServerInstance->Res->DelCache(source);
+			ServerInstance->Res->DelCache(source, querytype);
+			CQ = NULL;
 		}
 		else
 		{
+			ServerInstance->Res->CacheHits++;
 			cached = true;
 			return;
 		}
 	}
+	ServerInstance->Res->CacheMisses++;
+
+	/* If the same lookup is already in flight, wait for its answer instead of asking again */
+	this->myid = ServerInstance->Res->FindPending(source, querytype);
+	if (this->myid != -1)
+	{
+		if (querytype == DNS_QUERY_PTR4 || querytype == DNS_QUERY_PTR6)
+			querytype = DNS_QUERY_PTR;
+		ServerInstance->Logs->Log("RESOLVER",DEBUG,"DNS request for %s joins request id %d", source.c_str(), this->myid);
+		return;
+	}
 
 	switch (querytype)
 	{
@@ -1034,31 +1421,27 @@ void DNS::HandleEvent(EventType, int)
 		{
 			/* Mask off the error bit */
 			res.id -= ERROR_MASK;
-			/* Marshall the error to the correct class */
-			if (Classes[res.id])
+			/* Marshall the error to the correct classes */
+			std::vector<Resolver*> waiting = TakeResolvers(res.id);
+			if (!waiting.empty() && ServerInstance && ServerInstance->stats)
+				ServerInstance->stats->statsDnsBad++;
+			for (std::vector<Resolver*>::iterator i = waiting.begin(); i != waiting.end(); ++i)
 			{
-				if (ServerInstance && ServerInstance->stats)
-					ServerInstance->stats->statsDnsBad++;
-				Classes[res.id]->OnError(RESOLVER_NXDOMAIN, res.result);
-				delete Classes[res.id];
-				Classes[res.id] = NULL;
+				(*i)->OnError(RESOLVER_NXDOMAIN, res.result);
+				delete *i;
 			}
 			return;
 		}
 		else
 		{
-			/* It is a non-error result, marshall the result to the correct class */
-			if (Classes[res.id])
+			/* It is a non-error result, marshall the result to the correct classes */
+			std::vector<Resolver*> waiting = TakeResolvers(res.id);
+			if (!waiting.empty() && ServerInstance && ServerInstance->stats)
+				ServerInstance->stats->statsDnsGood++;
+			for (std::vector<Resolver*>::iterator i = waiting.begin(); i != waiting.end(); ++i)
 			{
-				if (ServerInstance && ServerInstance->stats)
-					ServerInstance->stats->statsDnsGood++;
-
-				if (!this->GetCache(res.original.c_str()))
-					this->cache->insert(std::make_pair(res.original.c_str(), CachedQuery(res.result, res.ttl)));
-
-				Classes[res.id]->OnLookupComplete(res.result, res.ttl, false);
-				delete Classes[res.id];
-				Classes[res.id] = NULL;
+				(*i)->OnLookupComplete(res.result, res.ttl, false);
+				delete *i;
 			}
 		}
 
@@ -1084,6 +1467,15 @@ bool DNS::AddResolverClass(Resolver* r)
 			Classes[r->GetId()] = r;
 			return true;
 		}
+
+		/* A request which is still in flight can only have been given to
+		 * another Resolver because it is looking up the same thing.
+		 */
+		if (requests[r->GetId()] && Classes[r->GetId()] != r)
+		{
+			Coalesced[r->GetId()].push_back(r);
+			return true;
+		}
 	}
 
 	/* Pointer or id not valid, or duplicate id.
@@ -1093,6 +1485,32 @@ bool DNS::AddResolverClass(Resolver* r)
 	return false;
 }
 
+int DNS::FindPending(const std::string &source, QueryType qt)
+{
+	nspace::hash_map<irc::string, int, irc::hash>::iterator pending = PendingQueries.find(CacheKey(source, qt));
+	if (pending == PendingQueries.end())
+		return -1;
+	return pending->second;
+}
+
+std::vector<Resolver*> DNS::TakeResolvers(int id)
+{
+	std::vector<Resolver*> waiting;
+	if (Classes[id])
+	{
+		waiting.push_back(Classes[id]);
+		Classes[id] = NULL;
+	}
+
+	std::map<int, std::vector<Resolver*> >::iterator joined = Coalesced.find(id);
+	if (joined != Coalesced.end())
+	{
+		waiting.insert(waiting.end(), joined->second.begin(), joined->second.end());
+		Coalesced.erase(joined);
+	}
+	return waiting;
+}
+
 void DNS::CleanResolvers(Module* module)
 {
 	for (int i = 0; i < MAX_REQUEST_ID; i++)
@@ -1107,4 +1525,25 @@ void DNS::CleanResolvers(Module* module)
 			}
 		}
 	}
+
+	for (std::map<int, std::vector<Resolver*> >::iterator i = Coalesced.begin(); i != Coalesced.end(); )
+	{
+		std::vector<Resolver*>& waiting = i->second;
+		for (std::vector<Resolver*>::iterator r = waiting.begin(); r != waiting.end(); )
+		{
+			if ((*r)->GetCreator() == module)
+			{
+				(*r)->OnError(RESOLVER_FORCEUNLOAD, "Parent module is unloading");
+				delete *r;
+				r = waiting.erase(r);
+			}
+			else
+				++r;
+		}
+
+		if (waiting.empty())
+			Coalesced.erase(i++);
+		else
+			++i;
+	}
 }
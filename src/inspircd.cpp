@@ -72,6 +72,7 @@ int* mysig = NULL;
  * e.g. for national character support.
  */
 unsigned const char *national_case_insensitive_map = rfc_case_insensitive_map;
+unsigned int national_case_insensitive_generation = 0;
 
 
 /* Moved from exitcodes.h -- due to duplicate symbols -- Burlex
@@ -127,6 +128,7 @@ void InspIRCd::Cleanup()
 	}
 
 	GlobalCulls.Apply();
+	DeleteZero(this->IOThreads);
 	Modules->UnloadAll();
 
 	/* Delete objects dynamically allocated in constructor (destructor would be more appropriate, but we're likely exiting) */
@@ -341,6 +343,7 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	// Initialize so that if we exit before proper initialization they're not deleted
 	this->Logs = 0;
 	this->Threads = 0;
+	this->IOThreads = 0;
 	this->PI = 0;
 	this->Users = 0;
 	this->chanlist = 0;
@@ -554,6 +557,19 @@ InspIRCd::InspIRCd(int argc, char** argv) :
 	this->Config->Apply(NULL, "");
 	Logs->OpenFileLogs();
 
+	if (Config->IOThreads)
+	{
+		try
+		{
+			this->IOThreads = new IOThreadPool(Config->IOThreads);
+		}
+		catch (CoreException& ex)
+		{
+			std::cout << "WARNING: Not using I/O threads: " << ex.GetReason() << std::endl;
+			Logs->Log("STARTUP", DEFAULT, "Not using I/O threads: %s", ex.GetReason());
+		}
+	}
+
 	this->Res = new DNS();
 
 	/*
@@ -825,6 +841,7 @@ int InspIRCd::Run()
 			}
 
 			Timers->TickTimers(TIME.tv_sec);
+			this->XLines->ExpireLines();
 			this->DoBackgroundUserStuff();
 
 			if ((TIME.tv_sec % 5) == 0)
@@ -834,6 +851,15 @@ int InspIRCd::Run()
 			}
 		}
 
+		/* Send queries which a slow nameserver hasn't answered to another one */
+		this->Res->CheckHedges();
+
+		/* Check some more users against any new lines which are still being
+		 * applied, and don't let the socket engine wait for events until that
+		 * and deleting the users of a netsplit is done.
+		 */
+		this->SE->NoWait = this->XLines->ContinueApplying() || this->GlobalCulls.HasDeferred();
+
 		/* Call the socket engine to wait on the active
 		 * file descriptors. The socket engine has everything's
 		 * descriptors in its list... dns, modules, users,
@@ -841,8 +867,13 @@ int InspIRCd::Run()
 		 * This will cause any read or write events to be
 		 * dispatched to their handlers.
 		 */
+		if (this->IOThreads)
+			this->IOThreads->Flush();
 		this->SE->DispatchTrialWrites();
+		this->SE->FlushCorked();
 		this->SE->DispatchEvents();
+		/* write out everything queued for corked sockets while handling those events */
+		this->SE->FlushCorked();
 
 		/* if any users were quit, take them out */
 		GlobalCulls.Apply();
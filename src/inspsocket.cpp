@@ -142,6 +142,45 @@ void StreamSocket::Close()
 	}
 }
 
+bool StreamSocket::EngineIO()
+{
+	return !IOHook;
+}
+
+bool StreamSocket::SendDone(size_t sent, bool finished)
+{
+	ConsumeSendQ(sent);
+	sendq_sending = finished ? 0 : sendq_sending - sent;
+	if (!finished)
+		return false;
+	if (!sendq.empty())
+		return true;
+	ServerInstance->SE->ChangeEventMask(this, FD_WANT_EDGE_WRITE);
+	return false;
+}
+
+void StreamSocket::ConsumeSendQ(size_t length)
+{
+	sendq_len -= length;
+	while (length > 0 && !sendq.empty())
+	{
+		size_t left = sendq.front()->data.length() - sendq_pos;
+		if (left <= length)
+		{
+			// this segment got fully written out
+			length -= left;
+			sendq_pos = 0;
+			sendq.pop_front();
+		}
+		else
+		{
+			// stopped in the middle of this segment
+			sendq_pos += length;
+			length = 0;
+		}
+	}
+}
+
 CullResult StreamSocket::cull()
 {
 	Close();
@@ -150,12 +189,18 @@ CullResult StreamSocket::cull()
 
 bool StreamSocket::GetNextLine(std::string& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
-	if (i == std::string::npos)
+	if (recvq_pos > recvq.length())
+		recvq_pos = 0;
+	const char* start = recvq.data() + recvq_pos;
+	const char* end = static_cast<const char*>(memchr(start, delim, recvq.length() - recvq_pos));
+	if (!end)
+	{
+		// No complete line left, so callers see only unprocessed data in recvq
+		CompactRecvQ();
 		return false;
-	line = recvq.substr(0, i);
-	// TODO is this the most efficient way to split?
-	recvq = recvq.substr(i + 1);
+	}
+	line.assign(start, end - start);
+	ConsumeRecvQ(end - start + 1);
 	return true;
 }
 
@@ -164,6 +209,7 @@ void StreamSocket::DoRead()
 	if (IOHook)
 	{
 		int rv = -1;
+		CompactRecvQ();
 		try
 		{
 			rv = IOHook->OnStreamSocketRead(this, recvq);
@@ -183,6 +229,8 @@ void StreamSocket::DoRead()
 	{
 		char* ReadBuffer = ServerInstance->GetReadBuffer();
 		int n = ServerInstance->SE->Recv(this, ReadBuffer, ServerInstance->Config->NetBufferSize, 0);
+		if (n > 0)
+			CompactRecvQ();
 		if (n == ServerInstance->Config->NetBufferSize)
 		{
 			ServerInstance->SE->ChangeEventMask(this, FD_WANT_FAST_READ | FD_ADD_TRIAL_READ);
@@ -219,6 +267,9 @@ void StreamSocket::DoRead()
 /* Don't try to prepare huge blobs of data to send to a blocked socket */
 static const int MYIOV_MAX = IOV_MAX < 128 ? IOV_MAX : 128;
 
+/* Unshared writes smaller than this are appended to the last sendq segment */
+static const size_t SENDQ_MERGE_MAX = 4096;
+
 void StreamSocket::DoWrite()
 {
 	if (sendq.empty())
@@ -228,6 +279,9 @@ void StreamSocket::DoWrite()
 		ServerInstance->Logs->Log("SOCKET", DEBUG, "DoWrite on errored or closed socket");
 		return;
 	}
+	// anything written now would overtake what the socket engine is still sending
+	if (sendq_sending)
+		return;
 
 #ifndef DISABLE_WRITEV
 	if (IOHook)
@@ -238,7 +292,7 @@ void StreamSocket::DoWrite()
 		{
 			while (error.empty() && !sendq.empty())
 			{
-				if (sendq.size() > 1 && sendq[0].length() < 1024)
+				if (sendq.size() > 1 && sendq[0]->data.length() - sendq_pos < 1024)
 				{
 					// Avoid multiple repeated SSL encryption invocations
 					// This adds a single copy of the queue, but avoids
@@ -247,17 +301,25 @@ void StreamSocket::DoWrite()
 					//
 					// The length limit of 1024 is to prevent merging strings
 					// more than once when writes begin to block.
-					std::string tmp;
-					tmp.reserve(sendq_len);
-					for(unsigned int i=0; i < sendq.size(); i++)
-						tmp.append(sendq[i]);
+					SendQueueSegment* tmp = new SendQueueSegment;
+					tmp->data.reserve(sendq_len);
+					tmp->data.append(sendq[0]->data, sendq_pos, std::string::npos);
+					for(unsigned int i=1; i < sendq.size(); i++)
+						tmp->data.append(sendq[i]->data);
 					sendq.clear();
 					sendq.push_back(tmp);
+					sendq_pos = 0;
 				}
-				std::string& front = sendq.front();
-				int itemlen = front.length();
 				if (IOHook)
 				{
+					if (sendq_pos || sendq.front()->GetReferenceCount() > 1)
+					{
+						// The IOHook may modify the string it is given, so it must not be shared
+						sendq.front() = new SendQueueSegment(sendq.front()->data.substr(sendq_pos));
+						sendq_pos = 0;
+					}
+					std::string& front = sendq.front()->data;
+					int itemlen = front.length();
 					rv = IOHook->OnStreamSocketWrite(this, front);
 					if (rv > 0)
 					{
@@ -283,7 +345,9 @@ void StreamSocket::DoWrite()
 #ifdef DISABLE_WRITEV
 				else
 				{
-					rv = ServerInstance->SE->Send(this, front.data(), itemlen, 0);
+					const std::string& front = sendq.front()->data;
+					int itemlen = front.length() - sendq_pos;
+					rv = ServerInstance->SE->Send(this, front.data() + sendq_pos, itemlen, 0);
 					if (rv == 0)
 					{
 						SetError("Connection closed");
@@ -300,13 +364,14 @@ void StreamSocket::DoWrite()
 					else if (rv < itemlen)
 					{
 						ServerInstance->SE->ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
-						front = front.substr(rv);
+						sendq_pos += rv;
 						sendq_len -= rv;
 						return;
 					}
 					else
 					{
 						sendq_len -= itemlen;
+						sendq_pos = 0;
 						sendq.pop_front();
 						if (sendq.empty())
 							ServerInstance->SE->ChangeEventMask(this, FD_WANT_EDGE_WRITE);
@@ -327,6 +392,13 @@ void StreamSocket::DoWrite()
 		// don't even try if we are known to be blocking
 		if (GetEventMask() & FD_WRITE_WILL_BLOCK)
 			return;
+		if (EngineIO())
+		{
+			// The sendq is consumed once the kernel has taken the data, see SendDone()
+			sendq_sending = ServerInstance->SE->SendSegments(this, sendq, sendq_pos);
+			if (sendq_sending)
+				return;
+		}
 		// start out optimistic - we won't need to write any more
 		int eventChange = FD_WANT_EDGE_WRITE;
 		while (error.empty() && sendq_len && eventChange == FD_WANT_EDGE_WRITE)
@@ -341,21 +413,24 @@ void StreamSocket::DoWrite()
 			}
 
 			int rv_max = 0;
-			iovec* iovecs = new iovec[bufcount];
+			iovec iovecs[MYIOV_MAX];
 			for(int i=0; i < bufcount; i++)
 			{
-				iovecs[i].iov_base = const_cast<char*>(sendq[i].data());
-				iovecs[i].iov_len = sendq[i].length();
-				rv_max += sendq[i].length();
+				// Segments may be shared with other sockets, so write straight out of them
+				const std::string& data = sendq[i]->data;
+				size_t skip = i ? 0 : sendq_pos;
+				iovecs[i].iov_base = const_cast<char*>(data.data() + skip);
+				iovecs[i].iov_len = data.length() - skip;
+				rv_max += iovecs[i].iov_len;
 			}
 			int rv = writev(fd, iovecs, bufcount);
-			delete[] iovecs;
 
 			if (rv == (int)sendq_len)
 			{
 				// it's our lucky day, everything got written out. Fast cleanup.
 				// This won't ever happen if the number of buffers got capped.
 				sendq_len = 0;
+				sendq_pos = 0;
 				sendq.clear();
 			}
 			else if (rv > 0)
@@ -366,23 +441,7 @@ void StreamSocket::DoWrite()
 					// it's going to block now
 					eventChange = FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK;
 				}
-				sendq_len -= rv;
-				while (rv > 0 && !sendq.empty())
-				{
-					std::string& front = sendq.front();
-					if (front.length() <= (size_t)rv)
-					{
-						// this string got fully written out
-						rv -= front.length();
-						sendq.pop_front();
-					}
-					else
-					{
-						// stopped in the middle of this string
-						front = front.substr(rv);
-						rv = 0;
-					}
-				}
+				ConsumeSendQ(rv);
 			}
 			else if (rv == 0)
 			{
@@ -424,11 +483,33 @@ void StreamSocket::WriteData(const std::string &data)
 		return;
 	}
 
-	/* Append the data to the back of the queue ready for writing */
-	sendq.push_back(data);
+	/* Append the data to the back of the queue ready for writing. Small writes
+	 * are merged into the last segment, unless it is shared with other sockets.
+	 */
+	if (!sendq.empty() && sendq.back()->GetReferenceCount() == 1 && sendq.back()->data.length() + data.length() <= SENDQ_MERGE_MAX)
+		sendq.back()->data.append(data);
+	else
+		sendq.push_back(new SendQueueSegment(data));
 	sendq_len += data.length();
 
-	ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+	if (!IsCorked() || !ServerInstance->SE->CorkWrite(this))
+		ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
+void StreamSocket::WriteData(const reference<SendQueueSegment>& segment)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", DEBUG, "Attempt to write data to dead socket: %s",
+			segment->data.c_str());
+		return;
+	}
+
+	sendq.push_back(segment);
+	sendq_len += segment->data.length();
+
+	if (!IsCorked() || !ServerInstance->SE->CorkWrite(this))
+		ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
 
 void SocketTimeout::Tick(time_t)
@@ -521,7 +602,12 @@ void StreamSocket::HandleEvent(EventType et, int errornum)
 			}
 			case EVENT_WRITE:
 			{
-				DoWrite();
+				/* A corked socket does not write as soon as it becomes
+				 * writable; anything queued later in this iteration is
+				 * sent along with it when the corked output is flushed.
+				 */
+				if (!IsCorked() || !ServerInstance->SE->CorkWrite(this, true))
+					DoWrite();
 				break;
 			}
 		}
@@ -0,0 +1,686 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* $Core */
+
+#include "inspircd.h"
+#include "iothreads.h"
+
+#ifdef HAS_EPOLL
+
+#include <sys/epoll.h>
+#ifdef HAS_EVENTFD
+#include <sys/eventfd.h>
+#else
+#include <fcntl.h>
+#endif
+
+/** Maximum number of reads done on one connection per loop iteration, so
+ * that a single flooding client cannot starve the others on its thread.
+ */
+#define IOTHREAD_READ_BUDGET 8
+
+/** A message passed between the main thread and an I/O thread */
+struct IOMessage
+{
+	enum Type
+	{
+		/* main -> I/O thread */
+		IOM_ADD,	/* start handling conn; data is any unprocessed input */
+		IOM_DATA,	/* data is output for conn */
+		IOM_CLOSE,	/* write any remaining output and close conn */
+		/* I/O thread -> main */
+		IOM_LINES,	/* data is complete lines received on conn */
+		IOM_ERROR,	/* conn failed; error is an errno value, or 0 if closed */
+		IOM_CLOSED	/* conn has been closed and may be freed */
+	};
+
+	Type type;
+	IOConnection* conn;
+	std::string data;
+	size_t bytes;
+	int error;
+
+	IOMessage() : type(IOM_DATA), conn(NULL), bytes(0), error(0) {}
+	IOMessage(Type t, IOConnection* c) : type(t), conn(c), bytes(0), error(0) {}
+
+	void swap(IOMessage& other)
+	{
+		std::swap(type, other.type);
+		std::swap(conn, other.conn);
+		data.swap(other.data);
+		std::swap(bytes, other.bytes);
+		std::swap(error, other.error);
+	}
+};
+
+/** Unbounded queue with exactly one producer and one consumer thread.
+ * Neither side takes a lock: the consumer owns head, the producer owns
+ * tail, and a node is only published once its contents are written.
+ */
+class IOQueue
+{
+	struct Node
+	{
+		IOMessage msg;
+		Node* volatile next;
+		Node() : next(NULL) {}
+	};
+
+	/** Dummy node before the first message; consumer side */
+	Node* head;
+	/** Last node in the queue; producer side */
+	Node* tail;
+
+ public:
+	IOQueue() : head(new Node), tail(head) {}
+
+	~IOQueue()
+	{
+		while (head)
+		{
+			Node* next = head->next;
+			delete head;
+			head = next;
+		}
+	}
+
+	/** Append a message. The contents of msg are swapped into the queue. */
+	void Push(IOMessage& msg)
+	{
+		Node* node = new Node;
+		node->msg.swap(msg);
+		__sync_synchronize();
+		tail->next = node;
+		tail = node;
+	}
+
+	/** Remove the first message, if there is one, into msg */
+	bool Pop(IOMessage& msg)
+	{
+		Node* next = head->next;
+		if (!next)
+			return false;
+		__sync_synchronize();
+		msg.swap(next->msg);
+		delete head;
+		head = next;
+		return true;
+	}
+};
+
+class IOThread : public SocketThread
+{
+	/** epoll instance for this thread's connections */
+	int epfd;
+	/** Read end of the wakeup channel from the main thread */
+	int wake_fd;
+	/** Write end of the wakeup channel (same as wake_fd for eventfd) */
+	int wake_send;
+
+	/** Connections with more input to read next iteration (I/O thread only) */
+	std::vector<IOConnection*> busy;
+	/** Set when a message has been posted to the main thread (I/O thread only) */
+	bool posted;
+	/** Receive buffer (I/O thread only) */
+	char readbuf[65536];
+
+	void Post(IOMessage& msg)
+	{
+		outbox.Push(msg);
+		posted = true;
+	}
+
+	void Fail(IOConnection* conn, int error);
+	void DoRead(IOConnection* conn);
+	void DoWrite(IOConnection* conn);
+	void ProcessInbox();
+
+ public:
+	/** Messages from the main thread */
+	IOQueue inbox;
+	/** Messages to the main thread */
+	IOQueue outbox;
+	/** Number of connections owned by this thread (main thread only) */
+	size_t conns;
+	/** Set if inbox has messages the thread has not been woken for (main thread only) */
+	bool wake_pending;
+
+	IOThread();
+	~IOThread();
+
+	/** Wake the thread up to process its inbox */
+	void Wake();
+
+	void Run();
+	void OnNotify();
+
+	void SetExitFlag()
+	{
+		SocketThread::SetExitFlag();
+		Wake();
+	}
+};
+
+IOThread::IOThread() : posted(false), conns(0), wake_pending(false)
+{
+	epfd = epoll_create(128);
+	if (epfd < 0)
+		throw CoreException("Could not create epoll instance for I/O thread: " + std::string(strerror(errno)));
+#ifdef HAS_EVENTFD
+	wake_fd = wake_send = eventfd(0, EFD_NONBLOCK);
+	if (wake_fd < 0)
+#else
+	int fds[2];
+	if (pipe(fds) == 0)
+	{
+		wake_fd = fds[0];
+		wake_send = fds[1];
+		fcntl(wake_fd, F_SETFL, O_NONBLOCK);
+		fcntl(wake_send, F_SETFL, O_NONBLOCK);
+	}
+	else
+#endif
+	{
+		close(epfd);
+		throw CoreException("Could not create wakeup channel for I/O thread: " + std::string(strerror(errno)));
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wake_fd, &ev);
+}
+
+IOThread::~IOThread()
+{
+	close(epfd);
+	close(wake_fd);
+	if (wake_send != wake_fd)
+		close(wake_send);
+}
+
+void IOThread::Wake()
+{
+#ifdef HAS_EVENTFD
+	eventfd_write(wake_send, 1);
+#else
+	static const char dummy = '*';
+	if (write(wake_send, &dummy, 1) < 0)
+		return;
+#endif
+}
+
+void IOThread::Fail(IOConnection* conn, int error)
+{
+	conn->partial.clear();
+	epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	conn->dead = true;
+	IOMessage msg(IOMessage::IOM_ERROR, conn);
+	msg.error = error;
+	Post(msg);
+}
+
+void IOThread::DoRead(IOConnection* conn)
+{
+	IOMessage msg(IOMessage::IOM_LINES, conn);
+	int error = -1;
+	bool more = true;
+
+	for (int i = 0; i < IOTHREAD_READ_BUDGET; i++)
+	{
+		int n = recv(conn->fd, readbuf, sizeof(readbuf), 0);
+		if (n > 0)
+		{
+			conn->rawin += n;
+			for (int pos = 0; pos < n; pos++)
+			{
+				char c = readbuf[pos];
+				switch (c)
+				{
+				case '\0':
+					c = ' ';
+					break;
+				case '\r':
+					continue;
+				case '\n':
+					msg.data.append(conn->partial);
+					msg.data.push_back('\n');
+					conn->partial.clear();
+					continue;
+				}
+				if (conn->partial.length() < MAXBUF - 2)
+					conn->partial.push_back(c);
+			}
+			if (n < (int)sizeof(readbuf))
+			{
+				more = false;
+				break;
+			}
+		}
+		else if (n == 0)
+		{
+			error = 0;
+			break;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			more = false;
+			break;
+		}
+		else if (errno != EINTR)
+		{
+			error = errno;
+			break;
+		}
+	}
+
+	if (!msg.data.empty())
+	{
+		msg.bytes = conn->rawin;
+		conn->rawin = 0;
+		Post(msg);
+	}
+
+	if (error >= 0)
+	{
+		Fail(conn, error);
+	}
+	else if (more && !conn->busy)
+	{
+		conn->busy = true;
+		busy.push_back(conn);
+	}
+}
+
+void IOThread::DoWrite(IOConnection* conn)
+{
+	while (conn->outpos < conn->outbuf.length())
+	{
+		int n = send(conn->fd, conn->outbuf.data() + conn->outpos, conn->outbuf.length() - conn->outpos, 0);
+		if (n > 0)
+		{
+			conn->outpos += n;
+			__sync_sub_and_fetch(&conn->queued, (size_t)n);
+		}
+		else if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		else
+		{
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				Fail(conn, errno);
+			break;
+		}
+	}
+
+	if (conn->outpos == conn->outbuf.length())
+	{
+		conn->outbuf.clear();
+		conn->outpos = 0;
+	}
+	else if (conn->outpos > conn->outbuf.length() / 2)
+	{
+		// Blocked with most of the buffer written; drop the written part
+		conn->outbuf.erase(0, conn->outpos);
+		conn->outpos = 0;
+	}
+}
+
+void IOThread::ProcessInbox()
+{
+	IOMessage msg;
+	while (inbox.Pop(msg))
+	{
+		IOConnection* conn = msg.conn;
+		switch (msg.type)
+		{
+			case IOMessage::IOM_ADD:
+			{
+				struct epoll_event ev;
+				memset(&ev, 0, sizeof(ev));
+				ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+				ev.data.ptr = conn;
+				if (epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0)
+				{
+					Fail(conn, errno);
+					break;
+				}
+				// Anything the main thread had read but not yet processed
+				for (std::string::size_type pos = 0; pos < msg.data.length(); pos++)
+				{
+					char c = msg.data[pos];
+					if (c == '\n')
+					{
+						IOMessage lines(IOMessage::IOM_LINES, conn);
+						lines.data.swap(conn->partial);
+						lines.data.push_back('\n');
+						Post(lines);
+					}
+					else if (c != '\r' && conn->partial.length() < MAXBUF - 2)
+						conn->partial.push_back(c ? c : ' ');
+				}
+				break;
+			}
+			case IOMessage::IOM_DATA:
+				if (conn->dead)
+				{
+					__sync_sub_and_fetch(&conn->queued, msg.data.length());
+					break;
+				}
+				if (conn->outbuf.empty())
+					conn->outbuf.swap(msg.data);
+				else
+					conn->outbuf.append(msg.data);
+				DoWrite(conn);
+				break;
+			case IOMessage::IOM_CLOSE:
+			{
+				if (!conn->dead)
+				{
+					// final chance, dump as much of the sendq as we can
+					DoWrite(conn);
+					epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+				}
+				if (conn->busy)
+					busy.erase(std::find(busy.begin(), busy.end(), conn));
+				shutdown(conn->fd, 2);
+				close(conn->fd);
+				IOMessage closed(IOMessage::IOM_CLOSED, conn);
+				Post(closed);
+				break;
+			}
+			default:
+				break;
+		}
+		msg.data.clear();
+	}
+}
+
+void IOThread::Run()
+{
+	struct epoll_event events[256];
+
+	while (true)
+	{
+		int timeout = busy.empty() ? 1000 : 0;
+		int n = epoll_wait(epfd, events, 256, timeout);
+
+		for (int i = 0; i < n; i++)
+		{
+			IOConnection* conn = static_cast<IOConnection*>(events[i].data.ptr);
+			if (!conn)
+			{
+#ifdef HAS_EVENTFD
+				eventfd_t dummy;
+				eventfd_read(wake_fd, &dummy);
+#else
+				char dummy[128];
+				while (read(wake_fd, dummy, sizeof(dummy)) > 0);
+#endif
+				continue;
+			}
+			if (conn->dead)
+				continue;
+			if (events[i].events & (EPOLLOUT | EPOLLERR))
+				DoWrite(conn);
+			if (!conn->dead && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+				DoRead(conn);
+		}
+
+		// Connections which did not drain their input last time round
+		std::vector<IOConnection*> again;
+		again.swap(busy);
+		for (std::vector<IOConnection*>::iterator i = again.begin(); i != again.end(); ++i)
+		{
+			IOConnection* conn = *i;
+			conn->busy = false;
+			if (!conn->dead)
+				DoRead(conn);
+		}
+
+		bool exiting = GetExitFlag();
+		ProcessInbox();
+
+		if (posted)
+		{
+			posted = false;
+			NotifyParent();
+		}
+
+		if (exiting)
+			break;
+	}
+}
+
+void IOThread::OnNotify()
+{
+	IOMessage msg;
+	while (outbox.Pop(msg))
+	{
+		IOConnection* conn = msg.conn;
+		UserIOHandler* eh = conn->owner;
+		switch (msg.type)
+		{
+			case IOMessage::IOM_LINES:
+				if (!eh)
+					break;
+				ServerInstance->stats->statsRecv += msg.bytes;
+				eh->user->bytes_in += msg.bytes;
+				if (conn->inpos)
+				{
+					conn->inbuf.erase(0, conn->inpos);
+					conn->inpos = 0;
+				}
+				if (conn->inbuf.empty())
+					conn->inbuf.swap(msg.data);
+				else
+					conn->inbuf.append(msg.data);
+				eh->OnDataReady();
+				break;
+			case IOMessage::IOM_ERROR:
+				if (!eh)
+					break;
+				eh->SetError(msg.error ? strerror(msg.error) : "Connection closed");
+				eh->OnError(I_ERR_OTHER);
+				break;
+			case IOMessage::IOM_CLOSED:
+				conn->thread->conns--;
+				delete conn;
+				break;
+			default:
+				break;
+		}
+		msg.data.clear();
+	}
+}
+
+IOThreadPool::IOThreadPool(unsigned int count)
+{
+	for (unsigned int i = 0; i < count; i++)
+	{
+		IOThread* thread = new IOThread;
+		try
+		{
+			ServerInstance->Threads->Start(thread);
+		}
+		catch (CoreException&)
+		{
+			delete thread;
+			for (std::vector<IOThread*>::iterator j = threads.begin(); j != threads.end(); ++j)
+			{
+				(*j)->join();
+				delete *j;
+			}
+			throw;
+		}
+		threads.push_back(thread);
+	}
+	ServerInstance->Logs->Log("SOCKET", DEFAULT, "Started %u I/O threads", count);
+}
+
+IOThreadPool::~IOThreadPool()
+{
+	for (std::vector<IOThread*>::iterator i = threads.begin(); i != threads.end(); ++i)
+	{
+		IOThread* thread = *i;
+		// The thread processes its inbox (including any CLOSE requests) before exiting
+		thread->join();
+		thread->OnNotify();
+		delete thread;
+	}
+	threads.clear();
+}
+
+void IOThreadPool::Adopt(LocalUser* user)
+{
+	adopting.push_back(user->uuid);
+}
+
+bool IOThreadPool::Migrate(LocalUser* user)
+{
+	UserIOHandler& eh = user->eh;
+	if (user->quitting || eh.ioconn || eh.GetIOHook() || eh.GetFd() < 0 || !eh.getError().empty())
+		return true;
+
+	// Let the socket engine finish writing out anything already queued
+	if (eh.getSendQSize())
+		return false;
+
+	IOThread* thread = threads.front();
+	for (std::vector<IOThread*>::iterator i = threads.begin(); i != threads.end(); ++i)
+		if ((*i)->conns < thread->conns)
+			thread = *i;
+
+	ServerInstance->SE->DelFd(&eh);
+	IOConnection* conn = new IOConnection(thread, eh.GetFd(), &eh);
+	eh.ioconn = conn;
+	thread->conns++;
+
+	IOMessage msg(IOMessage::IOM_ADD, conn);
+	eh.CompactRecvQ();
+	msg.data.swap(eh.recvq);
+	thread->inbox.Push(msg);
+	thread->wake_pending = true;
+
+	ServerInstance->Logs->Log("SOCKET", DEBUG, "Moved fd %d (%s) to an I/O thread", conn->fd, user->uuid.c_str());
+	return true;
+}
+
+void IOThreadPool::Write(IOConnection* conn, const std::string& data)
+{
+	conn->pending_out.append(data);
+	if (!conn->dirty)
+	{
+		conn->dirty = true;
+		dirty.push_back(conn);
+	}
+}
+
+void IOThreadPool::Release(IOConnection* conn)
+{
+	IOThread* thread = conn->thread;
+	if (conn->dirty)
+		dirty.erase(std::find(dirty.begin(), dirty.end(), conn));
+
+	if (!conn->pending_out.empty())
+	{
+		IOMessage data(IOMessage::IOM_DATA, conn);
+		__sync_add_and_fetch(&conn->queued, conn->pending_out.length());
+		data.data.swap(conn->pending_out);
+		thread->inbox.Push(data);
+	}
+
+	conn->owner = NULL;
+	conn->inbuf.clear();
+	IOMessage msg(IOMessage::IOM_CLOSE, conn);
+	thread->inbox.Push(msg);
+	thread->wake_pending = true;
+}
+
+void IOThreadPool::Flush()
+{
+	if (!adopting.empty())
+	{
+		std::vector<std::string> retry;
+		for (std::vector<std::string>::iterator i = adopting.begin(); i != adopting.end(); ++i)
+		{
+			User* u = ServerInstance->FindUUID(*i);
+			LocalUser* user = u ? IS_LOCAL(u) : NULL;
+			if (user && !Migrate(user))
+				retry.push_back(*i);
+		}
+		adopting.swap(retry);
+	}
+
+	for (std::vector<IOConnection*>::iterator i = dirty.begin(); i != dirty.end(); ++i)
+	{
+		IOConnection* conn = *i;
+		conn->dirty = false;
+		IOMessage msg(IOMessage::IOM_DATA, conn);
+		__sync_add_and_fetch(&conn->queued, conn->pending_out.length());
+		msg.data.swap(conn->pending_out);
+		conn->thread->inbox.Push(msg);
+		conn->thread->wake_pending = true;
+	}
+	dirty.clear();
+
+	for (std::vector<IOThread*>::iterator i = threads.begin(); i != threads.end(); ++i)
+	{
+		if ((*i)->wake_pending)
+		{
+			(*i)->wake_pending = false;
+			(*i)->Wake();
+		}
+	}
+}
+
+#else
+
+IOThreadPool::IOThreadPool(unsigned int)
+{
+	throw CoreException("I/O threads are not supported on this platform");
+}
+
+IOThreadPool::~IOThreadPool()
+{
+}
+
+void IOThreadPool::Adopt(LocalUser*)
+{
+}
+
+bool IOThreadPool::Migrate(LocalUser*)
+{
+	return true;
+}
+
+void IOThreadPool::Write(IOConnection*, const std::string&)
+{
+}
+
+void IOThreadPool::Release(IOConnection*)
+{
+}
+
+void IOThreadPool::Flush()
+{
+}
+
+#endif
@@ -370,6 +370,10 @@ ModeAction ModeParser::TryMode(User* user, User* targetuser, Channel* chan, bool
 	if (ma != MODEACTION_ALLOW)
 		return ma;
 
+	/* A list mode such as +b or +e changed, so any ban verdicts cached for the channel are stale */
+	if (chan && mh->IsListMode() && !mh->GetPrefixRank())
+		chan->banepoch++;
+
 	for (ModeWatchIter watchers = modewatchers[handler_id].begin(); watchers != modewatchers[handler_id].end(); watchers++)
 		(*watchers)->AfterMode(user, targetuser, chan, parameter, adding, type);
 
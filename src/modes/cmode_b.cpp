@@ -144,6 +144,7 @@ std::string& ModeChannelBan::AddBan(User *user, std::string &dest, Channel *chan
 	b.set_time = ServerInstance->Time();
 	b.data.assign(dest, 0, MAXBUF);
 	b.set_by.assign(user->nick, 0, 64);
+	b.cidr = irc::sockets::cidr_match(b.data);
 	chan->bans.push_back(b);
 	return dest;
 }
@@ -186,12 +186,24 @@ ModuleManager::~ModuleManager()
 {
 }
 
+/* A module starting or stopping to check bans can change whether anyone is
+ * banned anywhere, so the ban verdicts cached for every channel are dropped.
+ */
+static void InvalidateBanVerdicts(Implementation i)
+{
+	if (i != I_OnCheckBan && i != I_OnCheckChannelBan && i != I_OnExtBanCheck)
+		return;
+	for (chan_hash::const_iterator c = ServerInstance->chanlist->begin(); c != ServerInstance->chanlist->end(); ++c)
+		c->second->banepoch++;
+}
+
 bool ModuleManager::Attach(Implementation i, Module* mod)
 {
 	if (std::find(EventHandlers[i].begin(), EventHandlers[i].end(), mod) != EventHandlers[i].end())
 		return false;
 
 	EventHandlers[i].push_back(mod);
+	InvalidateBanVerdicts(i);
 	return true;
 }
 
@@ -203,6 +215,7 @@ bool ModuleManager::Detach(Implementation i, Module* mod)
 		return false;
 
 	EventHandlers[i].erase(x);
+	InvalidateBanVerdicts(i);
 	return true;
 }
 
@@ -347,6 +360,9 @@ void ModuleManager::DoSafeUnload(Module* mod)
 {
 	std::map<std::string, Module*>::iterator modfind = Modules.find(mod->ModuleSourceFile);
 
+	/* Users waiting to be deleted are in no list below, but may still have metadata from this module */
+	ServerInstance->GlobalCulls.ApplyDeferred();
+
 	std::vector<reference<ExtensionItem> > items;
 	ServerInstance->Extensions.BeginUnregister(modfind->second, items);
 	/* Give the module a chance to tidy out all its metadata */
@@ -263,6 +263,8 @@ class ModuleNationalChars : public Module
 			charset.insert(0, "../locales/");
 		unsigned char * tables[8] = { m_additional, m_additionalMB, m_additionalUp, m_lower, m_upper, m_additionalUtf8, m_additionalUtf8range, m_additionalUtf8interval };
 		loadtables(charset, tables, 8, 5);
+		/* m_lower was rewritten in place, so masks compiled with it are stale */
+		national_case_insensitive_generation++;
 		forcequit = tag->getBool("forcequit");
 		CheckForceQuit("National character set changed");
 	}
@@ -285,6 +287,7 @@ class ModuleNationalChars : public Module
 	{
 		ServerInstance->IsNick = rememberer;
 		national_case_insensitive_map = lowermap_rememberer;
+		national_case_insensitive_generation++;
 		CheckForceQuit("National characters module unloaded");
 	}
 
@@ -287,6 +287,8 @@ class ModuleServicesAccount : public Module
 		// check if its our metadata key, and its associated with a user
 		if (dest && (extname == "accountname"))
 		{
+			/* R: and U: bans match on the account */
+			dest->banepoch++;
 			std::string *account = accountname.get(dest);
 			if (account && !account->empty())
 			{
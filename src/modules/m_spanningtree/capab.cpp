@@ -141,6 +141,9 @@ void TreeSocket::SendCapabilities(int phase)
 	}
 	if (proto_version < 1202)
 		extra += ServerInstance->Modes->FindMode('h', MODETYPE_CHANNEL) ? " HALFOP=1" : " HALFOP=0";
+#ifdef HAS_ZLIB
+	extra += " COMPRESS=zlib";
+#endif
 
 	this->WriteLine("CAPAB CAPABILITIES " /* Preprocessor does this one. */
 			":NICKMAX="+ConvToStr(ServerInstance->Config->Limits.NickMax)+
@@ -169,7 +169,7 @@ void TreeSocket::WriteLine(std::string line)
 					std::string target = line.substr(d + 1, e - d - 1);
 
 					ServerInstance->Logs->Log("m_spanningtree",DEBUG,"Forging acceptance of CHGIDENT from 1201-protocol server");
-					recvq.insert(0, ":" + target + " FIDENT " + line.substr(e) + "\n");
+					recvq.insert(recvq_pos, ":" + target + " FIDENT " + line.substr(e) + "\n");
 				}
 
 				Command* thiscmd = ServerInstance->Parser->GetHandler(subcmd);
@@ -188,9 +188,36 @@ void TreeSocket::WriteLine(std::string line)
 	}
 
 	ServerInstance->Logs->Log("m_spanningtree", RAWIO, "S[%d] O %s", this->GetFd(), line.c_str());
-	this->WriteData(line);
 	if (proto_version < 1202)
-		this->WriteData(wide_newline);
+		line.append(wide_newline);
 	else
-		this->WriteData(newline);
+		line.append(newline);
+	plain_out += line.length();
+	if (deflater)
+		this->QueueCompressed(line);
+	else
+	{
+		wire_out += line.length();
+		this->WriteData(line);
+	}
+}
+
+void TreeSocket::WriteLine(const reference<SendQueueSegment>& line)
+{
+	/* Lines to 1201-protocol servers may need rewriting, and end in CRLF */
+	if (proto_version < 1202)
+	{
+		WriteLine(line->data.substr(0, line->data.length() - 1));
+		return;
+	}
+
+	ServerInstance->Logs->Log("m_spanningtree", RAWIO, "S[%d] O %.*s", this->GetFd(), (int)line->data.length() - 1, line->data.c_str());
+	plain_out += line->data.length();
+	if (deflater)
+		this->QueueCompressed(line->data);
+	else
+	{
+		wire_out += line->data.length();
+		this->WriteData(line);
+	}
 }
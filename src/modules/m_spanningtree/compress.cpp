@@ -0,0 +1,253 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* $LinkerFlags: exec("grep -qs HAS_ZLIB $SOURCEPATH/include/inspircd_config.h && echo -lz") */
+
+#include "inspircd.h"
+
+#ifdef HAS_ZLIB
+#include <zlib.h>
+#endif
+
+#include "main.h"
+#include "utils.h"
+#include "treeserver.h"
+#include "link.h"
+#include "treesocket.h"
+
+/*
+ * Link compression works one direction at a time. A server whose link
+ * block has compress set, and which sees COMPRESS=zlib in the other side's
+ * CAPAB CAPABILITIES, sends ":<sid> COMPRESS zlib" when it starts its burst.
+ * Everything it sends after that line is a single zlib stream, which is
+ * flushed (Z_SYNC_FLUSH) every time the socket is written to, so the other
+ * side can always decompress all of the lines it has been sent so far.
+ *
+ * Without zlib (see HAS_ZLIB in configure) COMPRESS=zlib is not sent in
+ * CAPAB, so neither side of a link starts compressing.
+ */
+
+#ifdef HAS_ZLIB
+
+void TreeSocket::StartCompression()
+{
+	if (deflater || !capab || !capab->link || capab->link->Compress <= 0)
+		return;
+
+	std::map<std::string,std::string>::iterator n = capab->CapKeys.find("COMPRESS");
+	if (n == capab->CapKeys.end())
+		return;
+
+	bool supported = false;
+	irc::commasepstream methods(n->second);
+	std::string method;
+	while (methods.GetToken(method))
+	{
+		if (method == "zlib")
+			supported = true;
+	}
+	if (!supported)
+		return;
+
+	z_stream_s* zs = new z_stream_s;
+	memset(zs, 0, sizeof(z_stream_s));
+	if (deflateInit(zs, capab->link->Compress) != Z_OK)
+	{
+		ServerInstance->Logs->Log("m_spanningtree", DEFAULT, "Could not start compression on link to %s: %s",
+			linkID.c_str(), zs->msg ? zs->msg : "unknown error");
+		delete zs;
+		return;
+	}
+
+	/* The marker itself must go out uncompressed */
+	this->WriteLine(":" + ServerInstance->Config->GetSID() + " COMPRESS zlib");
+	CompressLevel = capab->link->Compress;
+	deflater = zs;
+	ServerInstance->Logs->Log("m_spanningtree", DEBUG, "Compressing link to %s with zlib level %d", linkID.c_str(), CompressLevel);
+}
+
+void TreeSocket::StartDecompression(const parameterlist &params)
+{
+	if (LinkState != WAIT_AUTH_2 && LinkState != CONNECTED)
+	{
+		this->SendError("Invalid command in negotiation phase: COMPRESS");
+		return;
+	}
+	if (inflater)
+	{
+		this->SendError("Received COMPRESS on a link which is already compressed");
+		return;
+	}
+	if (params.empty() || params[0] != "zlib")
+	{
+		this->SendError("Unsupported link compression method: " + (params.empty() ? std::string("<none>") : params[0]));
+		return;
+	}
+
+	z_stream_s* zs = new z_stream_s;
+	memset(zs, 0, sizeof(z_stream_s));
+	if (inflateInit(zs) != Z_OK)
+	{
+		delete zs;
+		this->SendError("Could not start decompressing the link");
+		return;
+	}
+	inflater = zs;
+
+	/* Whatever is left in the recvq came after the marker, so it is compressed,
+	 * and was counted as if it was not.
+	 */
+	plain_in -= recvq.length() - recvq_pos;
+	Inflate(recvq_pos);
+}
+
+bool TreeSocket::Inflate(std::string::size_type start)
+{
+	if (start >= recvq.length())
+		return true;
+
+	std::string in(recvq, start);
+	recvq.erase(start);
+
+	char* buffer = ServerInstance->GetReadBuffer();
+	unsigned int size = ServerInstance->Config->NetBufferSize;
+	inflater->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+	inflater->avail_in = in.length();
+	do
+	{
+		inflater->next_out = reinterpret_cast<Bytef*>(buffer);
+		inflater->avail_out = size;
+		int rv = inflate(inflater, Z_SYNC_FLUSH);
+		if (rv != Z_OK && rv != Z_BUF_ERROR)
+		{
+			this->SendError(std::string("Could not decompress data from the link: ") + (inflater->msg ? inflater->msg : "stream ended"));
+			return false;
+		}
+		recvq.append(buffer, size - inflater->avail_out);
+	} while (inflater->avail_out == 0);
+
+	plain_in += recvq.length() - start;
+	return true;
+}
+
+void TreeSocket::QueueCompressed(const std::string& data)
+{
+	if (GetFd() < 0)
+		return;
+
+	deflatebuf.append(data);
+	if (!ServerInstance->SE->CorkWrite(this))
+		ServerInstance->SE->ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
+void TreeSocket::FlushCompressed()
+{
+	if (!deflater || deflatebuf.empty())
+		return;
+
+	reference<SendQueueSegment> segment = new SendQueueSegment;
+	std::string& out = segment->data;
+	out.resize(deflateBound(deflater, deflatebuf.length()) + 16);
+
+	deflater->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(deflatebuf.data()));
+	deflater->avail_in = deflatebuf.length();
+	std::string::size_type used = 0;
+	while (true)
+	{
+		deflater->next_out = reinterpret_cast<Bytef*>(&out[used]);
+		deflater->avail_out = out.length() - used;
+		int rv = deflate(deflater, Z_SYNC_FLUSH);
+		used = out.length() - deflater->avail_out;
+		if (rv != Z_OK && rv != Z_BUF_ERROR)
+		{
+			deflatebuf.clear();
+			SetError("Could not compress data for the link");
+			return;
+		}
+		if (deflater->avail_out != 0)
+			break;
+		out.resize(out.length() * 2);
+	}
+	out.resize(used);
+	deflatebuf.clear();
+
+	wire_out += used;
+	this->WriteData(segment);
+}
+
+void TreeSocket::CleanCompression()
+{
+	if (deflater)
+	{
+		deflateEnd(deflater);
+		delete deflater;
+		deflater = NULL;
+	}
+	if (inflater)
+	{
+		inflateEnd(inflater);
+		delete inflater;
+		inflater = NULL;
+	}
+	deflatebuf.clear();
+}
+
+#else
+
+void TreeSocket::StartCompression()
+{
+}
+
+void TreeSocket::StartDecompression(const parameterlist &params)
+{
+	this->SendError("Link compression is not supported by this server");
+}
+
+bool TreeSocket::Inflate(std::string::size_type start)
+{
+	return true;
+}
+
+void TreeSocket::QueueCompressed(const std::string& data)
+{
+}
+
+void TreeSocket::FlushCompressed()
+{
+}
+
+void TreeSocket::CleanCompression()
+{
+}
+
+#endif
+
+void TreeSocket::DoWrite()
+{
+	this->FlushCompressed();
+	this->BufferedSocket::DoWrite();
+}
+
+bool TreeSocket::IsCorked()
+{
+	return (deflater != NULL);
+}
+
+size_t TreeSocket::getSendQSize() const
+{
+	return StreamSocket::getSendQSize() + deflatebuf.length();
+}
@@ -37,6 +37,8 @@ class Link : public refcountbase
 	int Timeout;
 	std::string Bind;
 	bool Hidden;
+	/** zlib level to compress what we send with, or 0 for none */
+	int Compress;
 	Link(ConfigTag* Tag) : tag(Tag) {}
 };
 
@@ -68,6 +68,7 @@ void ModuleSpanningTree::init()
 	ServerInstance->Modules->AddService(commands->fhost);
 	ServerInstance->Modules->AddService(commands->fident);
 	ServerInstance->Modules->AddService(commands->fname);
+	ServerInstance->Modules->AddService(Utils->RouteCounts);
 	RefreshTimer = new CacheRefreshTimer(Utils);
 	ServerInstance->Timers->AddTimer(RefreshTimer);
 
@@ -86,8 +87,12 @@ void ModuleSpanningTree::init()
 	ServerInstance->PI = new SpanningTreeProtocolInterface(Utils);
 	loopCall = false;
 
-	// update our local user count
-	Utils->TreeRoot->SetUserCount(ServerInstance->Users->local_users.size());
+	// add the local users which are already connected
+	for (LocalUserList::const_iterator i = ServerInstance->Users->local_users.begin(); i != ServerInstance->Users->local_users.end(); ++i)
+	{
+		if ((*i)->registered == REG_ALL)
+			Utils->TreeRoot->AddUser(*i);
+	}
 }
 
 void ModuleSpanningTree::ShowLinks(TreeServer* Current, User* user, int hops)
@@ -495,11 +500,14 @@ void ModuleSpanningTree::OnUserNotice(User* user, void* dest, int target_type, c
 					cname = status + cname;
 				TreeServerList list;
 				Utils->GetListOfServersForChannel(c,list,status,exempt_list);
+				if (list.empty())
+					return;
+				reference<SendQueueSegment> line = Utils->PrepareLine(":"+user->uuid+" NOTICE "+cname+" :"+text);
 				for (TreeServerList::iterator i = list.begin(); i != list.end(); i++)
 				{
 					TreeSocket* Sock = i->second->GetSocket();
 					if (Sock)
-						Sock->WriteLine(":"+std::string(user->uuid)+" NOTICE "+cname+" :"+text);
+						Sock->WriteLine(line);
 				}
 			}
 		}
@@ -548,11 +556,14 @@ void ModuleSpanningTree::OnUserMessage(User* user, void* dest, int target_type,
 					cname = status + cname;
 				TreeServerList list;
 				Utils->GetListOfServersForChannel(c,list,status,exempt_list);
+				if (list.empty())
+					return;
+				reference<SendQueueSegment> line = Utils->PrepareLine(":"+user->uuid+" PRIVMSG "+cname+" :"+text);
 				for (TreeServerList::iterator i = list.begin(); i != list.end(); i++)
 				{
 					TreeSocket* Sock = i->second->GetSocket();
 					if (Sock)
-						Sock->WriteLine(":"+std::string(user->uuid)+" PRIVMSG "+cname+" :"+text);
+						Sock->WriteLine(line);
 				}
 			}
 		}
@@ -610,7 +621,7 @@ void ModuleSpanningTree::OnUserConnect(LocalUser* user)
 			ServerInstance->PI->SendMetaData(user, item->name, value);
 	}
 
-	Utils->TreeRoot->SetUserCount(1); // increment by 1
+	Utils->TreeRoot->AddUser(user);
 }
 
 void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created, CUList& excepts)
@@ -628,6 +639,10 @@ void ModuleSpanningTree::OnUserJoin(Membership* memb, bool sync, bool created, C
 		params.push_back(memb->modes+","+memb->user->uuid);
 		Utils->DoOneToMany(ServerInstance->Config->GetSID(),"FJOIN",params);
 	}
+	else
+	{
+		Utils->AddChannelRoute(memb->chan, memb->user);
+	}
 }
 
 void ModuleSpanningTree::OnChangeHost(User* user, const std::string &newhost)
@@ -671,6 +686,10 @@ void ModuleSpanningTree::OnUserPart(Membership* memb, std::string &partmessage,
 			params.push_back(":"+partmessage);
 		Utils->DoOneToMany(memb->user->uuid,"PART",params);
 	}
+	else
+	{
+		Utils->DelChannelRoute(memb->chan, memb->user);
+	}
 }
 
 void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const std::string &oper_message)
@@ -688,12 +707,17 @@ void ModuleSpanningTree::OnUserQuit(User* user, const std::string &reason, const
 		params.push_back(":"+reason);
 		Utils->DoOneToMany(user->uuid,"QUIT",params);
 	}
+	else if (!IS_LOCAL(user))
+	{
+		for (UCListIter i = user->chans.begin(); i != user->chans.end(); ++i)
+			Utils->DelChannelRoute(*i, user);
+	}
 
 	// Regardless, We need to modify the user Counts..
 	TreeServer* SourceServer = Utils->FindServer(user->server);
 	if (SourceServer)
 	{
-		SourceServer->SetUserCount(-1); // decrement by 1
+		SourceServer->DelUser(user);
 	}
 }
 
@@ -735,6 +759,9 @@ void ModuleSpanningTree::OnUserKick(User* source, Membership* memb, const std::s
 	{
 		Utils->DoOneToMany(ServerInstance->Config->GetSID(),"KICK",params);
 	}
+
+	if (!IS_LOCAL(memb->user))
+		Utils->DelChannelRoute(memb->chan, memb->user);
 }
 
 void ModuleSpanningTree::OnRemoteKill(User* source, User* dest, const std::string &reason, const std::string &operreason)
@@ -39,6 +39,7 @@ void TreeSocket::DoBurst(TreeServer* s)
 		servername.c_str(),
 		capab->auth_fingerprint ? "SSL Fingerprint and " : "",
 		capab->auth_challenge ? "challenge-response" : "plaintext password");
+	this->StartCompression();
 	this->CleanNegotiationInfo();
 	this->WriteLine(":" + ServerInstance->Config->GetSID() + " BURST " + ConvToStr(ServerInstance->Time()));
 	/* send our version string */
@@ -29,6 +29,12 @@
 #include "link.h"
 #include "treesocket.h"
 
+/** Size on the wire as a percentage of the uncompressed size */
+static std::string Ratio(unsigned long wire, unsigned long plain)
+{
+	return plain ? ConvToStr((unsigned long)(wire * 100.0 / plain)) + "%" : "-";
+}
+
 ModResult ModuleSpanningTree::OnStats(char statschar, User* user, string_list &results)
 {
 	if ((statschar == 'c') || (statschar == 'n'))
@@ -42,6 +48,24 @@ ModResult ModuleSpanningTree::OnStats(char statschar, User* user, string_list &r
 		}
 		return MOD_RES_DENY;
 	}
+	else if (statschar == '?')
+	{
+		std::string sn(ServerInstance->Config->ServerName);
+		results.push_back(sn+" 211 "+user->nick+" :server sendq compress_out bytes_out wire_out ratio_out compress_in bytes_in wire_in ratio_in time_open");
+		for (unsigned int i = 0; i < Utils->TreeRoot->ChildCount(); i++)
+		{
+			TreeServer* s = Utils->TreeRoot->GetChild(i);
+			TreeSocket* sock = s->GetSocket();
+			if (!sock)
+				continue;
+			int level = sock->GetCompressLevel();
+			results.push_back(sn+" 211 "+user->nick+" "+s->GetName()+" "+ConvToStr(sock->getSendQSize())+
+				" "+(level ? "zlib-"+ConvToStr(level) : "none")+" "+ConvToStr(sock->plain_out)+" "+ConvToStr(sock->wire_out)+" "+Ratio(sock->wire_out, sock->plain_out)+
+				" "+(sock->IsInflating() ? "zlib" : "none")+" "+ConvToStr(sock->plain_in)+" "+ConvToStr(sock->wire_in)+" "+Ratio(sock->wire_in, sock->plain_in)+
+				" "+ConvToStr(ServerInstance->Time() - sock->age));
+		}
+		return MOD_RES_DENY;
+	}
 	return MOD_RES_PASSTHRU;
 }
 
@@ -116,9 +116,7 @@ void SpanningTreeUtilities::RouteCommand(TreeServer* origin, const std::string &
 			TreeServerList list;
 			// TODO OnBuildExemptList hook was here
 			GetListOfServersForChannel(c,list,pfx, CUList());
-			std::string data = ":" + user->uuid + " " + sent_cmd;
-			for (unsigned int x = 0; x < params.size(); x++)
-				data += " " + params[x];
+			reference<SendQueueSegment> data = PrepareLine(user->uuid, sent_cmd, params);
 			for (TreeServerList::iterator i = list.begin(); i != list.end(); i++)
 			{
 				TreeSocket* Sock = i->second->GetSocket();
@@ -143,11 +143,14 @@ void SpanningTreeProtocolInterface::SendChannel(Channel* target, char status, co
 	TreeServerList list;
 	CUList exempt_list;
 	Utils->GetListOfServersForChannel(target,list,status,exempt_list);
+	if (list.empty())
+		return;
+	reference<SendQueueSegment> line = Utils->PrepareLine(text);
 	for (TreeServerList::iterator i = list.begin(); i != list.end(); i++)
 	{
 		TreeSocket* Sock = i->second->GetSocket();
 		if (Sock)
-			Sock->WriteLine(text);
+			Sock->WriteLine(line);
 	}
 }
 
@@ -259,6 +259,8 @@ bool TreeSocket::Inbound_Server(parameterlist &params)
 		MyRoot = new TreeServer(Utils, sname, description, sid, Utils->TreeRoot, this, x->Hidden);
 		Utils->TreeRoot->AddChild(MyRoot);
 
+		// remember which link block they matched, for its settings when we burst
+		capab->link = x;
 		this->LinkState = WAIT_AUTH_2;
 		return true;
 	}
@@ -42,7 +42,7 @@ TreeServer::TreeServer(SpanningTreeUtilities* Util, std::string Name, std::strin
 	bursting = false;
 	Parent = NULL;
 	VersionString.clear();
-	ServerUserCount = ServerOperCount = 0;
+	ServerOperCount = 0;
 	VersionString = ServerInstance->GetVersionString();
 	Route = NULL;
 	Socket = NULL; /* Fix by brain */
@@ -62,7 +62,7 @@ TreeServer::TreeServer(SpanningTreeUtilities* Util, std::string Name, std::strin
 	age = ServerInstance->Time();
 	bursting = true;
 	VersionString.clear();
-	ServerUserCount = ServerOperCount = 0;
+	ServerOperCount = 0;
 	SetNextPingTime(ServerInstance->Time() + Utils->PingFreq);
 	SetPingFlag();
 	Warned = false;
@@ -163,32 +163,18 @@ void TreeServer::SetID(const std::string &id)
 	Utils->sidlist[sid] = this;
 }
 
-int TreeServer::QuitUsers(const std::string &reason)
+void TreeServer::GetSplitUsers(std::vector<User*>& users)
 {
-	const char* reason_s = reason.c_str();
-	std::vector<User*> time_to_die;
-	for (user_hash::iterator n = ServerInstance->Users->clientlist->begin(); n != ServerInstance->Users->clientlist->end(); n++)
+	for (std::set<User*>::iterator n = Users.begin(); n != Users.end(); n++)
 	{
-		if (n->second->server == ServerName)
-		{
-			time_to_die.push_back(n->second);
-		}
-	}
-	for (std::vector<User*>::iterator n = time_to_die.begin(); n != time_to_die.end(); n++)
-	{
-		User* a = (User*)*n;
+		User* a = *n;
 		if (!IS_LOCAL(a))
 		{
 			if (this->Utils->quiet_bursts)
 				a->quietquit = true;
-
-			if (ServerInstance->Config->HideSplits)
-				ServerInstance->Users->QuitUser(a, "*.net *.split", reason_s);
-			else
-				ServerInstance->Users->QuitUser(a, reason_s);
+			users.push_back(a);
 		}
 	}
-	return time_to_die.size();
 }
 
 /** This method is used to add the structure to the
@@ -259,12 +245,17 @@ void TreeServer::SetPingFlag()
 
 unsigned int TreeServer::GetUserCount()
 {
-	return ServerUserCount;
+	return Users.size();
+}
+
+void TreeServer::AddUser(User* user)
+{
+	Users.insert(user);
 }
 
-void TreeServer::SetUserCount(int diff)
+void TreeServer::DelUser(User* user)
 {
-	ServerUserCount += diff;
+	Users.erase(user);
 }
 
 void TreeServer::SetOperCount(int diff)
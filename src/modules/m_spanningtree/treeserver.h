@@ -46,7 +46,7 @@ class TreeServer : public classbase
 	irc::string ServerName;			/* Server's name */
 	std::string ServerDesc;			/* Server's description */
 	std::string VersionString;		/* Version string or empty string */
-	unsigned int ServerUserCount;		/* How many users are on this server? [note: doesn't care about +i] */
+	std::set<User*> Users;			/* The users on this server, so a split doesn't have to look at every user */
 	unsigned int ServerOperCount;		/* How many opers are on this server? */
 	TreeSocket* Socket;			/* For directly connected servers this points at the socket object */
 	time_t NextPing;			/* After this time, the server should be PINGed*/
@@ -79,7 +79,10 @@ class TreeServer : public classbase
 	 */
 	TreeServer(SpanningTreeUtilities* Util, std::string Name, std::string Desc, const std::string &id, TreeServer* Above, TreeSocket* Sock, bool Hide);
 
-	int QuitUsers(const std::string &reason);
+	/** Adds the remote users on this server to the users lost in a netsplit
+	 * @param users The list to add them to
+	 */
+	void GetSplitUsers(std::vector<User*>& users);
 
 	/** This method is used to add the structure to the
 	 * hash_map for linear searches. It is only called
@@ -147,9 +150,13 @@ class TreeServer : public classbase
 	 */
 	unsigned int GetUserCount();
 
-	/** Increment or decrement the user count by diff.
+	/** Add a user which was introduced on this server.
+	 */
+	void AddUser(User* user);
+
+	/** Remove a user on this server which is quitting.
 	 */
-	void SetUserCount(int diff);
+	void DelUser(User* user);
 
 	/** Gets the numbers of opers on this server.
 	 */
@@ -29,6 +29,8 @@
 
 #include "utils.h"
 
+struct z_stream_s;
+
 /*
  * The server list in InspIRCd is maintained as two structures
  * which hold the data in different ways. Most of the time, we
@@ -95,9 +97,19 @@ class TreeSocket : public BufferedSocket
 	bool LastPingWasGood;			/* Responded to last ping we sent? */
 	int proto_version;			/* Remote protocol version */
 	bool ConnectionFailureShown; /* Set to true if a connection failure message was shown */
+	int CompressLevel;			/* zlib level we compress what we send with */
+	z_stream_s* deflater;			/* Compresses what we send, once we have sent COMPRESS */
+	z_stream_s* inflater;			/* Decompresses what we receive, once they have sent COMPRESS */
+	std::string deflatebuf;			/* Lines waiting to be compressed in one go when we write */
+	std::string::size_type recvq_plain;	/* Bytes of unprocessed data in recvq which are already decompressed */
  public:
 	time_t age;
 
+	/** Bytes sent and received on the wire, and before compression or after
+	 * decompression. These are the same when the link is not compressed.
+	 */
+	unsigned long wire_out, plain_out, wire_in, plain_in;
+
 	/** Because most of the I/O gubbins are encapsulated within
 	 * BufferedSocket, we just call the superclass constructor for
 	 * most of the action, and append a few of our own values
@@ -196,12 +208,10 @@ class TreeSocket : public BufferedSocket
 	bool Capab(const parameterlist &params);
 
 	/** This function forces this server to quit, removing this server
-	 * and any users on it (and servers and users below that, etc etc).
-	 * It's very slow and pretty clunky, but luckily unless your network
-	 * is having a REAL bad hair day, this function shouldnt be called
-	 * too many times a month ;-)
+	 * (and servers below that, etc etc), and collects the users on them
+	 * so Squit() can quit them all in one go.
 	 */
-	void SquitServer(std::string &from, TreeServer* Current, int& num_lost_servers, int& num_lost_users);
+	void SquitServer(std::string &from, TreeServer* Current, int& num_lost_servers, std::vector<User*>& lost_users);
 
 	/** This is a wrapper function for SquitServer above, which
 	 * does some validation first and passes on the SQUIT to all
@@ -239,10 +249,53 @@ class TreeSocket : public BufferedSocket
 	 */
 	void OnDataReady();
 
+	/** Start compressing what we send, if the link block asks for it and
+	 * the other side supports it. Must be called while capab is still set.
+	 */
+	void StartCompression();
+
+	/** Handle COMPRESS: everything the other side sends after it is compressed */
+	void StartDecompression(const parameterlist &params);
+
+	/** Decompress the data in recvq from the given offset onwards, in place
+	 * @return False if the data could not be decompressed, and the link is closing
+	 */
+	bool Inflate(std::string::size_type start);
+
+	/** Queue data to be compressed when the socket is next written to */
+	void QueueCompressed(const std::string& data);
+
+	/** Compress what has been queued and add it to the sendq */
+	void FlushCompressed();
+
+	/** Free the compression state of the link */
+	void CleanCompression();
+
+	/** Get the zlib level we compress with, or 0 if we don't */
+	int GetCompressLevel() { return deflater ? CompressLevel : 0; }
+
+	/** True if what we receive is compressed */
+	bool IsInflating() { return inflater != NULL; }
+
+	/** Compress everything queued since the last write, then write it */
+	void DoWrite();
+
+	/** Compressed links are corked, so all lines from one main loop
+	 * iteration are compressed and flushed together
+	 */
+	bool IsCorked();
+
+	size_t getSendQSize() const;
+
 	/** Send one or more complete lines down the socket
 	 */
 	void WriteLine(std::string line);
 
+	/** Send a line made by SpanningTreeUtilities::PrepareLine, which may
+	 * also be queued on other sockets
+	 */
+	void WriteLine(const reference<SendQueueSegment>& line);
+
 	/** Handle ERROR command */
 	void Error(parameterlist &params);
 
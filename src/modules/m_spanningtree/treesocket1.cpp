@@ -51,6 +51,10 @@ TreeSocket::TreeSocket(SpanningTreeUtilities* Util, Link* link, Autoconnect* mya
 	proto_version = 0;
 	ConnectionFailureShown = false;
 	LinkState = CONNECTING;
+	CompressLevel = 0;
+	deflater = inflater = NULL;
+	recvq_plain = 0;
+	wire_out = plain_out = wire_in = plain_in = 0;
 	if (!link->Hook.empty())
 	{
 		ServiceProvider* prov = ServerInstance->Modules->FindService(SERVICE_IOHOOK, link->Hook);
@@ -81,6 +85,10 @@ TreeSocket::TreeSocket(SpanningTreeUtilities* Util, int newfd, ListenSocket* via
 	proto_version = 0;
 	ConnectionFailureShown = false;
 	linkID = "inbound from " + client->addr();
+	CompressLevel = 0;
+	deflater = inflater = NULL;
+	recvq_plain = 0;
+	wire_out = plain_out = wire_in = plain_in = 0;
 
 	FOREACH_MOD(I_OnHookIO, OnHookIO(this, via));
 	if (GetIOHook())
@@ -116,6 +124,7 @@ TreeSocket::~TreeSocket()
 {
 	if (capab)
 		delete capab;
+	CleanCompression();
 }
 
 /** When an outbound connection finishes connecting, we receive
@@ -155,7 +164,7 @@ void TreeSocket::SendError(const std::string &errormessage)
  * is having a REAL bad hair day, this function shouldnt be called
  * too many times a month ;-)
  */
-void TreeSocket::SquitServer(std::string &from, TreeServer* Current, int& num_lost_servers, int& num_lost_users)
+void TreeSocket::SquitServer(std::string &from, TreeServer* Current, int& num_lost_servers, std::vector<User*>& lost_users)
 {
 	std::string servername = Current->GetName();
 	ServerInstance->Logs->Log("m_spanningtree",DEBUG,"SquitServer for %s from %s",
@@ -167,11 +176,11 @@ void TreeSocket::SquitServer(std::string &from, TreeServer* Current, int& num_lo
 	for (unsigned int q = 0; q < Current->ChildCount(); q++)
 	{
 		TreeServer* recursive_server = Current->GetChild(q);
-		this->SquitServer(from,recursive_server, num_lost_servers, num_lost_users);
+		this->SquitServer(from,recursive_server, num_lost_servers, lost_users);
 	}
 	/* Now we've whacked the kids, whack self */
 	num_lost_servers++;
-	num_lost_users += Current->QuitUsers(from);
+	Current->GetSplitUsers(lost_users);
 }
 
 /** This is a wrapper function for SquitServer above, which
@@ -204,9 +213,16 @@ void TreeSocket::Squit(TreeServer* Current, const std::string &reason)
 			ServerInstance->SNO->WriteGlobalSno('L', "Server \002"+Current->GetName()+"\002 split from server \002"+Current->GetParent()->GetName()+"\002 with reason: "+reason);
 		}
 		int num_lost_servers = 0;
-		int num_lost_users = 0;
+		std::vector<User*> lost_users;
 		std::string from = Current->GetParent()->GetName()+" "+Current->GetName();
-		SquitServer(from, Current, num_lost_servers, num_lost_users);
+		SquitServer(from, Current, num_lost_servers, lost_users);
+
+		/* Quit them all at once, so everyone gets all the quits in one go */
+		if (ServerInstance->Config->HideSplits)
+			ServerInstance->Users->QuitUsers(lost_users, "*.net *.split", from.c_str());
+		else
+			ServerInstance->Users->QuitUsers(lost_users, from);
+		int num_lost_users = lost_users.size();
 		ServerInstance->SNO->WriteToSnoMask(LocalSquit ? 'l' : 'L', "Netsplit complete, lost \002%d\002 user%s on \002%d\002 server%s.",
 			num_lost_users, num_lost_users != 1 ? "s" : "", num_lost_servers, num_lost_servers != 1 ? "s" : "");
 		Current->Tidy();
@@ -228,6 +244,21 @@ void TreeSocket::Squit(TreeServer* Current, const std::string &reason)
  */
 void TreeSocket::OnDataReady()
 {
+	/* Anything after the unprocessed data we already had is new, and needs
+	 * decompressing if the other side compresses what it sends
+	 */
+	std::string::size_type start = recvq_pos + recvq_plain;
+	if (start > recvq.length())
+		start = recvq.length();
+	wire_in += recvq.length() - start;
+	if (inflater)
+	{
+		if (!Inflate(start))
+			return;
+	}
+	else
+		plain_in += recvq.length() - start;
+
 	Utils->Creator->loopCall = true;
 	std::string line;
 	while (GetNextLine(line))
@@ -244,6 +275,7 @@ void TreeSocket::OnDataReady()
 		if (!getError().empty())
 			break;
 	}
+	recvq_plain = recvq.length() - recvq_pos;
 	if (LinkState != CONNECTED && recvq.length() > 4096)
 		SendError("RecvQ overrun (line too long)");
 	Utils->Creator->loopCall = false;
@@ -91,6 +91,12 @@ void TreeSocket::ProcessLine(std::string &line)
 	if (command.empty())
 		return;
 
+	if (command == "COMPRESS")
+	{
+		this->StartDecompression(params);
+		return;
+	}
+
 	switch (this->LinkState)
 	{
 		case WAIT_AUTH_1:
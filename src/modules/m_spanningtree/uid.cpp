@@ -143,7 +143,7 @@ CmdResult CommandUID::Handle(const parameterlist &params, User* serversrc)
 	_new->SetClientIP(params[6].c_str());
 
 	ServerInstance->Users->AddGlobalClone(_new);
-	remoteserver->SetUserCount(1); // increment by 1
+	remoteserver->AddUser(_new);
 
 	bool dosend = true;
 
@@ -130,7 +130,7 @@ TreeServer* SpanningTreeUtilities::FindServerID(const std::string &id)
 		return NULL;
 }
 
-SpanningTreeUtilities::SpanningTreeUtilities(ModuleSpanningTree* C) : Creator(C)
+SpanningTreeUtilities::SpanningTreeUtilities(ModuleSpanningTree* C) : Creator(C), RouteCounts("spanningtree_routes", C)
 {
 	ServerInstance->Logs->Log("m_spanningtree",DEBUG,"***** Using SID for hash: %s *****", ServerInstance->Config->GetSID().c_str());
 
@@ -174,6 +174,10 @@ void SpanningTreeUtilities::AddThisServer(TreeServer* server, TreeServerList &li
 /* returns a list of DIRECT servernames for a specific channel */
 void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeServerList &list, char status, const CUList &exempt_list)
 {
+	ChannelRoutes* routes = RouteCounts.get(c);
+	if (!routes)
+		return;
+
 	unsigned int minrank = 0;
 	if (status)
 	{
@@ -182,6 +186,25 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeServerLis
 			minrank = mh->GetPrefixRank();
 	}
 
+	if (!minrank)
+	{
+		/* A route is only left out if all the members behind it are exempt */
+		ChannelRoutes exempt;
+		for (CUList::const_iterator i = exempt_list.begin(); i != exempt_list.end(); ++i)
+		{
+			if (!IS_LOCAL(*i) && c->HasUser(*i))
+				exempt[this->BestRouteTo((*i)->server)]++;
+		}
+
+		for (ChannelRoutes::iterator i = routes->begin(); i != routes->end(); ++i)
+		{
+			ChannelRoutes::iterator e = exempt.find(i->first);
+			if (e == exempt.end() || e->second < i->second)
+				AddThisServer(i->first, list);
+		}
+		return;
+	}
+
 	const UserMembList *ulist = c->GetUsers();
 
 	for (UserMembCIter i = ulist->begin(); i != ulist->end(); i++)
@@ -202,15 +225,66 @@ void SpanningTreeUtilities::GetListOfServersForChannel(Channel* c, TreeServerLis
 	return;
 }
 
-bool SpanningTreeUtilities::DoOneToAllButSender(const std::string &prefix, const std::string &command, const parameterlist &params, std::string omit)
+reference<SendQueueSegment> SpanningTreeUtilities::PrepareLine(const std::string &prefix, const std::string &command, const parameterlist &params)
 {
-	TreeServer* omitroute = this->BestRouteTo(omit);
-	std::string FullLine = ":" + prefix + " " + command;
-	unsigned int words = params.size();
-	for (unsigned int x = 0; x < words; x++)
+	std::string::size_type length = prefix.length() + command.length() + 3;
+	for (parameterlist::const_iterator i = params.begin(); i != params.end(); ++i)
+		length += i->length() + 1;
+
+	SendQueueSegment* line = new SendQueueSegment;
+	line->data.reserve(length);
+	line->data.append(1, ':').append(prefix).append(1, ' ').append(command);
+	for (parameterlist::const_iterator i = params.begin(); i != params.end(); ++i)
+		line->data.append(1, ' ').append(*i);
+	line->data.append(1, '\n');
+	return line;
+}
+
+reference<SendQueueSegment> SpanningTreeUtilities::PrepareLine(const std::string &text)
+{
+	SendQueueSegment* line = new SendQueueSegment;
+	line->data.reserve(text.length() + 1);
+	line->data.append(text).append(1, '\n');
+	return line;
+}
+
+void SpanningTreeUtilities::AddChannelRoute(Channel* c, User* user)
+{
+	TreeServer* route = this->BestRouteTo(user->server);
+	if (!route)
+		return;
+
+	ChannelRoutes* routes = RouteCounts.get(c);
+	if (!routes)
 	{
-		FullLine = FullLine + " " + params[x];
+		routes = new ChannelRoutes;
+		RouteCounts.set(c, routes);
 	}
+	(*routes)[route]++;
+}
+
+void SpanningTreeUtilities::DelChannelRoute(Channel* c, User* user)
+{
+	ChannelRoutes* routes = RouteCounts.get(c);
+	if (!routes)
+		return;
+
+	ChannelRoutes::iterator i = routes->find(this->BestRouteTo(user->server));
+	if (i == routes->end())
+		return;
+
+	if (!--i->second)
+	{
+		routes->erase(i);
+		if (routes->empty())
+			RouteCounts.unset(c);
+	}
+}
+
+bool SpanningTreeUtilities::DoOneToAllButSender(const std::string &prefix, const std::string &command, const parameterlist &params, std::string omit)
+{
+	TreeServer* omitroute = this->BestRouteTo(omit);
+	reference<SendQueueSegment> FullLine = PrepareLine(prefix, command, params);
 	unsigned int items = this->TreeRoot->ChildCount();
 	for (unsigned int x = 0; x < items; x++)
 	{
@@ -231,12 +305,7 @@ bool SpanningTreeUtilities::DoOneToAllButSender(const std::string &prefix, const
 
 bool SpanningTreeUtilities::DoOneToMany(const std::string &prefix, const std::string &command, const parameterlist &params)
 {
-	std::string FullLine = ":" + prefix + " " + command;
-	unsigned int words = params.size();
-	for (unsigned int x = 0; x < words; x++)
-	{
-		FullLine = FullLine + " " + params[x];
-	}
+	reference<SendQueueSegment> FullLine = PrepareLine(prefix, command, params);
 	unsigned int items = this->TreeRoot->ChildCount();
 	for (unsigned int x = 0; x < items; x++)
 	{
@@ -270,17 +339,11 @@ bool SpanningTreeUtilities::DoOneToOne(const std::string &prefix, const std::str
 	TreeServer* Route = this->BestRouteTo(target);
 	if (Route)
 	{
-		std::string FullLine = ":" + prefix + " " + command;
-		unsigned int words = params.size();
-		for (unsigned int x = 0; x < words; x++)
-		{
-			FullLine = FullLine + " " + params[x];
-		}
 		if (Route && Route->GetSocket())
 		{
 			TreeSocket* Sock = Route->GetSocket();
 			if (Sock)
-				Sock->WriteLine(FullLine);
+				Sock->WriteLine(PrepareLine(prefix, command, params));
 		}
 		return true;
 	}
@@ -364,6 +427,7 @@ void SpanningTreeUtilities::ReadConfiguration()
 		L->Hook = tag->getString("ssl");
 		L->Bind = tag->getString("bind");
 		L->Hidden = tag->getBool("hidden");
+		L->Compress = tag->getInt("compress");
 
 		if (L->Name.empty())
 			throw ModuleException("Invalid configuration, found a link tag without a name!" + (!L->IPAddr.empty() ? " IP address: "+L->IPAddr : ""));
@@ -374,6 +438,9 @@ void SpanningTreeUtilities::ReadConfiguration()
 		if (L->Name.length() > 64)
 			throw ModuleException("The link name '"+assign(L->Name)+"' is invalid as it is longer than 64 characters");
 
+		if (L->Compress < 0 || L->Compress > 9)
+			throw ModuleException("Invalid configuration for link '"+assign(L->Name)+"', compress must be between 0 and 9");
+
 		if (L->RecvPass.empty())
 			throw ModuleException("Invalid configuration for server '"+assign(L->Name)+"', recvpass not defined");
 
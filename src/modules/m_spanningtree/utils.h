@@ -44,6 +44,10 @@ class SpanningTreeUtilities;
 
 typedef std::map<TreeServer*,TreeServer*> TreeServerList;
 
+/** The number of remote members of a channel behind each directly linked server
+ */
+typedef std::map<TreeServer*, unsigned int> ChannelRoutes;
+
 /** Contains helper functions and variables for this module,
  * and keeps them out of the global namespace
  */
@@ -113,6 +117,12 @@ class SpanningTreeUtilities : public classbase
 	 */
 	int PingFreq;
 
+	/** The routes to the remote members of each channel, kept up to date
+	 * as they join and leave so that channel messages don't need to look
+	 * at every member to find the servers to send them to
+	 */
+	SimpleExtItem<ChannelRoutes> RouteCounts;
+
 	/** Initialise utility class
 	 */
 	SpanningTreeUtilities(ModuleSpanningTree* Creator);
@@ -127,6 +137,15 @@ class SpanningTreeUtilities : public classbase
 
 	void RouteCommand(TreeServer*, const std::string&, const parameterlist&, User*);
 
+	/** Build a line to send to other servers. The same line can be
+	 * written to any number of TreeSockets without being copied.
+	 */
+	static reference<SendQueueSegment> PrepareLine(const std::string &prefix, const std::string &command, const parameterlist &params);
+
+	/** Build a line to send to other servers from its text
+	 */
+	static reference<SendQueueSegment> PrepareLine(const std::string &text);
+
 	/** Send a message from this server to one other local or remote
 	 */
 	bool DoOneToOne(const std::string &prefix, const std::string &command, const parameterlist &params, std::string target);
@@ -159,6 +178,14 @@ class SpanningTreeUtilities : public classbase
 	 */
 	void GetListOfServersForChannel(Channel* c, TreeServerList &list, char status, const CUList &exempt_list);
 
+	/** Count a remote user which joined a channel in the channel's routes
+	 */
+	void AddChannelRoute(Channel* c, User* user);
+
+	/** Stop counting a remote user which is leaving a channel
+	 */
+	void DelChannelRoute(Channel* c, User* user);
+
 	/** Find a server by name
 	 */
 	TreeServer* FindServer(const std::string &ServerName);
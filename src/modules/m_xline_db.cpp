@@ -20,16 +20,96 @@
 
 #include "inspircd.h"
 #include "xline.h"
+#include "threadengine.h"
 
-/* $ModConfig: <xlinedb filename="data/xline.db">
- *  Specify the filename for the xline database here*/
+/* $ModConfig: <xlinedb filename="data/xline.db" sync="periodic">
+ *  Specify the filename for the xline database here, and how often it is flushed to disk*/
 /* $ModDesc: Keeps a dynamic log of all XLines created, and stores them in a seperate conf file (xline.db). */
 
+/** The database is compacted once it holds at least this many records,
+ * and twice as many records as there were lines when it was last compacted.
+ */
+static const unsigned int COMPACT_MIN_RECORDS = 1000;
+
+/** How often the journal is synced to disk */
+enum SyncPolicy
+{
+	/** After every record */
+	SYNC_ALWAYS,
+	/** Every few seconds, if anything was written */
+	SYNC_PERIODIC,
+	/** Never; left to the operating system */
+	SYNC_NEVER
+};
+
+static int SyncFile(FILE* f)
+{
+	if (fflush(f))
+		return -1;
+#ifdef _WIN32
+	return _commit(_fileno(f));
+#else
+	return fsync(fileno(f));
+#endif
+}
+
+/** Writes a snapshot of all lines to a new database file, away from the main thread.
+ * Records journaled while this runs are appended by ModuleXLineDB::FinishCompaction().
+ */
+class XLineDBCompactor : public Thread
+{
+ public:
+	const std::string path;
+	const std::string data;
+	const unsigned int lines;
+	int error;
+	volatile bool done;
+
+	XLineDBCompactor(const std::string& newpath, const std::string& contents, unsigned int count)
+		: path(newpath), data(contents), lines(count), error(0), done(false)
+	{
+	}
+
+	void Run()
+	{
+		FILE* f = fopen(path.c_str(), "w");
+		if (!f)
+		{
+			error = errno;
+		}
+		else
+		{
+			if (fwrite(data.data(), 1, data.length(), f) != data.length() || SyncFile(f))
+				error = errno;
+			if (fclose(f) && !error)
+				error = errno;
+		}
+		done = true;
+	}
+};
+
 class ModuleXLineDB : public Module
 {
-	bool dirty;
 	std::string xlinedbpath;
+	SyncPolicy sync;
+	/** The database, opened for appending records */
+	FILE* journal;
+	/** True if records were written since the journal was last synced */
+	bool unsynced;
+	/** True if the database should be compacted even if it is small */
+	bool needcompact;
+	/** Number of records in the database, and number of lines it was last compacted to */
+	unsigned int records;
+	unsigned int compactedlines;
+	XLineDBCompactor* compactor;
+	/** Records written while the compactor runs */
+	std::vector<std::string> tail;
+
  public:
+	ModuleXLineDB() : journal(NULL), unsynced(false), needcompact(false), records(0), compactedlines(0), compactor(NULL)
+	{
+	}
+
 	void init()
 	{
 		/* Load the configuration
@@ -40,17 +120,41 @@ class ModuleXLineDB : public Module
 		 */
 		ConfigTag* Conf = ServerInstance->Config->ConfValue("xlinedb");
 		xlinedbpath = Conf->getString("filename", DATA_PATH "/xline.db");
+		OnRehash(NULL);
 
-		// Read xlines before attaching to events
-		ReadDatabase();
+		// Read xlines before attaching to events; an unreadable database is replaced by a new one
+		if (!ReadDatabase())
+			needcompact = true;
+		OpenJournal();
 
-		Implementation eventlist[] = { I_OnAddLine, I_OnDelLine, I_OnExpireLine, I_OnBackgroundTimer };
+		Implementation eventlist[] = { I_OnAddLine, I_OnDelLine, I_OnBackgroundTimer, I_OnRehash };
 		ServerInstance->Modules->Attach(eventlist, this, sizeof(eventlist)/sizeof(Implementation));
-		dirty = false;
 	}
 
 	virtual ~ModuleXLineDB()
 	{
+		if (compactor)
+		{
+			compactor->join();
+			FinishCompaction();
+		}
+		if (journal)
+		{
+			if (sync != SYNC_NEVER)
+				SyncFile(journal);
+			fclose(journal);
+		}
+	}
+
+	void OnRehash(User* user)
+	{
+		std::string policy = ServerInstance->Config->ConfValue("xlinedb")->getString("sync", "periodic");
+		if (policy == "always")
+			sync = SYNC_ALWAYS;
+		else if (policy == "never")
+			sync = SYNC_NEVER;
+		else
+			sync = SYNC_PERIODIC;
 	}
 
 	/** Called whenever an xline is added by a local user.
@@ -60,7 +164,7 @@ class ModuleXLineDB : public Module
 	 */
 	void OnAddLine(User* source, XLine* line)
 	{
-		dirty = true;
+		WriteRecord(LineRecord(line));
 	}
 
 	/** Called whenever an xline is deleted.
@@ -70,44 +174,84 @@ class ModuleXLineDB : public Module
 	 */
 	void OnDelLine(User* source, XLine* line)
 	{
-		dirty = true;
+		WriteRecord("DEL " + line->type + " " + line->Displayable() + "\n");
 	}
 
-	void OnExpireLine(XLine *line)
-	{
-		dirty = true;
-	}
+	/* Expired lines are not journaled; they are dropped when the database is read */
 
 	void OnBackgroundTimer(time_t now)
 	{
-		if (dirty)
+		if (compactor && compactor->done)
+		{
+			compactor->join();
+			FinishCompaction();
+		}
+
+		if (journal && unsynced)
 		{
-			if (WriteDatabase())
-				dirty = false;
+			if (SyncFile(journal))
+				ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Cannot sync database! %s (%d)", strerror(errno), errno);
+			unsynced = false;
 		}
+
+		if (!compactor && (!journal || needcompact || (records >= COMPACT_MIN_RECORDS && records > compactedlines * 2)))
+			StartCompaction();
 	}
 
-	bool WriteDatabase()
+	std::string LineRecord(XLine* line)
 	{
-		FILE *f;
+		return "LINE " + line->type + " " + line->Displayable() + " " + ServerInstance->Config->ServerName + " " +
+			ConvToStr((unsigned long)line->set_time) + " " + ConvToStr((unsigned long)line->duration) + " :" + line->reason + "\n";
+	}
 
-		/*
-		 * We need to perform an atomic write so as not to fuck things up.
-		 * So, let's write to a temporary file, flush and sync the FD, then rename the file..
-		 * Technically, that means that this can block, but I have *never* seen that.
-		 *		-- w00t
-		 */
-		ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Opening temporary database");
-		std::string xlinenewdbpath = xlinedbpath + ".new";
-		f = fopen(xlinenewdbpath.c_str(), "w");
-		if (!f)
+	void WriteRecord(const std::string& record)
+	{
+		records++;
+		if (compactor)
+			tail.push_back(record);
+		if (!journal)
+			return;
+
+		if (fputs(record.c_str(), journal) < 0 || fflush(journal))
+		{
+			ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Cannot write to database! %s (%d)", strerror(errno), errno);
+			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot write to db: %s (%d)", strerror(errno), errno);
+			// Rewrite it from scratch at the next background timer
+			fclose(journal);
+			journal = NULL;
+			return;
+		}
+
+		if (sync == SYNC_ALWAYS)
+			SyncFile(journal);
+		else if (sync == SYNC_PERIODIC)
+			unsynced = true;
+	}
+
+	void OpenJournal()
+	{
+		ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Opening database for appending");
+		journal = fopen(xlinedbpath.c_str(), "a");
+		if (!journal)
 		{
-			ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Cannot create database! %s (%d)", strerror(errno), errno);
-			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot create new db: %s (%d)", strerror(errno), errno);
-			return false;
+			ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Cannot open database! %s (%d)", strerror(errno), errno);
+			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot open db: %s (%d)", strerror(errno), errno);
+			return;
 		}
 
-		ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Opened. Writing..");
+		// A new file needs its header; older versions did not know about DEL records
+		fseek(journal, 0, SEEK_END);
+		if (ftell(journal) == 0)
+			fputs("VERSION 2\n", journal);
+	}
+
+	/** Start writing all current lines to a new database in the background.
+	 * The lines are formatted here, only the disk I/O is done by the thread.
+	 */
+	void StartCompaction()
+	{
+		std::string data = "VERSION 2\n";
+		unsigned int count = 0;
 
 		/*
 		 * Now, much as I hate writing semi-unportable formats, additional
@@ -116,9 +260,6 @@ class ModuleXLineDB : public Module
 		 * semblance of backwards compatibility for reading on startup..
 		 * 		-- w00t
 		 */
-		fprintf(f, "VERSION 1\n");
-
-		// Now, let's write.
 		std::vector<std::string> types = ServerInstance->XLines->GetAllTypes();
 		for (std::vector<std::string>::const_iterator it = types.begin(); it != types.end(); ++it)
 		{
@@ -128,22 +269,65 @@ class ModuleXLineDB : public Module
 
 			for (LookupIter i = lookup->begin(); i != lookup->end(); ++i)
 			{
-				XLine* line = i->second;
-				fprintf(f, "LINE %s %s %s %lu %lu :%s\n", line->type.c_str(), line->Displayable(),
-					ServerInstance->Config->ServerName.c_str(), (unsigned long)line->set_time, (unsigned long)line->duration, line->reason.c_str());
+				data.append(LineRecord(i->second));
+				count++;
 			}
 		}
 
-		ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Finished writing XLines. Checking for error..");
+		ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Compacting %u records to %u lines", records, count);
+		compactor = new XLineDBCompactor(xlinedbpath + ".new", data, count);
+		tail.clear();
+		needcompact = false;
+		try
+		{
+			ServerInstance->Threads->Start(compactor);
+		}
+		catch (CoreException& e)
+		{
+			ServerInstance->Logs->Log("m_xline_db",DEFAULT, "xlinedb: Cannot start compaction: %s", e.GetReason());
+			delete compactor;
+			compactor = NULL;
+		}
+	}
 
-		int write_error = 0;
-		write_error = ferror(f);
-		write_error |= fclose(f);
-		if (write_error)
+	/** Called in the main thread once the compactor is done, to append the records
+	 * written in the meantime and replace the database with the new one.
+	 */
+	void FinishCompaction()
+	{
+		XLineDBCompactor* c = compactor;
+		compactor = NULL;
+		std::string xlinenewdbpath = c->path;
+		unsigned int lines = c->lines;
+		int error = c->error;
+		delete c;
+
+		if (error)
+		{
+			ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Cannot write to new database! %s (%d)", strerror(error), error);
+			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot write to new db: %s (%d)", strerror(error), error);
+			return;
+		}
+
+		FILE* f = fopen(xlinenewdbpath.c_str(), "a");
+		if (f)
+		{
+			for (std::vector<std::string>::const_iterator i = tail.begin(); i != tail.end(); ++i)
+				fputs(i->c_str(), f);
+			error = ferror(f) | SyncFile(f);
+			error |= fclose(f);
+		}
+		if (!f || error)
 		{
 			ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Cannot write to new database! %s (%d)", strerror(errno), errno);
 			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot write to new db: %s (%d)", strerror(errno), errno);
-			return false;
+			return;
+		}
+
+		if (journal)
+		{
+			fclose(journal);
+			journal = NULL;
 		}
 
 #ifdef _WIN32
@@ -151,7 +335,8 @@ class ModuleXLineDB : public Module
 		{
 			ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Cannot remove old database! %s (%d)", strerror(errno), errno);
 			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot remove old database: %s (%d)", strerror(errno), errno);
-			return false;
+			OpenJournal();
+			return;
 		}
 #endif
 		// Use rename to move temporary to new db - this is guarenteed not to fuck up, even in case of a crash.
@@ -159,10 +344,16 @@ class ModuleXLineDB : public Module
 		{
 			ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Cannot move new to old database! %s (%d)", strerror(errno), errno);
 			ServerInstance->SNO->WriteToSnoMask('a', "database: cannot replace old with new db: %s (%d)", strerror(errno), errno);
-			return false;
+		}
+		else
+		{
+			records = lines + tail.size();
+			compactedlines = lines;
 		}
 
-		return true;
+		tail.clear();
+		unsynced = false;
+		OpenJournal();
 	}
 
 	bool ReadDatabase()
@@ -187,6 +378,13 @@ class ModuleXLineDB : public Module
 			}
 		}
 
+		/* Records are replayed here, so that each line which was deleted or
+		 * replaced later in the journal is never added to the XLineManager.
+		 * The lines left are then added in one go.
+		 */
+		std::vector<XLine*> lines;
+		std::map<std::string, std::map<irc::string, size_t> > positions;
+
 		while (fgets(linebuf, MAXBUF, f))
 		{
 			char *c = linebuf;
@@ -217,13 +415,17 @@ class ModuleXLineDB : public Module
 
 			if (command_p[0] == "VERSION")
 			{
-				if (command_p[1] == "1")
+				if (command_p[1] == "1" || command_p[1] == "2")
 				{
 					ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: Reading db version %s", command_p[1].c_str());
+					// Rewrite old databases with the current version, so they are not appended to
+					needcompact = (command_p[1] != "2");
 				}
 				else
 				{
 					fclose(f);
+					for (std::vector<XLine*>::iterator i = lines.begin(); i != lines.end(); ++i)
+						delete *i;
 					ServerInstance->Logs->Log("m_xline_db",DEBUG, "xlinedb: I got database version %s - I don't understand it", command_p[1].c_str());
 					ServerInstance->SNO->WriteToSnoMask('a', "database: I got a database version (%s) I don't understand", command_p[1].c_str());
 					return false;
@@ -231,6 +433,8 @@ class ModuleXLineDB : public Module
 			}
 			else if (command_p[0] == "LINE")
 			{
+				records++;
+
 				// Mercilessly stolen from spanningtree
 				XLineFactory* xlf = ServerInstance->XLines->GetFactory(command_p[1]);
 
@@ -243,21 +447,41 @@ class ModuleXLineDB : public Module
 				XLine* xl = xlf->Generate(ServerInstance->Time(), atoi(command_p[5].c_str()), command_p[3], command_p[6], command_p[2]);
 				xl->SetCreateTime(atoi(command_p[4].c_str()));
 
-				if (ServerInstance->XLines->AddLine(xl, NULL))
+				// Lines are only journaled once added, so a later line replaces an earlier (expired) one
+				size_t& pos = positions[xl->type].insert(std::make_pair(xl->Displayable(), lines.size())).first->second;
+				if (pos != lines.size())
 				{
-					ServerInstance->SNO->WriteToSnoMask('x', "database: Added a line of type %s", command_p[1].c_str());
+					delete lines[pos];
+					lines[pos] = NULL;
+					pos = lines.size();
 				}
-				else
-					delete xl;
+				lines.push_back(xl);
+			}
+			else if (command_p[0] == "DEL")
+			{
+				records++;
+
+				std::map<std::string, std::map<irc::string, size_t> >::iterator t = positions.find(command_p[1]);
+				if (t == positions.end())
+					continue;
+				std::map<irc::string, size_t>::iterator l = t->second.find(command_p[2].c_str());
+				if (l == t->second.end())
+					continue;
+				delete lines[l->second];
+				lines[l->second] = NULL;
+				t->second.erase(l);
 			}
 		}
 
 		fclose(f);
+
+		lines.erase(std::remove(lines.begin(), lines.end(), (XLine*)NULL), lines.end());
+		size_t count = lines.size();
+		compactedlines = ServerInstance->XLines->AddLines(lines, NULL);
+		ServerInstance->SNO->WriteToSnoMask('x', "database: Added %u of %u lines", compactedlines, (unsigned int)count);
 		return true;
 	}
 
-
-
 	virtual Version GetVersion()
 	{
 		return Version("Keeps a dynamic log of all XLines created, and stores them in a separate conf file (xline.db).", VF_VENDOR);
@@ -265,4 +489,3 @@ class ModuleXLineDB : public Module
 };
 
 MODULE_INIT(ModuleXLineDB)
-
@@ -48,9 +48,82 @@ public:
 	unsigned int limit;
 };
 
-/** Items stored in the channel's list
+/** Items stored in the channel's list, in the order they were added,
+ * along with an index on their masks so that adding or removing an
+ * entry does not have to scan the whole list.
  */
-typedef std::list<ListItem> modelist;
+class modelist
+{
+	typedef std::list<ListItem> itemlist;
+	typedef nspace::hash_map<std::string, itemlist::iterator> itemindex;
+
+	itemlist items;
+	itemindex index;
+
+	void Reindex()
+	{
+		index.clear();
+		for (itemlist::iterator it = items.begin(); it != items.end(); ++it)
+			index[it->mask] = it;
+	}
+
+ public:
+	/** Items can't be changed through an iterator, as that would bypass the index */
+	typedef itemlist::const_iterator iterator;
+	typedef itemlist::const_iterator const_iterator;
+	typedef itemlist::const_reverse_iterator reverse_iterator;
+	typedef itemlist::const_reverse_iterator const_reverse_iterator;
+
+	modelist() { }
+	modelist(const modelist& other) : items(other.items) { Reindex(); }
+	modelist& operator=(const modelist& other)
+	{
+		items = other.items;
+		Reindex();
+		return *this;
+	}
+
+	iterator begin() const { return items.begin(); }
+	iterator end() const { return items.end(); }
+	reverse_iterator rbegin() const { return items.rbegin(); }
+	reverse_iterator rend() const { return items.rend(); }
+	size_t size() const { return index.size(); }
+	bool empty() const { return index.empty(); }
+
+	/** Find the entry with the given mask
+	 * @return The entry, or end() if there is none
+	 */
+	iterator find(const std::string& mask) const
+	{
+		itemindex::const_iterator i = index.find(mask);
+		return (i == index.end()) ? items.end() : iterator(i->second);
+	}
+
+	/** Add an entry to the end of the list
+	 * @return False if an entry with the same mask is already on the list
+	 */
+	bool push_back(const ListItem& item)
+	{
+		if (index.find(item.mask) != index.end())
+			return false;
+		index[item.mask] = items.insert(items.end(), item);
+		return true;
+	}
+
+	/** Remove the entry with the given mask
+	 * @return False if there was no such entry
+	 */
+	bool erase(const std::string& mask)
+	{
+		itemindex::iterator i = index.find(mask);
+		if (i == index.end())
+			return false;
+		items.erase(i->second);
+		index.erase(i);
+		return true;
+	}
+};
+
 /** Max items per channel by name
  */
 typedef std::list<ListLimit> limitlist;
@@ -107,16 +180,8 @@ class ListModeBase : public ModeHandler
 	std::pair<bool,std::string> ModeSet(User*, User*, Channel* channel, const std::string &parameter)
 	{
 		modelist* el = extItem.get(channel);
-		if (el)
-		{
-			for (modelist::iterator it = el->begin(); it != el->end(); it++)
-			{
-				if(parameter == it->mask)
-				{
-					return std::make_pair(true, parameter);
-				}
-			}
-		}
+		if (el && el->find(parameter) != el->end())
+			return std::make_pair(true, parameter);
 		return std::make_pair(false, parameter);
 	}
 
@@ -245,16 +310,13 @@ class ListModeBase : public ModeHandler
 			}
 
 			// Check if the item already exists in the list
-			for (modelist::iterator it = el->begin(); it != el->end(); it++)
+			if (el->find(parameter) != el->end())
 			{
-				if (parameter == it->mask)
-				{
-					/* Give a subclass a chance to error about this */
-					TellAlreadyOnList(source, channel, parameter);
+				/* Give a subclass a chance to error about this */
+				TellAlreadyOnList(source, channel, parameter);
 
-					// it does, deny the change
-					return MODEACTION_DENY;
-				}
+				// it does, deny the change
+				return MODEACTION_DENY;
 			}
 
 			unsigned int maxsize = 0;
@@ -311,17 +373,13 @@ class ListModeBase : public ModeHandler
 			// We're taking the mode off
 			if (el)
 			{
-				for (modelist::iterator it = el->begin(); it != el->end(); it++)
+				if (el->erase(parameter))
 				{
-					if (parameter == it->mask)
+					if (el->empty())
 					{
-						el->erase(it);
-						if (el->size() == 0)
-						{
-							extItem.unset(channel);
-						}
-						return MODEACTION_ALLOW;
+						extItem.unset(channel);
 					}
+					return MODEACTION_ALLOW;
 				}
 				/* Tried to remove something that wasn't set */
 				TellNotSet(source, channel, parameter);
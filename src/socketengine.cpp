@@ -36,7 +36,9 @@ void EventHandler::SetFd(int FD)
 
 SocketEngine::SocketEngine()
 {
-	TotalEvents = WriteEvents = ReadEvents = ErrorEvents = 0;
+	TotalEvents = WriteEvents = ReadEvents = ErrorEvents = CorkedWrites = 0;
+	flushing_corked = false;
+	NoWait = false;
 	lastempty = ServerInstance->Time();
 	indata = outdata = 0;
 }
@@ -94,6 +96,38 @@ void SocketEngine::DispatchTrialWrites()
 	}
 }
 
+bool SocketEngine::CorkWrite(EventHandler* eh, bool event)
+{
+	if (flushing_corked)
+		return false;
+	int fd = eh->GetFd();
+	corked.insert(fd);
+	if (event)
+		corked_events.insert(fd);
+	else if (corked_events.erase(fd))
+		CorkedWrites++;
+	return true;
+}
+
+void SocketEngine::FlushCorked()
+{
+	if (corked.empty())
+		return;
+	std::vector<int> working_list;
+	working_list.reserve(corked.size());
+	working_list.assign(corked.begin(), corked.end());
+	corked.clear();
+	corked_events.clear();
+	flushing_corked = true;
+	for(unsigned int i=0; i < working_list.size(); i++)
+	{
+		EventHandler* eh = GetRef(working_list[i]);
+		if (eh && !(eh->GetEventMask() & FD_WRITE_WILL_BLOCK))
+			eh->HandleEvent(EVENT_WRITE, 0);
+	}
+	flushing_corked = false;
+}
+
 bool SocketEngine::HasFd(int fd)
 {
 	if ((fd < 0) || (fd > GetMaxFds()))
@@ -192,7 +192,7 @@ int EPollEngine::DispatchEvents()
 {
 	socklen_t codesize = sizeof(int);
 	int errcode;
-	int i = epoll_wait(EngineHandle, events, GetMaxFds() - 1, 1000);
+	int i = epoll_wait(EngineHandle, events, GetMaxFds() - 1, NoWait ? 0 : 1000);
 	ServerInstance->UpdateTime();
 
 	TotalEvents += i;
@@ -258,7 +258,15 @@ std::string EPollEngine::GetName()
 	return "epoll";
 }
 
+#ifdef USE_URING
+/* The io_uring engine uses this one if io_uring can't be set up */
+SocketEngine* CreateEPollEngine()
+{
+	return new EPollEngine;
+}
+#else
 SocketEngine* CreateSocketEngine()
 {
 	return new EPollEngine;
 }
+#endif
@@ -132,7 +132,7 @@ void SelectEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 
 int SelectEngine::DispatchEvents()
 {
-	static timeval tval = { 1, 0 };
+	timeval tval = { NoWait ? 0 : 1, 0 };
 
 	fd_set rfdset = ReadSet, wfdset = WriteSet, errfdset = ErrSet;
 
@@ -0,0 +1,1060 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <vector>
+#include <string>
+#include <map>
+#include "inspircd.h"
+#include "exitcodes.h"
+#include "socketengine.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <ulimit.h>
+#include <iostream>
+
+/** Number of submission queue entries. Requests for every fd touched
+ * during one loop iteration are queued here and handed to the kernel in a
+ * single io_uring_enter() call; if the queue fills up it is flushed early.
+ */
+#define URING_SQ_ENTRIES 4096
+
+/** user_data values which do not refer to a file descriptor */
+#define URING_DATA_TIMEOUT (~(__u64)0)
+#define URING_DATA_REMOVE (~(__u64)0 - 1)
+#define URING_DATA_PROVIDE (~(__u64)0 - 2)
+
+/** Bits of the low word of user_data which mark a receive or a send instead of a poll */
+#define URING_DATA_RECV 0x40000000U
+#define URING_DATA_SEND 0x20000000U
+#define URING_DATA_FD 0x1FFFFFFFU
+
+/** Internal flag stored alongside the poll bits of a multishot poll */
+#define URING_POLL_MULTI 0x80000000U
+
+/** Pool of receive buffers given to the kernel. A receive only takes a buffer
+ * once data has arrived, and it is given back as soon as the handler has read
+ * everything out of it, so idle connections don't hold any.
+ */
+#define URING_RECV_BUFFERS 1024
+#define URING_RECV_BUFSIZE 16384
+#define URING_RECV_GROUP 1
+
+/** Most sendq segments sent together by a single send */
+#define URING_SEND_IOV 128
+
+/** Engine I/O state of a file descriptor */
+#define URING_IO_RECV 0x01	/* a receive is in the kernel */
+#define URING_IO_SEND 0x02	/* a send is in the kernel */
+#define URING_IO_PENDING 0x04	/* the result of a receive is waiting for the handler */
+#define URING_IO_NOBUFS 0x08	/* the buffer pool ran dry, so poll for reads until the next read event */
+#define URING_IO_DIRTY 0x10	/* the requests of the fd are brought up to date before the next submission */
+
+SocketEngine* CreateEPollEngine();
+
+/** A specialisation of the SocketEngine class, designed to use the linux 5.x io_uring interface.
+ *
+ * Every request made during a loop iteration is batched into the submission queue and sent
+ * together with the wait for completions, so one DispatchEvents() call costs a single system
+ * call regardless of the number of event mask changes.
+ *
+ * Handlers which allow it (see EventHandler::EngineIO()) have their data received and sent by
+ * the kernel. A receive (IORING_OP_RECV) picks a buffer from a pool given to the kernel up front
+ * and the handler reads out of that buffer through Recv(). SendSegments() sends straight out of the
+ * sendq segments of a socket (IORING_OP_SENDMSG), and the socket consumes its sendq once the send
+ * is done. Other handlers, and all handlers on kernels older than linux 5.7, get readiness
+ * notifications from IORING_OP_POLL_ADD and do their own I/O exactly as they do under epoll.
+ *
+ * If no ring can be set up at all, the epoll engine is used instead.
+ */
+class URingEngine : public SocketEngine
+{
+private:
+	/** A send made straight out of the sendq of a socket
+	 */
+	struct SendState
+	{
+		/** The socket whose sendq is being sent
+		 */
+		StreamSocket* sock;
+		/** Segments being sent; holding them keeps their data unchanged until the send is done
+		 */
+		std::vector<reference<SendQueueSegment> > segments;
+		/** The data of the segments, and the message pointing at the part of it not sent yet
+		 */
+		struct iovec iov[URING_SEND_IOV];
+		struct msghdr msg;
+		/** Bytes to send, and how many of them have been sent
+		 */
+		size_t len;
+		size_t sent;
+	};
+
+	/** Poll and I/O state of a single file descriptor
+	 */
+	struct PollState
+	{
+		/** Generation counter, bumped whenever the poll request for the fd is replaced.
+		 * Completions carrying an older generation are stale and are ignored.
+		 */
+		__u32 gen;
+		/** Poll bits (plus URING_POLL_MULTI) of the request currently in the kernel, or 0 if none
+		 */
+		unsigned armed;
+		/** Bumped whenever the handler of the fd is removed. Receives and sends carry it,
+		 * so that their completions can be matched with the handler they were made for.
+		 */
+		__u32 life;
+		/** URING_IO_* flags
+		 */
+		unsigned io;
+		/** Buffer holding the received data, and the part of it which is still unread.
+		 * If a pending receive has no data, recv_res is its result (0 or -errno).
+		 */
+		unsigned bid;
+		unsigned recv_off;
+		unsigned recv_len;
+		int recv_res;
+		/** State of the send in the kernel, allocated on the first send and then reused
+		 */
+		SendState* send;
+	};
+
+	int EngineHandle;
+
+	/** Submission queue ring */
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned sq_mask;
+	unsigned* sq_array;
+	struct io_uring_sqe* sqes;
+
+	/** Completion queue ring */
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe* cqes;
+
+	/** Mappings, kept so that they can be released again */
+	void* sq_ring;
+	size_t sq_ring_len;
+	void* cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+
+	/** Per-fd poll state, indexed by fd */
+	PollState* polls;
+
+	/** File descriptors whose requests are brought up to date before the next submission */
+	std::vector<int> dirty;
+
+	/** Receive buffer pool, URING_RECV_BUFFERS buffers of URING_RECV_BUFSIZE bytes */
+	char* recvbufs;
+
+	/** True if the kernel supports multishot polls (linux 5.13+) */
+	bool multishot;
+
+	/** True if receives and sends are done by the kernel for handlers which allow it */
+	bool engineio;
+
+	/** True while a wakeup timeout is queued in the kernel */
+	bool timeout_armed;
+
+	/** The timeout used for the wakeup; the kernel reads this on submission */
+	struct __kernel_timespec timeout;
+
+	/** Set up the rings, returns false if io_uring can't be used */
+	bool SetupRing();
+	/** Release the rings and close the io_uring descriptor */
+	void FreeRing();
+	/** Get a free submission queue entry, flushing the queue to the kernel if needed */
+	struct io_uring_sqe* GetSQE();
+	/** Submit all queued entries, optionally waiting for at least one completion */
+	int Submit(bool wait);
+	/** Replace the poll request in the kernel for the given fd if it differs from the wanted poll bits */
+	void SyncPoll(int fd, unsigned want);
+	/** Translate an event mask to poll bits */
+	unsigned MaskToPoll(int event_mask);
+	/** Have the requests of the given fd brought up to date before the next submission */
+	void MarkDirty(int fd);
+	/** Bring the receive and poll requests of the given fd in line with the event mask of its handler */
+	void SyncIO(int fd);
+	/** Queue a receive into a pool buffer for the given fd */
+	bool QueueRecv(int fd);
+	/** Queue a send of the part of the segments of the given fd which is not sent yet */
+	bool QueueSend(int fd);
+	/** Give count buffers starting at bid back to the kernel */
+	void ProvideBuffers(unsigned bid, unsigned count);
+	/** Drop the result of a receive the handler has not read */
+	void ReleaseRecv(PollState& ps);
+	/** Cancel the receive or send (URING_DATA_RECV or URING_DATA_SEND) in the kernel for the given fd */
+	void CancelIO(int fd, unsigned what);
+	/** Handle the completion of a receive, returns the number of events delivered */
+	int RecvDone(int fd, const struct io_uring_cqe& cqe);
+	/** Handle the completion of a send, returns the number of events delivered */
+	int SendDone(int fd, const struct io_uring_cqe& cqe);
+public:
+	/** Create a new URingEngine
+	 */
+	URingEngine();
+	/** Delete a URingEngine
+	 */
+	virtual ~URingEngine();
+	/** Check whether the engine has a ring to work with
+	 */
+	bool HasRing() { return EngineHandle >= 0; }
+	virtual bool AddFd(EventHandler* eh, int event_mask);
+	virtual void OnSetEvent(EventHandler* eh, int old_mask, int new_mask);
+	virtual void DelFd(EventHandler* eh);
+	virtual int DispatchEvents();
+	virtual std::string GetName();
+	virtual void RecoverFromFork();
+	virtual int Recv(EventHandler* eh, void* buf, size_t len, int flags);
+	virtual int Send(EventHandler* eh, const void* buf, size_t len, int flags);
+	virtual size_t SendSegments(StreamSocket* sock, const std::deque<reference<SendQueueSegment> >& segments, size_t pos);
+	virtual int Shutdown(EventHandler* eh, int how);
+};
+
+static inline unsigned load_acquire(unsigned* p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static inline void store_release(unsigned* p, unsigned v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+URingEngine::URingEngine() : EngineHandle(-1), sqes(NULL), sq_ring(MAP_FAILED), cq_ring(MAP_FAILED), recvbufs(NULL), engineio(false)
+{
+	int max = ulimit(4, 0);
+	if (max > 0)
+	{
+		MAX_DESCRIPTORS = max;
+	}
+	else
+	{
+		ServerInstance->Logs->Log("SOCKET", DEFAULT, "ERROR: Can't determine maximum number of open sockets!");
+		std::cout << "ERROR: Can't determine maximum number of open sockets!" << std::endl;
+		ServerInstance->Exit(EXIT_STATUS_SOCKETENGINE);
+	}
+
+	CurrentSetSize = 0;
+	ref = new EventHandler* [GetMaxFds()];
+	polls = new PollState[GetMaxFds()];
+
+	memset(ref, 0, GetMaxFds() * sizeof(EventHandler*));
+	memset(polls, 0, GetMaxFds() * sizeof(PollState));
+
+	SetupRing();
+}
+
+void URingEngine::RecoverFromFork()
+{
+	/*
+	 * The rings are shared memory mappings and would stay shared with the parent
+	 * process after a fork, so set up a fresh ring. No descriptors are registered
+	 * before the fork, so there is nothing to carry over.
+	 */
+	if (SetupRing())
+		return;
+
+	// For the same reason the epoll engine can simply take over
+	ServerInstance->Logs->Log("SOCKET",DEFAULT, "Falling back to the epoll socket engine");
+	std::cout << "Falling back to the epoll socket engine" << std::endl;
+	ServerInstance->SE = CreateEPollEngine();
+	delete this;
+}
+
+bool URingEngine::SetupRing()
+{
+	FreeRing();
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	// Multishot polls can post several completions per fd per iteration, so give the CQ some headroom
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	p.cq_entries = GetMaxFds() * 2;
+	EngineHandle = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+	if (EngineHandle < 0 && errno == EINVAL)
+	{
+		memset(&p, 0, sizeof(p));
+		EngineHandle = syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+	}
+
+	if (EngineHandle < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET",DEFAULT, "ERROR: Could not initialize io_uring socket engine: %s", strerror(errno));
+		std::cout << "ERROR: Could not initialize io_uring socket engine: " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (cq_ring_len > sq_ring_len)
+			sq_ring_len = cq_ring_len;
+		cq_ring_len = sq_ring_len;
+	}
+
+	sq_ring = mmap(NULL, sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQ_RING);
+	if (sq_ring != MAP_FAILED)
+	{
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			cq_ring = sq_ring;
+		else
+			cq_ring = mmap(NULL, cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_CQ_RING);
+	}
+	sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqe_map = MAP_FAILED;
+	if (cq_ring != MAP_FAILED)
+		sqe_map = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, IORING_OFF_SQES);
+
+	if (sqe_map == MAP_FAILED)
+	{
+		ServerInstance->Logs->Log("SOCKET",DEFAULT, "ERROR: Could not map io_uring rings: %s", strerror(errno));
+		std::cout << "ERROR: Could not map io_uring rings: " << strerror(errno) << std::endl;
+		FreeRing();
+		return false;
+	}
+
+	char* sq = static_cast<char*>(sq_ring);
+	sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+	sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+	sqes = static_cast<struct io_uring_sqe*>(sqe_map);
+
+	char* cq = static_cast<char*>(cq_ring);
+	cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+	cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+	cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+	// Assume multishot polls work until the kernel tells us otherwise
+	multishot = true;
+	timeout_armed = false;
+	timeout.tv_sec = 1;
+	timeout.tv_nsec = 0;
+
+	// Receives which wait for data without tying up a kernel thread need IORING_FEAT_FAST_POLL (linux 5.7)
+	engineio = (p.features & IORING_FEAT_FAST_POLL);
+	if (engineio)
+	{
+		if (!recvbufs)
+			recvbufs = new char[URING_RECV_BUFFERS * URING_RECV_BUFSIZE];
+		ProvideBuffers(0, URING_RECV_BUFFERS);
+	}
+	return true;
+}
+
+void URingEngine::FreeRing()
+{
+	if (sqes)
+		munmap(sqes, sqes_len);
+	if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_len);
+	if (sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_ring_len);
+	if (EngineHandle >= 0)
+		this->Close(EngineHandle);
+	sqes = NULL;
+	sq_ring = cq_ring = MAP_FAILED;
+	EngineHandle = -1;
+}
+
+URingEngine::~URingEngine()
+{
+	FreeRing();
+	for (int fd = 0; fd < GetMaxFds(); fd++)
+		delete polls[fd].send;
+	delete[] recvbufs;
+	delete[] ref;
+	delete[] polls;
+}
+
+unsigned URingEngine::MaskToPoll(int event_mask)
+{
+	unsigned rv = 0;
+	if (multishot && !(event_mask & (FD_WANT_POLL_READ | FD_WANT_POLL_WRITE | FD_WANT_SINGLE_WRITE)))
+	{
+		// A multishot poll only fires on wakeups, which gives the same edge-triggered
+		// behaviour as EPOLLET and so satisfies the edge states as well.
+		// POLLRDHUP tells us when the peer's FIN came in along with the data of
+		// the same wakeup, which the read that handles the data won't notice.
+		if (event_mask & (FD_WANT_FAST_READ | FD_WANT_EDGE_READ))
+			rv |= POLLIN | POLLRDHUP;
+		if (event_mask & (FD_WANT_FAST_WRITE | FD_WANT_EDGE_WRITE))
+			rv |= POLLOUT;
+		if (rv)
+			rv |= URING_POLL_MULTI;
+	}
+	else
+	{
+		// One-shot polls are level-triggered; the edge states are optional so they are
+		// left out to avoid getting a write event on every iteration.
+		if (event_mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ))
+			rv |= POLLIN;
+		if (event_mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE))
+			rv |= POLLOUT;
+	}
+	return rv;
+}
+
+int URingEngine::Submit(bool wait)
+{
+	unsigned pending = *sq_tail - load_acquire(sq_head);
+	if (!pending && !wait)
+		return 0;
+
+	int rv = syscall(__NR_io_uring_enter, EngineHandle, pending, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	if (rv < 0 && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"io_uring_enter failed: %s", strerror(errno));
+	return rv;
+}
+
+struct io_uring_sqe* URingEngine::GetSQE()
+{
+	unsigned tail = *sq_tail;
+	if (tail - load_acquire(sq_head) > sq_mask)
+	{
+		// queue is full, hand what we have to the kernel now
+		Submit(false);
+		if (tail - load_acquire(sq_head) > sq_mask)
+		{
+			ServerInstance->Logs->Log("SOCKET",DEFAULT,"io_uring submission queue is full, dropping request");
+			return NULL;
+		}
+	}
+
+	unsigned idx = tail & sq_mask;
+	struct io_uring_sqe* sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[idx] = idx;
+	store_release(sq_tail, tail + 1);
+	return sqe;
+}
+
+void URingEngine::SyncPoll(int fd, unsigned want)
+{
+	PollState& ps = polls[fd];
+	if (want == ps.armed)
+		return;
+
+	if (ps.armed)
+	{
+		struct io_uring_sqe* sqe = GetSQE();
+		if (!sqe)
+			return;
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = ((__u64)ps.gen << 32) | (__u32)fd;
+		sqe->user_data = URING_DATA_REMOVE;
+		ps.armed = 0;
+	}
+
+	// Anything still in flight for the previous request is stale from here on
+	ps.gen++;
+
+	if (want)
+	{
+		struct io_uring_sqe* sqe = GetSQE();
+		if (!sqe)
+			return;
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		// poll32_events overlays the older 16-bit poll_events field on little endian systems
+		sqe->poll32_events = want & ~URING_POLL_MULTI;
+		if (want & URING_POLL_MULTI)
+			sqe->len = IORING_POLL_ADD_MULTI;
+		sqe->user_data = ((__u64)ps.gen << 32) | (__u32)fd;
+		ps.armed = want;
+	}
+}
+
+void URingEngine::MarkDirty(int fd)
+{
+	if (polls[fd].io & URING_IO_DIRTY)
+		return;
+	polls[fd].io |= URING_IO_DIRTY;
+	dirty.push_back(fd);
+}
+
+void URingEngine::SyncIO(int fd)
+{
+	EventHandler* eh = ref[fd];
+	PollState& ps = polls[fd];
+	int mask = eh->GetEventMask();
+	unsigned want = MaskToPoll(mask);
+
+	if (mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ | FD_WANT_EDGE_READ))
+	{
+		if (ps.io & URING_IO_PENDING)
+		{
+			// Received data is waiting, so there is nothing to poll for until it is read
+			want &= ~(POLLIN | POLLRDHUP);
+			if (!(mask & FD_ADD_TRIAL_READ))
+			{
+				SetEventMask(eh, (mask & ~FD_READ_WILL_BLOCK) | FD_ADD_TRIAL_READ);
+				trials.insert(fd);
+			}
+		}
+		else if (ps.io & URING_IO_RECV)
+		{
+			want &= ~(POLLIN | POLLRDHUP);
+		}
+		else if (engineio && !(ps.io & URING_IO_NOBUFS) && eh->EngineIO() && QueueRecv(fd))
+		{
+			want &= ~(POLLIN | POLLRDHUP);
+		}
+	}
+
+	// The end of the send takes the place of POLLOUT
+	if (ps.io & URING_IO_SEND)
+		want &= ~POLLOUT;
+
+	if (!(want & ~URING_POLL_MULTI))
+		want = 0;
+	SyncPoll(fd, want);
+}
+
+bool URingEngine::QueueRecv(int fd)
+{
+	struct io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+		return false;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	// Take no more than one read of the handler would, so it sees the data in the same chunks
+	sqe->len = std::min<unsigned>(URING_RECV_BUFSIZE, ServerInstance->Config->NetBufferSize);
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_RECV_GROUP;
+	sqe->user_data = ((__u64)polls[fd].life << 32) | URING_DATA_RECV | (__u32)fd;
+	polls[fd].io |= URING_IO_RECV;
+	return true;
+}
+
+bool URingEngine::QueueSend(int fd)
+{
+	PollState& ps = polls[fd];
+	struct io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+		return false;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<__u64>(&ps.send->msg);
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = ((__u64)ps.life << 32) | URING_DATA_SEND | (__u32)fd;
+	ps.io |= URING_IO_SEND;
+	return true;
+}
+
+void URingEngine::ProvideBuffers(unsigned bid, unsigned count)
+{
+	struct io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+	{
+		ServerInstance->Logs->Log("SOCKET",DEFAULT,"Lost %u io_uring receive buffers", count);
+		return;
+	}
+	sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+	sqe->fd = count;
+	sqe->addr = reinterpret_cast<__u64>(recvbufs + bid * URING_RECV_BUFSIZE);
+	sqe->len = URING_RECV_BUFSIZE;
+	sqe->off = bid;
+	sqe->buf_group = URING_RECV_GROUP;
+	sqe->user_data = URING_DATA_PROVIDE;
+}
+
+void URingEngine::ReleaseRecv(PollState& ps)
+{
+	if (ps.recv_len)
+		ProvideBuffers(ps.bid, 1);
+	ps.recv_off = ps.recv_len = 0;
+	ps.io &= ~URING_IO_PENDING;
+}
+
+void URingEngine::CancelIO(int fd, unsigned what)
+{
+	struct io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = ((__u64)polls[fd].life << 32) | what | (__u32)fd;
+	sqe->user_data = URING_DATA_REMOVE;
+}
+
+bool URingEngine::AddFd(EventHandler* eh, int event_mask)
+{
+	int fd = eh->GetFd();
+	if ((fd < 0) || (fd > GetMaxFds() - 1))
+	{
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"AddFd out of range: (fd: %d, max: %d)", fd, GetMaxFds());
+		return false;
+	}
+
+	if (ref[fd])
+	{
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"Attempt to add duplicate fd: %d", fd);
+		return false;
+	}
+
+	ServerInstance->Logs->Log("SOCKET",DEBUG,"New file descriptor: %d", fd);
+
+	ref[fd] = eh;
+	polls[fd].armed = 0;
+	SocketEngine::SetEventMask(eh, event_mask);
+	MarkDirty(fd);
+	CurrentSetSize++;
+	return true;
+}
+
+void URingEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
+{
+	MarkDirty(eh->GetFd());
+}
+
+void URingEngine::DelFd(EventHandler* eh)
+{
+	int fd = eh->GetFd();
+	if ((fd < 0) || (fd > GetMaxFds() - 1))
+	{
+		ServerInstance->Logs->Log("SOCKET",DEBUG,"DelFd out of range: (fd: %d, max: %d)", fd, GetMaxFds());
+		return;
+	}
+
+	// Queue the removal of the outstanding requests; it is submitted with the next batch
+	PollState& ps = polls[fd];
+	SyncPoll(fd, 0);
+	if (ps.io & URING_IO_RECV)
+		CancelIO(fd, URING_DATA_RECV);
+	if (ps.io & URING_IO_SEND)
+		CancelIO(fd, URING_DATA_SEND);
+	ReleaseRecv(ps);
+	ps.io &= ~URING_IO_NOBUFS;
+	// Completions of the receive and send above no longer belong to any handler
+	ps.life++;
+
+	ref[fd] = NULL;
+
+	ServerInstance->Logs->Log("SOCKET",DEBUG,"Remove file descriptor: %d", fd);
+	CurrentSetSize--;
+}
+
+int URingEngine::Recv(EventHandler* eh, void* buf, size_t len, int flags)
+{
+	int fd = eh->GetFd();
+	if ((fd < 0) || (fd > GetMaxFds() - 1))
+		return SocketEngine::Recv(eh, buf, len, flags);
+
+	PollState& ps = polls[fd];
+	if (ps.io & URING_IO_PENDING)
+	{
+		if (!ps.recv_len)
+		{
+			// The receive found the end of the stream or an error
+			ps.io &= ~URING_IO_PENDING;
+			MarkDirty(fd);
+			if (ps.recv_res == 0)
+				return 0;
+			errno = -ps.recv_res;
+			return -1;
+		}
+
+		size_t n = ps.recv_len - ps.recv_off;
+		if (n > len)
+			n = len;
+		memcpy(buf, recvbufs + ps.bid * URING_RECV_BUFSIZE + ps.recv_off, n);
+		if (!(flags & MSG_PEEK))
+		{
+			ps.recv_off += n;
+			if (ps.recv_off == ps.recv_len)
+			{
+				// Everything has been read, so the next receive can go out
+				ReleaseRecv(ps);
+				MarkDirty(fd);
+			}
+		}
+		UpdateStats(n, 0);
+		return n;
+	}
+
+	if (ps.io & URING_IO_RECV)
+	{
+		// Reading now could overtake the data of the receive
+		errno = EAGAIN;
+		return -1;
+	}
+	return SocketEngine::Recv(eh, buf, len, flags);
+}
+
+int URingEngine::Send(EventHandler* eh, const void* buf, size_t len, int flags)
+{
+	int fd = eh->GetFd();
+	if ((fd >= 0) && (fd < GetMaxFds()) && (polls[fd].io & URING_IO_SEND))
+	{
+		// Data given to SendSegments() goes out first
+		errno = EAGAIN;
+		return -1;
+	}
+	return SocketEngine::Send(eh, buf, len, flags);
+}
+
+size_t URingEngine::SendSegments(StreamSocket* sock, const std::deque<reference<SendQueueSegment> >& segments, size_t pos)
+{
+	int fd = sock->GetFd();
+	if (!engineio || (fd < 0) || (fd > GetMaxFds() - 1) || ref[fd] != sock || segments.empty())
+		return 0;
+
+	// A send left over from the previous handler of the fd is still using the state
+	PollState& ps = polls[fd];
+	if (ps.io & URING_IO_SEND)
+		return 0;
+
+	if (!ps.send)
+		ps.send = new SendState;
+	SendState& ss = *ps.send;
+	size_t count = std::min<size_t>(segments.size(), URING_SEND_IOV);
+	ss.len = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		const std::string& data = segments[i]->data;
+		size_t skip = i ? 0 : pos;
+		ss.iov[i].iov_base = const_cast<char*>(data.data() + skip);
+		ss.iov[i].iov_len = data.length() - skip;
+		ss.len += ss.iov[i].iov_len;
+		ss.segments.push_back(segments[i]);
+	}
+	memset(&ss.msg, 0, sizeof(ss.msg));
+	ss.msg.msg_iov = ss.iov;
+	ss.msg.msg_iovlen = count;
+	ss.sock = sock;
+	ss.sent = 0;
+
+	if (!ss.len || !QueueSend(fd))
+	{
+		ss.segments.clear();
+		return 0;
+	}
+	MarkDirty(fd);
+	return ss.len;
+}
+
+int URingEngine::Shutdown(EventHandler* eh, int how)
+{
+	// Let the kernel have the data being sent before the socket is shut down
+	int fd = eh->GetFd();
+	if ((fd >= 0) && (fd < GetMaxFds()) && (polls[fd].io & URING_IO_SEND))
+		Submit(false);
+	return SocketEngine::Shutdown(eh, how);
+}
+
+int URingEngine::RecvDone(int fd, const struct io_uring_cqe& cqe)
+{
+	PollState& ps = polls[fd];
+	ps.io &= ~URING_IO_RECV;
+	bool hasbuf = (cqe.flags & IORING_CQE_F_BUFFER);
+	unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+	EventHandler* eh = ref[fd];
+	if (eh)
+		MarkDirty(fd);
+	if (!eh || (__u32)(cqe.user_data >> 32) != ps.life)
+	{
+		// The handler this was for has been removed
+		if (hasbuf)
+			ProvideBuffers(bid, 1);
+		return 0;
+	}
+
+	switch (cqe.res)
+	{
+		case -ENOBUFS:
+			// Let the handler read for itself until the buffers come back
+			ps.io |= URING_IO_NOBUFS;
+			return 0;
+		case -EINVAL:
+			ServerInstance->Logs->Log("SOCKET",DEFAULT,"Kernel does not support io_uring receives, handlers do their own I/O");
+			engineio = false;
+			return 0;
+		case -EINTR:
+		case -EAGAIN:
+		case -ECANCELED:
+			return 0;
+	}
+
+	ps.io |= URING_IO_PENDING;
+	ps.bid = bid;
+	ps.recv_off = 0;
+	ps.recv_len = (cqe.res > 0 && hasbuf) ? cqe.res : 0;
+	ps.recv_res = (cqe.res > 0) ? 0 : cqe.res;
+
+	// Delivered like a poll for reads; anything left unread becomes a trial read in SyncIO()
+	if (!(eh->GetEventMask() & (FD_WANT_POLL_READ | FD_WANT_FAST_READ | FD_WANT_EDGE_READ)))
+		return 0;
+	SetEventMask(eh, eh->GetEventMask() & ~FD_READ_WILL_BLOCK);
+	ReadEvents++;
+	eh->HandleEvent(EVENT_READ);
+	return 1;
+}
+
+int URingEngine::SendDone(int fd, const struct io_uring_cqe& cqe)
+{
+	PollState& ps = polls[fd];
+	SendState& ss = *ps.send;
+	bool current = ref[fd] && (__u32)(cqe.user_data >> 32) == ps.life;
+	int res = cqe.res;
+	size_t sent = (res > 0) ? res : 0;
+	if (current && (res > 0 || res == -EINTR || res == -EAGAIN))
+	{
+		if (res > 0)
+		{
+			// Move the message past what was sent
+			ss.sent += res;
+			size_t n = res;
+			while (n && ss.msg.msg_iovlen)
+			{
+				struct iovec* iov = ss.msg.msg_iov;
+				if (iov->iov_len > n)
+				{
+					iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+					iov->iov_len -= n;
+					break;
+				}
+				n -= iov->iov_len;
+				ss.msg.msg_iov++;
+				ss.msg.msg_iovlen--;
+			}
+		}
+		// Send whatever is left over; the socket drops what the kernel has taken already
+		if (ss.sent < ss.len)
+		{
+			if (QueueSend(fd))
+			{
+				if (sent)
+					ss.sock->SendDone(sent, false);
+				return 0;
+			}
+			res = -EIO;
+		}
+	}
+	ps.io &= ~URING_IO_SEND;
+	ss.segments.clear();
+
+	EventHandler* eh = ref[fd];
+	if (!eh)
+		return 0;
+	MarkDirty(fd);
+
+	bool more = false;
+	if (current)
+	{
+		// Only now that the kernel has taken the data is it gone from the sendq
+		more = ss.sock->SendDone(sent, true);
+		if (res <= 0)
+		{
+			// A send of 0 bytes means the connection is gone, as with writev()
+			ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, -res);
+			return 1;
+		}
+	}
+
+	// The fd may also have a handler which was kept waiting by Send()
+	if (more || (eh->GetEventMask() & FD_WRITE_WILL_BLOCK))
+	{
+		SetEventMask(eh, eh->GetEventMask() & ~FD_WRITE_WILL_BLOCK);
+		WriteEvents++;
+		eh->HandleEvent(EVENT_WRITE);
+		return 1;
+	}
+	return 0;
+}
+
+int URingEngine::DispatchEvents()
+{
+	socklen_t codesize = sizeof(int);
+	int errcode;
+
+	// Bring the requests of every fd touched since the last call up to date
+	for (unsigned int n = 0; n < dirty.size(); n++)
+	{
+		int fd = dirty[n];
+		polls[fd].io &= ~URING_IO_DIRTY;
+		if (ref[fd])
+			SyncIO(fd);
+	}
+	dirty.clear();
+
+	if (!timeout_armed)
+	{
+		// Completes after one second, or as soon as any other completion is posted
+		struct io_uring_sqe* sqe = GetSQE();
+		if (sqe)
+		{
+			sqe->opcode = IORING_OP_TIMEOUT;
+			sqe->fd = -1;
+			sqe->addr = reinterpret_cast<__u64>(&timeout);
+			sqe->len = 1;
+			sqe->off = 1;
+			sqe->user_data = URING_DATA_TIMEOUT;
+			timeout_armed = true;
+		}
+	}
+
+	// Don't wait if SyncIO() left received data for a trial read
+	Submit(!NoWait && trials.empty());
+	ServerInstance->UpdateTime();
+
+	int i = 0;
+	unsigned head = *cq_head;
+	while (head != load_acquire(cq_tail))
+	{
+		struct io_uring_cqe cqe = cqes[head & cq_mask];
+		store_release(cq_head, ++head);
+
+		if (cqe.user_data == URING_DATA_TIMEOUT)
+		{
+			timeout_armed = false;
+			continue;
+		}
+		if (cqe.user_data == URING_DATA_REMOVE)
+			continue;
+		if (cqe.user_data == URING_DATA_PROVIDE)
+		{
+			if (cqe.res < 0 && engineio)
+			{
+				ServerInstance->Logs->Log("SOCKET",DEFAULT,"Kernel does not support io_uring receive buffers, handlers do their own I/O");
+				engineio = false;
+			}
+			continue;
+		}
+
+		__u32 data = (__u32)cqe.user_data;
+		int fd = data & URING_DATA_FD;
+		if (fd > GetMaxFds() - 1)
+			continue;
+		if (data & URING_DATA_RECV)
+		{
+			i += RecvDone(fd, cqe);
+			continue;
+		}
+		if (data & URING_DATA_SEND)
+		{
+			i += SendDone(fd, cqe);
+			continue;
+		}
+		if ((cqe.user_data >> 32) != polls[fd].gen)
+			continue;
+
+		EventHandler* eh = ref[fd];
+		if (!eh)
+			continue;
+
+		if (!(cqe.flags & IORING_CQE_F_MORE))
+		{
+			// The request is finished; it gets renewed by SyncIO() if still wanted
+			if (cqe.res == -EINVAL && (polls[fd].armed & URING_POLL_MULTI))
+			{
+				ServerInstance->Logs->Log("SOCKET",DEBUG,"Kernel does not support multishot polls, using one-shot polls");
+				multishot = false;
+			}
+			polls[fd].armed = 0;
+		}
+
+		if (cqe.res < 0)
+		{
+			MarkDirty(fd);
+			continue;
+		}
+
+		i++;
+		unsigned revents = cqe.res;
+		if (revents & POLLHUP)
+		{
+			ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, 0);
+		}
+		else if (revents & POLLERR)
+		{
+			ErrorEvents++;
+			/* Get error number */
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &codesize) < 0)
+				errcode = errno;
+			eh->HandleEvent(EVENT_ERROR, errcode);
+		}
+		else
+		{
+			int mask = eh->GetEventMask();
+			if (revents & POLLIN)
+			{
+				mask &= ~FD_READ_WILL_BLOCK;
+				// The handler reads for itself now, after that receives can be tried again
+				polls[fd].io &= ~URING_IO_NOBUFS;
+			}
+			if (revents & POLLOUT)
+			{
+				mask &= ~FD_WRITE_WILL_BLOCK;
+				if (mask & FD_WANT_SINGLE_WRITE)
+					mask &= ~FD_WANT_SINGLE_WRITE;
+			}
+			SetEventMask(eh, mask);
+			if (revents & POLLIN)
+			{
+				ReadEvents++;
+				eh->HandleEvent(EVENT_READ);
+				// There will be no more wakeups, so read again to see the end of file
+				if ((revents & POLLRDHUP) && eh == ref[fd])
+					ChangeEventMask(eh, FD_ADD_TRIAL_READ);
+			}
+			// whoa! we got deleted, better not give out the write event
+			if ((revents & POLLOUT) && eh == ref[fd])
+			{
+				WriteEvents++;
+				eh->HandleEvent(EVENT_WRITE);
+			}
+		}
+
+		if (eh == ref[fd])
+			MarkDirty(fd);
+	}
+
+	TotalEvents += i;
+	return i;
+}
+
+std::string URingEngine::GetName()
+{
+	return "io_uring";
+}
+
+SocketEngine* CreateSocketEngine()
+{
+	URingEngine* se = new URingEngine;
+	if (se->HasRing())
+		return se;
+
+	ServerInstance->Logs->Log("SOCKET",DEFAULT, "Falling back to the epoll socket engine");
+	std::cout << "Falling back to the epoll socket engine" << std::endl;
+	delete se;
+	return CreateEPollEngine();
+}
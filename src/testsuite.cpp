@@ -64,6 +64,7 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Wildcard matching benchmark\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -107,6 +108,9 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoWildBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -118,10 +122,10 @@ TestSuite::TestSuite()
 	}
 }
 
-/* Test that x matches y with match() */
-#define WCTEST(x, y) std::cout << "match(\"" << x << "\",\"" << y "\") " << ((passed = (InspIRCd::Match(x, y, NULL))) ? " SUCCESS!\n" : " FAILURE\n")
-/* Test that x does not match y with match() */
-#define WCTESTNOT(x, y) std::cout << "!match(\"" << x << "\",\"" << y "\") " << ((passed = ((!InspIRCd::Match(x, y, NULL)))) ? " SUCCESS!\n" : " FAILURE\n")
+/* Test that x matches y with match() and with a CompiledMask */
+#define WCTEST(x, y) std::cout << "match(\"" << x << "\",\"" << y "\") " << ((passed = (InspIRCd::Match(x, y, NULL) && CompiledMask(y).Match(x))) ? " SUCCESS!\n" : " FAILURE\n")
+/* Test that x does not match y with match() nor with a CompiledMask */
+#define WCTESTNOT(x, y) std::cout << "!match(\"" << x << "\",\"" << y "\") " << ((passed = ((!InspIRCd::Match(x, y, NULL) && !CompiledMask(y).Match(x)))) ? " SUCCESS!\n" : " FAILURE\n")
 
 /* Test that x matches y with match() and cidr enabled */
 #define CIDRTEST(x, y) std::cout << "match(\"" << x << "\",\"" << y "\", true) " << ((passed = (InspIRCd::MatchCIDR(x, y, NULL))) ? " SUCCESS!\n" : " FAILURE\n")
@@ -156,6 +160,10 @@ bool TestSuite::DoWildTests()
 	WCTEST("test@foo.bar.test", "*@*.bar.test");
 	WCTEST("test@foo.bar.test", "*test*@*.bar.test");
 	WCTEST("test@foo.bar.test", "*@*test");
+	WCTEST("test@foo.bar.test", "*@*.BAR.*");
+	WCTEST("test@foo.bar.test", "t?st@*.b?r.*t");
+	WCTEST("foo.bar.bar.baz", "*.bar.baz");
+	WCTEST("aXbXc", "*X*X*");
 
 	WCTEST("a", "*a");
 	WCTEST("aa", "*a");
@@ -184,6 +192,10 @@ bool TestSuite::DoWildTests()
 	WCTESTNOT("O", "OperServ");
 	WCTESTNOT("foobar.tst", "fo?bar.*g");
 	WCTESTNOT("foobar.test", "fo?bar.*tt");
+	WCTESTNOT("test@foo.bar.test", "*@*.baz.*");
+	WCTESTNOT("aXbc", "*X*X*");
+	WCTESTNOT("ab", "a*?b");
+	WCTESTNOT("abab", "*ab*ab*ab*");
 
 	CIDRTEST("brain@1.2.3.4", "*@1.2.0.0/16");
 	CIDRTEST("brain@1.2.3.4", "*@1.2.3.0/24");
@@ -201,6 +213,45 @@ bool TestSuite::DoWildTests()
 }
 
 
+bool TestSuite::DoWildBenchmark()
+{
+	std::cout << "\n\nWildcard matching benchmark\n\n";
+
+	const char* masks[] = { "*@*.example.com", "*!*@192.168.*", "baduser*", "*spam*bot*", "Guest?????", "*", "nick!ident@host.example.com" };
+	const std::string strs[] = { "someone@ip-10-1-2-3.isp.example.com", "nick!ident@192.168.100.42", "some.long.hostname.which.does.not.match.net",
+		"GuestNick", "ident@spambot.example.org", "nick!ident@host.example.com" };
+	const unsigned int masks_count = sizeof(masks) / sizeof(masks[0]);
+	const unsigned int strs_count = sizeof(strs) / sizeof(strs[0]);
+	const unsigned int rounds = 200000;
+
+	std::vector<CompiledMask> compiled;
+	for (unsigned int m = 0; m < masks_count; m++)
+		compiled.push_back(CompiledMask(masks[m]));
+
+	for (unsigned int m = 0; m < masks_count; m++)
+	{
+		unsigned int found = 0;
+		clock_t start = clock();
+		for (unsigned int r = 0; r < rounds; r++)
+			for (unsigned int n = 0; n < strs_count; n++)
+				found += InspIRCd::Match(strs[n], masks[m]);
+		clock_t middle = clock();
+		for (unsigned int r = 0; r < rounds; r++)
+			for (unsigned int n = 0; n < strs_count; n++)
+				found -= compiled[m].Match(strs[n]);
+		clock_t end = clock();
+
+		double interpreted = (middle - start) * 1000000000.0 / CLOCKS_PER_SEC / (rounds * strs_count);
+		double precompiled = (end - middle) * 1000000000.0 / CLOCKS_PER_SEC / (rounds * strs_count);
+		std::cout << masks[m] << ": Match() " << interpreted << "ns, CompiledMask " << precompiled << "ns per string" << std::endl;
+
+		// Both must have matched the same number of strings
+		if (found)
+			return false;
+	}
+	return true;
+}
+
 #define STREQUALTEST(x, y) std::cout << "==(\"" << x << ",\"" << y "\") " << ((passed = (x == y)) ? "SUCCESS\n" : "FAILURE\n")
 
 bool TestSuite::DoCommaSepStreamTests()
@@ -25,52 +25,188 @@
 #include "inspircd.h"
 #include "timer.h"
 
-TimerManager::TimerManager()
+TimerManager::TimerManager() : Due(NULL), Current(ServerInstance->Time()), Ticking(false)
 {
+	for (unsigned int i = 0; i < sizeof(Wheel) / sizeof(Wheel[0]); i++)
+		Wheel[i] = NULL;
 }
 
 TimerManager::~TimerManager()
 {
-	for(std::vector<Timer *>::iterator i = Timers.begin(); i != Timers.end(); i++)
-		delete *i;
+	for (unsigned int i = 0; i < sizeof(Wheel) / sizeof(Wheel[0]); i++)
+	{
+		while (Wheel[i])
+		{
+			Timer* t = Wheel[i];
+			Unlink(t);
+			delete t;
+		}
+	}
+}
+
+void TimerManager::Link(Timer** slot, Timer* T)
+{
+	T->next = *slot;
+	if (T->next)
+		T->next->pprev = &T->next;
+	*slot = T;
+	T->pprev = slot;
+}
+
+void TimerManager::Unlink(Timer* T)
+{
+	*T->pprev = T->next;
+	if (T->next)
+		T->next->pprev = T->pprev;
+	T->pprev = NULL;
+	T->next = NULL;
+}
+
+void TimerManager::Place(Timer* T)
+{
+	time_t trigger = T->GetTimer();
+	if (trigger < Current)
+	{
+		// Already due: tick it in this pass if one is running, else in the next one
+		if (Ticking)
+		{
+			Link(&Due, T);
+			return;
+		}
+		trigger = Current;
+	}
+
+	time_t delta = trigger - Current;
+	if (delta < WHEEL_ROOT_SIZE)
+	{
+		Link(&Wheel[trigger & (WHEEL_ROOT_SIZE - 1)], T);
+		return;
+	}
+
+	unsigned int level = 0;
+	unsigned int shift = WHEEL_ROOT_BITS;
+	while (level < WHEEL_LEVELS - 1 && delta >= ((time_t)1 << (shift + WHEEL_LEVEL_BITS)))
+	{
+		level++;
+		shift += WHEEL_LEVEL_BITS;
+	}
+
+	// Timers beyond the end of the wheel wait in its last slot and are placed again when it cascades
+	if (delta >= ((time_t)1 << (shift + WHEEL_LEVEL_BITS)))
+		trigger = Current + ((time_t)1 << (shift + WHEEL_LEVEL_BITS)) - 1;
+
+	Link(&Wheel[WHEEL_ROOT_SIZE + level * WHEEL_LEVEL_SIZE + ((trigger >> shift) & (WHEEL_LEVEL_SIZE - 1))], T);
+}
+
+bool TimerManager::Cascade(unsigned int level)
+{
+	unsigned int index = (Current >> (WHEEL_ROOT_BITS + level * WHEEL_LEVEL_BITS)) & (WHEEL_LEVEL_SIZE - 1);
+	Timer** slot = &Wheel[WHEEL_ROOT_SIZE + level * WHEEL_LEVEL_SIZE + index];
+
+	// Detach the slot first, a timer may be placed back into the same slot
+	Timer* list = *slot;
+	*slot = NULL;
+	if (list)
+		list->pprev = &list;
+
+	while (list)
+	{
+		Timer* t = list;
+		Unlink(t);
+		Place(t);
+	}
+	return (index == 0);
+}
+
+void TimerManager::Rebuild(time_t TIME)
+{
+	Timer* all = NULL;
+	for (unsigned int i = 0; i < sizeof(Wheel) / sizeof(Wheel[0]); i++)
+	{
+		while (Wheel[i])
+		{
+			Timer* t = Wheel[i];
+			Unlink(t);
+			Link(&all, t);
+		}
+	}
+
+	// Everything which triggers before TIME goes into the slot that is processed next
+	Current = TIME - 1;
+	while (all)
+	{
+		Timer* t = all;
+		Unlink(t);
+		Place(t);
+	}
 }
 
 void TimerManager::TickTimers(time_t TIME)
 {
-	while ((Timers.size()) && (TIME > (*Timers.begin())->GetTimer()))
+	// The clock went backwards or skipped ahead; rather than walking
+	// through every missed second, distribute all timers again.
+	if (TIME < Current || TIME - Current > WHEEL_ROOT_SIZE)
+		Rebuild(TIME);
+
+	while (Current < TIME)
 	{
-		std::vector<Timer *>::iterator i = Timers.begin();
-		Timer *t = (*i);
+		if ((Current & (WHEEL_ROOT_SIZE - 1)) == 0)
+		{
+			for (unsigned int level = 0; level < WHEEL_LEVELS; level++)
+			{
+				if (!Cascade(level))
+					break;
+			}
+		}
 
-		// Probable fix: move vector manipulation to *before* we modify the vector.
-		Timers.erase(i);
+		Timer** slot = &Wheel[Current & (WHEEL_ROOT_SIZE - 1)];
+		Due = *slot;
+		*slot = NULL;
+		if (Due)
+			Due->pprev = &Due;
+		Current++;
 
-		t->Tick(TIME);
-		if (t->GetRepeat())
+		Ticking = true;
+		while (Due)
 		{
-			t->SetTimer(TIME + t->GetSecs());
-			AddTimer(t);
+			Timer *t = Due;
+			Unlink(t);
+
+			// The trigger time was moved on with SetTimer()
+			if (t->GetTimer() >= Current)
+			{
+				Place(t);
+				continue;
+			}
+
+			t->Tick(TIME);
+			if (t->GetRepeat())
+			{
+				t->SetTimer(TIME + t->GetSecs());
+				Place(t);
+			}
+			else
+				delete t;
 		}
-		else
-			delete t;
+		Ticking = false;
 	}
 }
 
 void TimerManager::DelTimer(Timer* T)
 {
-	std::vector<Timer *>::iterator i = std::find(Timers.begin(), Timers.end(), T);
-
-	if (i != Timers.end())
+	// Timers which are not queued (such as one which is currently ticking) are left alone
+	if (T->pprev)
 	{
-		delete (*i);
-		Timers.erase(i);
+		Unlink(T);
+		delete T;
 	}
 }
 
 void TimerManager::AddTimer(Timer* T)
 {
-	Timers.push_back(T);
-	sort(Timers.begin(), Timers.end(), TimerManager::TimerComparison);
+	if (T->pprev)
+		Unlink(T);
+	Place(T);
 }
 
 bool TimerManager::TimerComparison( Timer *one, Timer *two)
@@ -74,6 +74,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	ServerInstance->Users->AddGlobalClone(New);
 
 	New->localuseriter = this->local_users.insert(local_users.end(), New);
+	this->ScheduleCheck(New, ServerInstance->Time() + 1);
 
 	if ((this->local_users.size() > ServerInstance->Config->SoftLimit) || (this->local_users.size() >= (unsigned int)ServerInstance->SE->GetMaxFds()))
 	{
@@ -103,7 +104,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	 */
 	New->exempt = (ServerInstance->XLines->MatchesLine("E",New) != NULL);
 
-	if (BanCacheHit *b = ServerInstance->BanCache->GetHit(New->GetIPString()))
+	if (BanCacheHit *b = ServerInstance->BanCache->GetHit(New->client_sa))
 	{
 		if (!b->Type.empty() && !New->exempt)
 		{
@@ -163,6 +164,33 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	}
 }
 
+void UserManager::ScheduleCheck(LocalUser* user, time_t when)
+{
+	if (user->nextcheck && user->nextcheck <= when)
+		return;
+	user->nextcheck = when;
+	checks[when].push_back(user->uuid);
+}
+
+void UserManager::GetDueChecks(time_t now, std::vector<LocalUser*>& users)
+{
+	while (!checks.empty() && checks.begin()->first <= now)
+	{
+		std::map<time_t, std::vector<std::string> >::iterator i = checks.begin();
+		for (std::vector<std::string>::iterator j = i->second.begin(); j != i->second.end(); ++j)
+		{
+			User* u = ServerInstance->FindUUID(*j);
+			LocalUser* user = u ? IS_LOCAL(u) : NULL;
+			// skip users who are gone, and entries which were replaced by an earlier check
+			if (!user || user->nextcheck != i->first)
+				continue;
+			user->nextcheck = 0;
+			users.push_back(user);
+		}
+		checks.erase(i);
+	}
+}
+
 void UserManager::QuitUser(User *user, const std::string &quitreason, const char* operreason)
 {
 	if (user->quitting)
@@ -244,6 +272,126 @@ void UserManager::QuitUser(User *user, const std::string &quitreason, const char
 	ServerInstance->Users->uuidlist->erase(user->uuid);
 }
 
+/** Adds the QUIT line of a user to the batch of every local user who would see them quit
+ */
+static void BatchCommonQuit(User* user, const std::string &normal_text, const std::string &oper_text, std::map<LocalUser*, std::string>& batches)
+{
+	char tb1[MAXBUF];
+	char tb2[MAXBUF];
+
+	already_sent_t uniq_id = ++LocalUser::already_sent_id;
+
+	snprintf(tb1,MAXBUF,":%s QUIT :%s",user->GetFullHost().c_str(),normal_text.c_str());
+	snprintf(tb2,MAXBUF,":%s QUIT :%s",user->GetFullHost().c_str(),oper_text.c_str());
+	reference<SendQueueSegment> out1 = LocalUser::PrepareLine(tb1);
+	reference<SendQueueSegment> out2 = LocalUser::PrepareLine(tb2);
+
+	UserChanList include_c(user->chans);
+	std::map<User*,bool> exceptions;
+
+	FOREACH_MOD(I_OnBuildNeighborList,OnBuildNeighborList(user, include_c, exceptions));
+
+	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+	{
+		LocalUser* u = IS_LOCAL(i->first);
+		if (u && !u->quitting)
+		{
+			u->already_sent = uniq_id;
+			if (i->second)
+				batches[u].append(IS_OPER(u) ? out2->data : out1->data);
+		}
+	}
+	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
+	{
+		const UserMembList* ulist = (*v)->GetUsers();
+		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		{
+			LocalUser* u = IS_LOCAL(i->first);
+			if (u && !u->quitting && (u->already_sent != uniq_id))
+			{
+				u->already_sent = uniq_id;
+				batches[u].append(IS_OPER(u) ? out2->data : out1->data);
+			}
+		}
+	}
+}
+
+void UserManager::QuitUsers(const std::vector<User*>& users, const std::string &quitreason, const char* operreason)
+{
+	std::string reason;
+	std::string oper_reason;
+	reason.assign(quitreason, 0, ServerInstance->Config->Limits.MaxQuit);
+	if (operreason && *operreason)
+		oper_reason.assign(operreason, 0, ServerInstance->Config->Limits.MaxQuit);
+	else
+		oper_reason = quitreason;
+
+	std::vector<User*> gone;
+	gone.reserve(users.size());
+	std::map<LocalUser*, std::string> batches;
+
+	for (std::vector<User*>::const_iterator n = users.begin(); n != users.end(); ++n)
+	{
+		User* user = *n;
+		if (IS_LOCAL(user) || IS_SERVER(user) || user->quitting)
+		{
+			QuitUser(user, quitreason, operreason);
+			continue;
+		}
+
+		user->quitting = true;
+		gone.push_back(user);
+
+		ServerInstance->Logs->Log("USERS", DEBUG, "QuitUser: %s=%s '%s'", user->uuid.c_str(), user->nick.c_str(), quitreason.c_str());
+
+		if (user->registered == REG_ALL)
+		{
+			FOREACH_MOD(I_OnUserQuit,OnUserQuit(user, reason, oper_reason));
+			BatchCommonQuit(user, reason, oper_reason, batches);
+
+			if ((!ServerInstance->SilentULine(user->server)) && (!user->quietquit))
+			{
+				ServerInstance->SNO->WriteToSnoMask('Q',"Client exiting on server %s: %s (%s) [%s]",
+					user->server.c_str(), user->GetFullRealHost().c_str(), user->GetIPString(), oper_reason.c_str());
+			}
+			user->AddToWhoWas();
+		}
+		else if (this->unregistered_count)
+			this->unregistered_count--;
+
+		user_hash::iterator iter = this->clientlist->find(user->nick);
+
+		if (iter != this->clientlist->end())
+			this->clientlist->erase(iter);
+		else
+			ServerInstance->Logs->Log("USERS", DEBUG, "iter == clientlist->end, can't remove them from hash... problematic..");
+
+		this->uuidlist->erase(user->uuid);
+	}
+
+	for (std::map<LocalUser*, std::string>::iterator i = batches.begin(); i != batches.end(); ++i)
+	{
+		if (i->first->quitting)
+			continue;
+
+		reference<SendQueueSegment> lines = new SendQueueSegment;
+		lines->data.swap(i->second);
+		i->first->Write(lines);
+	}
+
+	/* Nothing refers to them any more once they have left their channels,
+	 * so deleting them can wait until the event loop has a moment.
+	 */
+	for (std::vector<User*>::iterator n = gone.begin(); n != gone.end(); ++n)
+	{
+		User* user = *n;
+		for (UCListIter c = user->chans.begin(); c != user->chans.end(); ++c)
+			(*c)->DelUser(user);
+		user->chans.clear();
+		user->UnOper();
+		ServerInstance->GlobalCulls.AddDeferredItem(user);
+	}
+}
 
 void UserManager::AddLocalClone(User *user)
 {
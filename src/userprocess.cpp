@@ -50,22 +50,26 @@ void FloodQuitUserHandler::Call(User* current)
  * This function is called once a second from the mainloop.
  * It is intended to do background checking on all the user structs, e.g.
  * stuff like ping checks, registration timeouts, etc.
+ *
+ * Only the users whose check is due are looked at: unregistered users and
+ * users with a command penalty or sendq are checked every second, everyone
+ * else when their next ping is due.
  */
 void InspIRCd::DoBackgroundUserStuff()
 {
 	/*
-	 * loop over all local users..
+	 * loop over the local users which are due..
 	 */
-	LocalUserList::reverse_iterator count2 = this->Users->local_users.rbegin();
-	while (count2 != this->Users->local_users.rend())
+	std::vector<LocalUser*> due;
+	this->Users->GetDueChecks(Time(), due);
+	for (std::vector<LocalUser*>::iterator count2 = due.begin(); count2 != due.end(); ++count2)
 	{
 		LocalUser *curr = *count2;
-		count2++;
 
 		if (curr->quitting)
 			continue;
 
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
+		if (curr->CommandFloodPenalty || curr->eh.getSendQSize() || curr->eh.lines_held)
 		{
 			unsigned int rate = curr->MyClass->GetCommandRate();
 			if (curr->CommandFloodPenalty > rate)
@@ -117,5 +121,20 @@ void InspIRCd::DoBackgroundUserStuff()
 			continue;
 		}
 	}
+
+	/*
+	 * ..and work out when each of them is due again
+	 */
+	for (std::vector<LocalUser*>::iterator count2 = due.begin(); count2 != due.end(); ++count2)
+	{
+		LocalUser *curr = *count2;
+		if (curr->quitting)
+			continue;
+
+		if (curr->registered != REG_ALL || curr->CommandFloodPenalty || curr->eh.getSendQSize() || curr->eh.lines_held)
+			this->Users->ScheduleCheck(curr, Time() + 1);
+		else
+			this->Users->ScheduleCheck(curr, curr->nping + 1);
+	}
 }
 
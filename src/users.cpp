@@ -206,6 +206,7 @@ User::User(const std::string &uid, const std::string& sid, int type)
 	registered = 0;
 	quietquit = quitting = exempt = dns_done = false;
 	quitting_sendq = false;
+	banepoch = 0;
 	client_sa.sa.sa_family = AF_UNSPEC;
 
 	ServerInstance->Logs->Log("USERS", DEBUG, "New UUID for user: %s", uuid.c_str());
@@ -220,7 +221,7 @@ User::User(const std::string &uid, const std::string& sid, int type)
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
 	: User(ServerInstance->GetUID(), ServerInstance->Config->ServerName, USERTYPE_LOCAL), eh(this),
 	localuseriter(ServerInstance->Users->local_users.end()),
-	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), CommandFloodPenalty(0),
+	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), nextcheck(0), CommandFloodPenalty(0),
 	already_sent(0)
 {
 	ident = "unknown";
@@ -450,11 +451,12 @@ void UserIOHandler::OnDataReady()
 	if (user->quitting)
 		return;
 
-	if (recvq.length() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
+	size_t recvqlen = ioconn ? ioconn->GetRecvQSize() : recvq.length() - recvq_pos;
+	if (recvqlen > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		ServerInstance->Users->QuitUser(user, "RecvQ exceeded");
 		ServerInstance->SNO->WriteToSnoMask('a', "User %s RecvQ of %lu exceeds connect class maximum of %lu",
-			user->nick.c_str(), (unsigned long)recvq.length(), user->MyClass->GetRecvqMax());
+			user->nick.c_str(), (unsigned long)recvqlen, user->MyClass->GetRecvqMax());
 	}
 	unsigned long sendqmax = ULONG_MAX;
 	if (!user->HasPrivPermission("users/flood/increased-buffers"))
@@ -463,62 +465,126 @@ void UserIOHandler::OnDataReady()
 	if (!user->HasPrivPermission("users/flood/no-fakelag"))
 		penaltymax = user->MyClass->GetPenaltyThreshold() * 1000;
 
+	std::string line;
+	line.reserve(MAXBUF);
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
-		std::string line;
-		line.reserve(MAXBUF);
-		std::string::size_type qpos = 0;
-		while (qpos < recvq.length())
+		if (ioconn)
 		{
-			char c = recvq[qpos++];
-			switch (c)
-			{
-			case '\0':
-				c = ' ';
+			// The I/O thread has already split and cleaned up the line, and counted its bytes
+			if (!ioconn->GetLine(line))
 				break;
-			case '\r':
-				continue;
-			case '\n':
-				goto eol_found;
-			}
-			if (line.length() < MAXBUF - 2)
-				line.push_back(c);
 		}
-		// if we got here, the recvq ran out before we found a newline
-		return;
-eol_found:
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq = recvq.substr(qpos);
+		else
+		{
+			const char* start = recvq.data() + recvq_pos;
+			const char* eol = static_cast<const char*>(memchr(start, '\n', recvq.length() - recvq_pos));
+			// if we got here, the recvq ran out before we found a newline
+			if (!eol)
+				break;
 
-		// TODO should this be moved to when it was inserted in recvq?
-		ServerInstance->stats->statsRecv += qpos;
-		user->bytes_in += qpos;
+			// CRs are dropped and NULs become spaces, then the line is cut to MAXBUF - 2
+			line.assign(start, eol - start);
+			if (memchr(line.data(), '\r', line.length()))
+				line.erase(std::remove(line.begin(), line.end(), '\r'), line.end());
+			if (line.length() > MAXBUF - 2)
+				line.erase(MAXBUF - 2);
+			if (memchr(line.data(), '\0', line.length()))
+				std::replace(line.begin(), line.end(), '\0', ' ');
+
+			// the processed part of recvq is dropped when more data is read
+			std::string::size_type qpos = eol - start + 1;
+			ConsumeRecvQ(qpos);
+
+			// TODO should this be moved to when it was inserted in recvq?
+			ServerInstance->stats->statsRecv += qpos;
+			user->bytes_in += qpos;
+		}
 		user->cmds_in++;
 
 		ServerInstance->Parser->ProcessBuffer(line, user);
 		if (user->quitting)
 			return;
 	}
+	lines_held = (user->CommandFloodPenalty >= penaltymax || getSendQSize() >= sendqmax);
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
+	else if (user->CommandFloodPenalty || getSendQSize())
+		// the penalty decays, and held back lines are retried, once a second
+		ServerInstance->Users->ScheduleCheck(user, ServerInstance->Time() + 1);
 }
 
-void UserIOHandler::AddWriteBuf(const std::string &data)
+bool UserIOHandler::CheckSendQ(size_t length)
 {
 	if (user->quitting_sendq)
-		return;
-	if (!user->quitting && getSendQSize() + data.length() > user->MyClass->GetSendqHardMax() &&
+		return false;
+	if (!user->quitting && getSendQSize() + length > user->MyClass->GetSendqHardMax() &&
 		!user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		user->quitting_sendq = true;
 		ServerInstance->GlobalCulls.AddSQItem(user);
-		return;
+		return false;
 	}
 
 	// We still want to append data to the sendq of a quitting user,
 	// e.g. their ERROR message that says 'closing link'
+	return true;
+}
+
+void UserIOHandler::AddWriteBuf(const std::string &data)
+{
+	if (!CheckSendQ(data.length()))
+		return;
+
+	if (ioconn)
+		ServerInstance->IOThreads->Write(ioconn, data);
+	else
+		WriteData(data);
+}
+
+void UserIOHandler::AddWriteBuf(const reference<SendQueueSegment>& segment)
+{
+	if (!CheckSendQ(segment->data.length()))
+		return;
+
+	// I/O threads copy the data into their own buffer
+	if (ioconn)
+		ServerInstance->IOThreads->Write(ioconn, segment->data);
+	else
+		WriteData(segment);
+}
+
+size_t UserIOHandler::getSendQSize() const
+{
+	if (ioconn)
+		return ioconn->pending_out.length() + ioconn->queued;
+	return StreamSocket::getSendQSize();
+}
+
+bool UserIOHandler::IsCorked()
+{
+	return user->MyClass && user->MyClass->cork;
+}
 
-	WriteData(data);
+bool UserIOHandler::EngineIO()
+{
+	/* Sockets which may be handed to an I/O thread do their own reads, so
+	 * that nothing is left behind in the socket engine when that happens
+	 */
+	return !ServerInstance->IOThreads && StreamSocket::EngineIO();
+}
+
+void UserIOHandler::Close()
+{
+	if (ioconn)
+	{
+		// The I/O thread writes out what it can and closes the socket
+		ServerInstance->IOThreads->Release(ioconn);
+		ioconn = NULL;
+		fd = -1;
+		return;
+	}
+	StreamSocket::Close();
 }
 
 void UserIOHandler::OnError(BufferedSocketError)
@@ -567,6 +633,7 @@ void User::Oper(OperInfo* info)
 
 	this->modes[UM_OPERATOR] = 1;
 	this->oper = info;
+	this->banepoch++;
 	this->WriteServ("MODE %s :+o", this->nick.c_str());
 	FOREACH_MOD(I_OnOper, OnOper(this, info->name));
 
@@ -663,6 +730,7 @@ void User::UnOper()
 	 * to call UnOper. -- w00t
 	 */
 	oper = NULL;
+	banepoch++;
 
 
 	/* Remove all oper only modes from the user when the deoper - Bug #466*/
@@ -823,9 +891,12 @@ void LocalUser::FullConnect()
 	ServerInstance->SNO->WriteToSnoMask('c',"Client connecting on port %d (class %s): %s (%s) [%s]",
 		this->GetServerPort(), this->MyClass->name.c_str(), GetFullRealHost().c_str(), this->GetIPString(), this->fullname.c_str());
 	ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCache: Adding NEGATIVE hit for %s", this->GetIPString());
-	ServerInstance->BanCache->AddHit(this->GetIPString(), "", "");
+	ServerInstance->BanCache->AddHit(this->client_sa, "", "");
 	// reset the flood penalty (which could have been raised due to things like auto +x)
 	CommandFloodPenalty = 0;
+
+	if (ServerInstance->IOThreads)
+		ServerInstance->IOThreads->Adopt(this);
 }
 
 void User::InvalidateCache()
@@ -835,6 +906,7 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+	banepoch++;
 }
 
 bool User::ChangeNick(const std::string& newnick, bool force)
@@ -1057,6 +1129,30 @@ void LocalUser::Write(const std::string& text)
 	this->cmds_out++;
 }
 
+void LocalUser::Write(const reference<SendQueueSegment>& line)
+{
+	if (!ServerInstance->SE->BoundsCheckFd(&eh))
+		return;
+
+	size_t length = line->data.length();
+	ServerInstance->Logs->Log("USEROUTPUT", RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)length - 2, line->data.c_str());
+
+	eh.AddWriteBuf(line);
+
+	ServerInstance->stats->statsSent += length;
+	this->bytes_out += length;
+	this->cmds_out++;
+}
+
+reference<SendQueueSegment> LocalUser::PrepareLine(const std::string& text)
+{
+	SendQueueSegment* line = new SendQueueSegment;
+	line->data.reserve(std::min(text.length(), (size_t)MAXBUF - 2) + wide_newline.length());
+	line->data.assign(text, 0, MAXBUF - 2);
+	line->data.append(wide_newline);
+	return line;
+}
+
 /** Write()
  */
 void LocalUser::Write(const char *text, ...)
@@ -1210,6 +1306,8 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 
 	FOREACH_MOD(I_OnBuildNeighborList,OnBuildNeighborList(this, include_c, exceptions));
 
+	reference<SendQueueSegment> shared = LocalUser::PrepareLine(line);
+
 	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 	{
 		LocalUser* u = IS_LOCAL(i->first);
@@ -1217,7 +1315,7 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 		{
 			u->already_sent = LocalUser::already_sent_id;
 			if (i->second)
-				u->Write(line);
+				u->Write(shared);
 		}
 	}
 	for (UCListIter v = include_c.begin(); v != include_c.end(); ++v)
@@ -1230,7 +1328,7 @@ void User::WriteCommonRaw(const std::string &line, bool include_self)
 			if (u && !u->quitting && u->already_sent != LocalUser::already_sent_id)
 			{
 				u->already_sent = LocalUser::already_sent_id;
-				u->Write(line);
+				u->Write(shared);
 			}
 		}
 	}
@@ -1248,8 +1346,8 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 
 	snprintf(tb1,MAXBUF,":%s QUIT :%s",this->GetFullHost().c_str(),normal_text.c_str());
 	snprintf(tb2,MAXBUF,":%s QUIT :%s",this->GetFullHost().c_str(),oper_text.c_str());
-	std::string out1 = tb1;
-	std::string out2 = tb2;
+	reference<SendQueueSegment> out1 = LocalUser::PrepareLine(tb1);
+	reference<SendQueueSegment> out2 = LocalUser::PrepareLine(tb2);
 
 	UserChanList include_c(chans);
 	std::map<User*,bool> exceptions;
@@ -1374,6 +1472,7 @@ bool User::ChangeName(const char* gecos)
 		FOREACH_MOD(I_OnChangeName,OnChangeName(this,gecos));
 	}
 	this->fullname.assign(gecos, 0, ServerInstance->Config->Limits.MaxGecos);
+	banepoch++;
 
 	return true;
 }
@@ -1622,8 +1721,7 @@ void LocalUser::SetClass(const std::string &explicit_name)
 				continue;
 
 			/* check if host matches.. */
-			if (!InspIRCd::MatchCIDR(this->GetIPString(), c->GetHost(), NULL) &&
-			    !InspIRCd::MatchCIDR(this->host, c->GetHost(), NULL))
+			if (!c->MatchesHost(this))
 			{
 				ServerInstance->Logs->Log("CONNECTCLASS", DEBUG, "No host match (for %s)", c->GetHost().c_str());
 				continue;
@@ -1716,19 +1814,19 @@ const std::string& FakeUser::GetFullRealHost()
 }
 
 ConnectClass::ConnectClass(ConfigTag* tag, char t, const std::string& mask)
-	: config(tag), type(t), fakelag(true), name("unnamed"), registration_timeout(0), host(mask),
+	: config(tag), type(t), fakelag(true), name("unnamed"), registration_timeout(0), host(mask), hostmatch(mask), hostcidr(mask),
 	pingtime(0), softsendqmax(0), hardsendqmax(0), recvqmax(0),
-	penaltythreshold(0), commandrate(0), maxlocal(0), maxglobal(0), maxconnwarn(true), maxchans(0), limit(0)
+	penaltythreshold(0), commandrate(0), maxlocal(0), maxglobal(0), maxconnwarn(true), maxchans(0), limit(0), cork(false)
 {
 }
 
 ConnectClass::ConnectClass(ConfigTag* tag, char t, const std::string& mask, const ConnectClass& parent)
 	: config(tag), type(t), fakelag(parent.fakelag), name("unnamed"),
-	registration_timeout(parent.registration_timeout), host(mask), pingtime(parent.pingtime),
+	registration_timeout(parent.registration_timeout), host(mask), hostmatch(mask), hostcidr(mask), pingtime(parent.pingtime),
 	softsendqmax(parent.softsendqmax), hardsendqmax(parent.hardsendqmax), recvqmax(parent.recvqmax),
 	penaltythreshold(parent.penaltythreshold), commandrate(parent.commandrate),
 	maxlocal(parent.maxlocal), maxglobal(parent.maxglobal), maxconnwarn(parent.maxconnwarn), maxchans(parent.maxchans),
-	limit(parent.limit)
+	limit(parent.limit), cork(parent.cork)
 {
 }
 
@@ -1740,6 +1838,8 @@ void ConnectClass::Update(const ConnectClass* src)
 	name = src->name;
 	registration_timeout = src->registration_timeout;
 	host = src->host;
+	hostmatch = src->hostmatch;
+	hostcidr = src->hostcidr;
 	pingtime = src->pingtime;
 	softsendqmax = src->softsendqmax;
 	hardsendqmax = src->hardsendqmax;
@@ -1751,4 +1851,10 @@ void ConnectClass::Update(const ConnectClass* src)
 	maxconnwarn = src->maxconnwarn;
 	maxchans = src->maxchans;
 	limit = src->limit;
+	cork = src->cork;
+}
+
+bool ConnectClass::MatchesHost(LocalUser* user)
+{
+	return hostcidr.match(user->client_sa) || hostmatch.Match(user->GetIPString()) || hostmatch.Match(user->host);
 }
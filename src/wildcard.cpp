@@ -74,6 +74,197 @@ static bool match_internal(const unsigned char *str, const unsigned char *mask,
 	return !*wild;
 }
 
+CompiledMask::CompiledMask() : givenmap(NULL), map(NULL), generation(0)
+{
+}
+
+CompiledMask::CompiledMask(const std::string& m, const unsigned char* cmap) : mask(m), givenmap(cmap), map(NULL), generation(0)
+{
+}
+
+void CompiledMask::Compile() const
+{
+	map = givenmap ? givenmap : national_case_insensitive_map;
+	generation = national_case_insensitive_generation;
+	segments.clear();
+	fallback = false;
+	minlength = 0;
+	prefilter = -1;
+
+	/* How many bytes fold to each character; anchors must only have one */
+	unsigned int folds[256] = { 0 };
+	unsigned char foldedfrom[256] = { 0 };
+	for (unsigned int c = 1; c < 256; c++)
+	{
+		folds[map[c]]++;
+		foldedfrom[map[c]] = c;
+		if (c != '?' && map[c] == '?')
+			fallback = true;
+	}
+	if (fallback)
+		return;
+
+	/* Split at each run of '*'. There is always a first and (if there was a '*')
+	 * a last segment, which may be empty, and any in between are not.
+	 */
+	segments.push_back(Segment());
+	for (std::string::const_iterator i = mask.begin(); i != mask.end(); ++i)
+	{
+		if (*i == '*')
+		{
+			if (!segments.back().chars.empty() || segments.size() == 1)
+				segments.push_back(Segment());
+			continue;
+		}
+		unsigned char c = (*i == '?') ? '?' : map[(unsigned char)*i];
+		segments.back().chars.push_back(c);
+		minlength++;
+	}
+
+	size_t longest = 0;
+	for (size_t n = 0; n < segments.size(); n++)
+	{
+		Segment& seg = segments[n];
+		for (size_t i = 0; i < seg.chars.length(); i++)
+		{
+			unsigned char c = seg.chars[i];
+			if (c != '?' && folds[c] == 1)
+			{
+				seg.anchor = i;
+				seg.anchorbyte = foldedfrom[c];
+				break;
+			}
+		}
+
+		/* Find the longest literal run which memchr() can look for, in the middle segments */
+		if (n == 0 || n == segments.size() - 1)
+			continue;
+		for (size_t start = 0; start < seg.chars.length(); )
+		{
+			size_t end = seg.chars.find('?', start);
+			if (end == std::string::npos)
+				end = seg.chars.length();
+			if (end - start > longest)
+			{
+				Segment run;
+				run.chars = seg.chars.substr(start, end - start);
+				for (size_t i = 0; i < run.chars.length(); i++)
+				{
+					if (folds[(unsigned char)run.chars[i]] == 1)
+					{
+						run.anchor = i;
+						run.anchorbyte = foldedfrom[(unsigned char)run.chars[i]];
+						break;
+					}
+				}
+				if (run.anchor >= 0)
+				{
+					longest = end - start;
+					prefilter = n;
+					prefilterrun = run;
+				}
+			}
+			start = end + 1;
+		}
+	}
+
+	/* If that run is all of the only middle segment, searching for it again is a waste of time */
+	if (segments.size() == 3 && longest == segments[1].chars.length())
+		prefilter = -1;
+}
+
+bool CompiledMask::MatchSegment(const Segment& seg, const unsigned char* str) const
+{
+	const unsigned char* chars = (const unsigned char*)seg.chars.data();
+	for (size_t i = 0; i < seg.chars.length(); i++)
+	{
+		if (chars[i] != '?' && chars[i] != map[str[i]])
+			return false;
+	}
+	return true;
+}
+
+const unsigned char* CompiledMask::FindSegment(const Segment& seg, const unsigned char* begin, const unsigned char* end) const
+{
+	size_t len = seg.chars.length();
+	if ((size_t)(end - begin) < len)
+		return NULL;
+	const unsigned char* last = end - len;
+
+	if (seg.anchor < 0)
+	{
+		const unsigned char first = seg.chars[0];
+		for (const unsigned char* p = begin; p <= last; p++)
+		{
+			if ((first == '?' || map[*p] == first) && MatchSegment(seg, p))
+				return p;
+		}
+		return NULL;
+	}
+
+	/* Only one byte folds to the anchor, so it can be found with memchr() */
+	while (begin <= last)
+	{
+		const unsigned char* p = (const unsigned char*)memchr(begin + seg.anchor, seg.anchorbyte, last - begin + 1);
+		if (!p)
+			return NULL;
+		p -= seg.anchor;
+		if (MatchSegment(seg, p))
+			return p;
+		begin = p + 1;
+	}
+	return NULL;
+}
+
+bool CompiledMask::Match(const char* str) const
+{
+	return Match(str, strlen(str));
+}
+
+bool CompiledMask::Match(const char* cstr, size_t length) const
+{
+	/* The national map may also have been rewritten in place */
+	if (map != (givenmap ? givenmap : national_case_insensitive_map) || generation != national_case_insensitive_generation)
+		Compile();
+
+	if (fallback)
+		return match_internal((const unsigned char*)cstr, (const unsigned char*)mask.c_str(), map);
+
+	/* Only '*' */
+	if (minlength == 0 && segments.size() == 2)
+		return true;
+
+	const unsigned char* str = (const unsigned char*)cstr;
+	if (length < minlength)
+		return false;
+
+	/* No '*' at all, so the lengths must be the same */
+	if (segments.size() == 1)
+		return length == minlength && MatchSegment(segments[0], str);
+
+	/* The literal prefix and suffix */
+	const Segment& first = segments.front();
+	const Segment& last = segments.back();
+	if (!MatchSegment(first, str) || !MatchSegment(last, str + length - last.chars.length()))
+		return false;
+
+	const unsigned char* begin = str + first.chars.length();
+	const unsigned char* end = str + length - last.chars.length();
+
+	if (prefilter >= 0 && !FindSegment(prefilterrun, begin, end))
+		return false;
+
+	/* Each middle segment may as well match as early as it can */
+	for (size_t n = 1; n + 1 < segments.size(); n++)
+	{
+		const unsigned char* p = FindSegment(segments[n], begin, end);
+		if (!p)
+			return false;
+		begin = p + segments[n].chars.length();
+	}
+	return true;
+}
+
 /********************************************************************
  * Below here is all wrappers around match_internal
  ********************************************************************/
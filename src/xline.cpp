@@ -141,6 +141,481 @@ bool XLine::Matches(User *u)
 	return false;
 }
 
+/** Same as InspIRCd::MatchCIDR(), with the glob part of the mask already compiled */
+static inline bool MatchCIDR(const std::string& str, const std::string& mask, const CompiledMask& glob)
+{
+	return irc::sockets::MatchCIDR(str, mask, true) || glob.Match(str);
+}
+
+static inline unsigned int GetBit(const irc::sockets::cidr_mask& mask, unsigned int bit)
+{
+	return (mask.bits[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/* Returns the number of leading bits two masks have in common, at most the length of the shorter one */
+static unsigned int CommonBits(const irc::sockets::cidr_mask& one, const irc::sockets::cidr_mask& two)
+{
+	unsigned int max = std::min(one.length, two.length);
+	unsigned int n = 0;
+	while (n + 8 <= max && one.bits[n / 8] == two.bits[n / 8])
+		n += 8;
+	while (n < max && GetBit(one, n) == GetBit(two, n))
+		n++;
+	return n;
+}
+
+/* Parses a literal IP address. Unlike aptosa() on its own, this does not
+ * take an empty string or anything starting with '*' as the wildcard address.
+ */
+static bool ParseAddress(const std::string& str, irc::sockets::sockaddrs& sa)
+{
+	if (str.empty() || str[0] == '*')
+		return false;
+	return irc::sockets::aptosa(str, 0, sa);
+}
+
+/* Parses a mask which can only ever match an IP address: either a range in CIDR
+ * notation, or a single address, which is compared as a string. Anything else
+ * (wildcards, hostnames, malformed ranges) is left to the normal matching.
+ */
+static bool ParseIPMask(const std::string& str, irc::sockets::cidr_mask& mask)
+{
+	irc::sockets::sockaddrs sa;
+	std::string::size_type slash = str.rfind('/');
+	if (slash == std::string::npos)
+	{
+		if (!ParseAddress(str, sa))
+			return false;
+		mask = irc::sockets::cidr_mask(sa, 128);
+		return true;
+	}
+
+	if (slash + 1 == str.length() || str.find_first_not_of("0123456789", slash + 1) != std::string::npos)
+		return false;
+	if (!ParseAddress(str.substr(0, slash), sa))
+		return false;
+	mask = irc::sockets::cidr_mask(str);
+	return true;
+}
+
+XLineIPTree::~XLineIPTree()
+{
+	DeleteNode(root4);
+	DeleteNode(root6);
+}
+
+void XLineIPTree::DeleteNode(Node* node)
+{
+	if (!node)
+		return;
+	DeleteNode(node->child[0]);
+	DeleteNode(node->child[1]);
+	delete node;
+}
+
+void XLineIPTree::Add(const irc::sockets::cidr_mask& mask, XLine* line)
+{
+	Node** slot = (mask.type == AF_INET6) ? &root6 : &root4;
+	while (true)
+	{
+		Node* node = *slot;
+		if (!node)
+		{
+			node = *slot = new Node(mask);
+			node->lines.push_back(line);
+			return;
+		}
+
+		unsigned int common = CommonBits(node->prefix, mask);
+		if (common < node->prefix.length)
+		{
+			// The mask leaves this node's prefix part way; insert a node for the shared part above it
+			irc::sockets::cidr_mask shared = mask;
+			shared.length = common;
+			for (unsigned int i = common; i < 128; i++)
+				shared.bits[i / 8] &= ~(0x80 >> (i % 8));
+
+			Node* split = new Node(shared);
+			split->child[GetBit(node->prefix, common)] = node;
+			*slot = split;
+			node = split;
+		}
+
+		if (node->prefix.length == mask.length)
+		{
+			node->lines.push_back(line);
+			return;
+		}
+		slot = &node->child[GetBit(mask, node->prefix.length)];
+	}
+}
+
+void XLineIPTree::Remove(const irc::sockets::cidr_mask& mask, XLine* line)
+{
+	Node** parentslot = NULL;
+	Node** slot = (mask.type == AF_INET6) ? &root6 : &root4;
+	while (*slot)
+	{
+		Node* node = *slot;
+		if (CommonBits(node->prefix, mask) < node->prefix.length)
+			return;
+
+		if (node->prefix.length < mask.length)
+		{
+			parentslot = slot;
+			slot = &node->child[GetBit(mask, node->prefix.length)];
+			continue;
+		}
+
+		std::vector<XLine*>::iterator i = std::find(node->lines.begin(), node->lines.end(), line);
+		if (i != node->lines.end())
+			node->lines.erase(i);
+
+		// Every node without lines must have two children; drop the ones which no longer do
+		if (node->lines.empty() && !(node->child[0] && node->child[1]))
+		{
+			*slot = node->child[0] ? node->child[0] : node->child[1];
+			delete node;
+
+			Node* parent = parentslot ? *parentslot : NULL;
+			if (parent && parent->lines.empty() && !(parent->child[0] && parent->child[1]))
+			{
+				*parentslot = parent->child[0] ? parent->child[0] : parent->child[1];
+				delete parent;
+			}
+		}
+		return;
+	}
+}
+
+void XLineIPTree::Find(const irc::sockets::sockaddrs& addr, std::vector<XLine*>& lines) const
+{
+	if (addr.sa.sa_family != AF_INET && addr.sa.sa_family != AF_INET6)
+		return;
+
+	irc::sockets::cidr_mask full(addr, 128);
+	const Node* node = (full.type == AF_INET6) ? root6 : root4;
+	while (node && CommonBits(node->prefix, full) == node->prefix.length)
+	{
+		lines.insert(lines.end(), node->lines.begin(), node->lines.end());
+		if (node->prefix.length == full.length)
+			break;
+		node = node->child[GetBit(full, node->prefix.length)];
+	}
+}
+
+enum HostMaskKind
+{
+	HOSTMASK_LITERAL,
+	HOSTMASK_SUFFIX,
+	HOSTMASK_PREFIX
+};
+
+/* Works out how a host mask can be indexed. Sets key to the folded literal
+ * host, or to the domain after "*." or before ".*". Masks with CIDR ranges or
+ * any other wildcards are left to the normal matching.
+ */
+static bool ClassifyHostMask(const std::string& mask, HostMaskKind& kind, std::string& key)
+{
+	if (mask.empty() || mask.find_first_of("/@") != std::string::npos)
+		return false;
+
+	std::string::size_type wild = mask.find_first_of("*?");
+	if (wild == std::string::npos)
+	{
+		kind = HOSTMASK_LITERAL;
+		key = mask;
+	}
+	else if (mask.length() > 2 && mask.compare(0, 2, "*.") == 0 && mask.find_first_of("*?", 2) == std::string::npos)
+	{
+		kind = HOSTMASK_SUFFIX;
+		key = mask.substr(2);
+	}
+	else if (mask.length() > 2 && wild == mask.length() - 1 && mask[wild - 1] == '.')
+	{
+		kind = HOSTMASK_PREFIX;
+		key = mask.substr(0, wild - 1);
+	}
+	else
+		return false;
+
+	for (std::string::iterator i = key.begin(); i != key.end(); ++i)
+		*i = rfc_case_insensitive_map[(unsigned char)*i];
+	return true;
+}
+
+static void SplitLabels(const std::string& host, std::vector<std::string>& labels)
+{
+	std::string::size_type start = 0;
+	while (true)
+	{
+		std::string::size_type dot = host.find('.', start);
+		if (dot == std::string::npos)
+		{
+			labels.push_back(host.substr(start));
+			return;
+		}
+		labels.push_back(host.substr(start, dot - start));
+		start = dot + 1;
+	}
+}
+
+XLineHostIndex::~XLineHostIndex()
+{
+	DeleteChildren(&suffixes);
+	DeleteChildren(&prefixes);
+}
+
+void XLineHostIndex::DeleteChildren(Node* node)
+{
+	for (std::map<std::string, Node*>::iterator i = node->children.begin(); i != node->children.end(); ++i)
+	{
+		DeleteChildren(i->second);
+		delete i->second;
+	}
+	node->children.clear();
+}
+
+bool XLineHostIndex::Add(const std::string& mask, XLine* line)
+{
+	HostMaskKind kind;
+	std::string key;
+	if (!ClassifyHostMask(mask, kind, key))
+		return false;
+
+	if (kind == HOSTMASK_LITERAL)
+	{
+		literals[key].push_back(line);
+		return true;
+	}
+
+	std::vector<std::string> labels;
+	SplitLabels(key, labels);
+	if (kind == HOSTMASK_SUFFIX)
+		std::reverse(labels.begin(), labels.end());
+
+	Node* node = (kind == HOSTMASK_SUFFIX) ? &suffixes : &prefixes;
+	for (std::vector<std::string>::const_iterator i = labels.begin(); i != labels.end(); ++i)
+	{
+		Node*& child = node->children[*i];
+		if (!child)
+			child = new Node;
+		node = child;
+	}
+	node->lines.push_back(line);
+	return true;
+}
+
+void XLineHostIndex::Remove(const std::string& mask, XLine* line)
+{
+	HostMaskKind kind;
+	std::string key;
+	if (!ClassifyHostMask(mask, kind, key))
+		return;
+
+	if (kind == HOSTMASK_LITERAL)
+	{
+		LiteralMap::iterator i = literals.find(key);
+		if (i == literals.end())
+			return;
+		std::vector<XLine*>::iterator j = std::find(i->second.begin(), i->second.end(), line);
+		if (j != i->second.end())
+			i->second.erase(j);
+		if (i->second.empty())
+			literals.erase(i);
+		return;
+	}
+
+	std::vector<std::string> labels;
+	SplitLabels(key, labels);
+	if (kind == HOSTMASK_SUFFIX)
+		std::reverse(labels.begin(), labels.end());
+
+	std::vector<Node*> path;
+	path.push_back((kind == HOSTMASK_SUFFIX) ? &suffixes : &prefixes);
+	for (std::vector<std::string>::const_iterator i = labels.begin(); i != labels.end(); ++i)
+	{
+		std::map<std::string, Node*>::iterator child = path.back()->children.find(*i);
+		if (child == path.back()->children.end())
+			return;
+		path.push_back(child->second);
+	}
+
+	Node* node = path.back();
+	std::vector<XLine*>::iterator j = std::find(node->lines.begin(), node->lines.end(), line);
+	if (j != node->lines.end())
+		node->lines.erase(j);
+
+	// Prune the nodes which no longer lead to any lines
+	for (size_t depth = labels.size(); depth > 0; depth--)
+	{
+		node = path[depth];
+		if (!node->lines.empty() || !node->children.empty())
+			break;
+		path[depth - 1]->children.erase(labels[depth - 1]);
+		delete node;
+	}
+}
+
+void XLineHostIndex::Find(const std::string& host, std::vector<XLine*>& lines) const
+{
+	std::string key(host);
+	for (std::string::iterator i = key.begin(); i != key.end(); ++i)
+		*i = rfc_case_insensitive_map[(unsigned char)*i];
+
+	LiteralMap::const_iterator literal = literals.find(key);
+	if (literal != literals.end())
+		lines.insert(lines.end(), literal->second.begin(), literal->second.end());
+
+	if (suffixes.children.empty() && prefixes.children.empty())
+		return;
+
+	std::vector<std::string> labels;
+	SplitLabels(key, labels);
+
+	/* "*.domain" matches when the host has at least one more label before
+	 * the domain, "prefix.*" when it has at least one more after the prefix.
+	 */
+	const Node* node = &suffixes;
+	for (size_t n = labels.size(); n > 1; n--)
+	{
+		std::map<std::string, Node*>::const_iterator child = node->children.find(labels[n - 1]);
+		if (child == node->children.end())
+			break;
+		node = child->second;
+		lines.insert(lines.end(), node->lines.begin(), node->lines.end());
+	}
+
+	node = &prefixes;
+	for (size_t n = 0; n + 1 < labels.size(); n++)
+	{
+		std::map<std::string, Node*>::const_iterator child = node->children.find(labels[n]);
+		if (child == node->children.end())
+			break;
+		node = child->second;
+		lines.insert(lines.end(), node->lines.begin(), node->lines.end());
+	}
+}
+
+/* Finds the indexed lines which may match a user: those covering their IP
+ * address, and those whose host mask may match their host or IP address.
+ */
+static void FindCandidates(const XLineIPTree* tree, const XLineHostIndex* hosts, User* user, std::vector<XLine*>& candidates)
+{
+	const std::string& ip = user->GetIPString();
+	if (tree)
+	{
+		tree->Find(user->client_sa, candidates);
+
+		// K, G and E-lines also match the host, which can be an IP address too
+		irc::sockets::sockaddrs hostsa;
+		if (user->host != ip && ParseAddress(user->host, hostsa))
+			tree->Find(hostsa, candidates);
+	}
+
+	if (hosts)
+	{
+		hosts->Find(user->host, candidates);
+		if (user->host != ip)
+			hosts->Find(ip, candidates);
+	}
+}
+
+/** The number of line matches ApplyLines() does before leaving the rest
+ * of the users for the next main loop iteration
+ */
+static const size_t APPLY_SLICE_MATCHES = 20000;
+
+/** A set of newly added lines being applied to the local users. The lines
+ * are indexed like the stored ones, so each user is only tested against the
+ * lines which can match them.
+ */
+class XLineBatch
+{
+	XLineIPTree iptree;
+	XLineHostIndex hostindex;
+	std::vector<XLine*> unindexed;
+
+	/** The position of each line in the order they were added */
+	std::map<XLine*, size_t> order;
+
+	/** Count of lines ever added, used for their positions */
+	size_t added;
+
+ public:
+	/** UUIDs of the users to check */
+	std::vector<std::string> users;
+
+	/** Index in users of the next user to check */
+	size_t next;
+
+	XLineBatch() : added(0), next(0) { }
+
+	void Add(XLine* x)
+	{
+		order[x] = added++;
+
+		irc::sockets::cidr_mask mask;
+		std::string hostmask;
+		if (x->GetIPMask(mask))
+			iptree.Add(mask, x);
+		else if (!x->GetHostMask(hostmask) || !hostindex.Add(hostmask, x))
+			unindexed.push_back(x);
+	}
+
+	void Remove(XLine* x)
+	{
+		std::map<XLine*, size_t>::iterator i = order.find(x);
+		if (i == order.end())
+			return;
+		order.erase(i);
+
+		irc::sockets::cidr_mask mask;
+		std::string hostmask;
+		if (x->GetIPMask(mask))
+			iptree.Remove(mask, x);
+		else if (x->GetHostMask(hostmask))
+			hostindex.Remove(hostmask, x);
+		std::vector<XLine*>::iterator j = std::find(unindexed.begin(), unindexed.end(), x);
+		if (j != unindexed.end())
+			unindexed.erase(j);
+	}
+
+	/** Apply the matching lines to a user, E-lines first and then the rest
+	 * in the order they were added, as each one might quit the user.
+	 * @return The number of lines tested
+	 */
+	size_t Apply(User* u)
+	{
+		std::vector<XLine*> candidates(unindexed);
+		FindCandidates(&iptree, &hostindex, u, candidates);
+
+		std::vector<std::pair<size_t, XLine*> > sorted;
+		for (std::vector<XLine*>::iterator i = candidates.begin(); i != candidates.end(); ++i)
+			sorted.push_back(std::make_pair(order[*i], *i));
+		std::sort(sorted.begin(), sorted.end());
+		sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+		for (std::vector<std::pair<size_t, XLine*> >::iterator i = sorted.begin(); i != sorted.end(); ++i)
+		{
+			if (i->second->type == "E" && i->second->Matches(u))
+				u->exempt = true;
+		}
+
+		// Don't ban people who are exempt.
+		if (!u->exempt)
+		{
+			for (std::vector<std::pair<size_t, XLine*> >::iterator i = sorted.begin(); i != sorted.end(); ++i)
+			{
+				XLine* x = i->second;
+				if (x->type != "E" && x->Matches(u))
+					x->Apply(u);
+			}
+		}
+		return sorted.size() + 1;
+	}
+};
+
 /*
  * Checks what users match a given vector of ELines and sets their ban exempt flag accordingly.
  */
@@ -157,21 +632,34 @@ void XLineManager::CheckELines()
 		return;
 
 	for (LocalUserList::const_iterator u2 = ServerInstance->Users->local_users.begin(); u2 != ServerInstance->Users->local_users.end(); u2++)
-	{
-		User* u = (User*)(*u2);
+		CheckELines(*u2);
+}
 
-		/* This uses safe iteration to ensure that if a line expires here, it doenst trash the iterator */
-		LookupIter safei;
+void XLineManager::CheckELines(User* u)
+{
+	u->exempt = false;
 
-		for (LookupIter i = ELines.begin(); i != ELines.end(); )
-		{
-			safei = i;
-			safei++;
+	std::vector<XLine*> candidates;
+	std::map<std::string, XLineIPTree*>::iterator t = ip_lines.find("E");
+	std::map<std::string, XLineHostIndex*>::iterator h = host_lines.find("E");
+	FindCandidates(t != ip_lines.end() ? t->second : NULL, h != host_lines.end() ? h->second : NULL, u, candidates);
 
-			XLine *e = i->second;
-			u->exempt = e->Matches(u);
+	ContainerIter un = unindexed_lines.find("E");
+	if (un != unindexed_lines.end())
+	{
+		for (LookupIter i = un->second.begin(); i != un->second.end(); ++i)
+			candidates.push_back(i->second);
+	}
 
-			i = safei;
+	// Expired lines are skipped rather than expired, as this may be called while expiring a line
+	const time_t current = ServerInstance->Time();
+	for (std::vector<XLine*>::iterator i = candidates.begin(); i != candidates.end(); ++i)
+	{
+		XLine* e = *i;
+		if ((!e->duration || current <= e->expiry) && e->Matches(u))
+		{
+			u->exempt = true;
+			return;
 		}
 	}
 }
@@ -184,20 +672,8 @@ XLineLookup* XLineManager::GetAll(const std::string &type)
 	if (n == lookup_lines.end())
 		return NULL;
 
-	LookupIter safei;
-	const time_t current = ServerInstance->Time();
-
 	/* Expire any dead ones, before sending */
-	for (LookupIter x = n->second.begin(); x != n->second.end(); )
-	{
-		safei = x;
-		safei++;
-		if (x->second->duration && current > x->second->expiry)
-		{
-			ExpireLine(n, x);
-		}
-		x = safei;
-	}
+	ExpireLines();
 
 	return &(n->second);
 }
@@ -251,6 +727,33 @@ IdentHostPair XLineManager::IdentSplit(const std::string &ident_and_host)
 // adds a line
 
 bool XLineManager::AddLine(XLine* line, User* user)
+{
+	if (!InsertLine(line, user))
+		return false;
+
+	ServerInstance->BanCache->RemoveEntries(line->type, false); // XXX perhaps remove ELines here?
+	return true;
+}
+
+unsigned int XLineManager::AddLines(std::vector<XLine*>& lines, User* user)
+{
+	unsigned int added = 0;
+	for (std::vector<XLine*>::iterator i = lines.begin(); i != lines.end(); ++i)
+	{
+		if (InsertLine(*i, user))
+			added++;
+		else
+			delete *i;
+	}
+	lines.clear();
+
+	// Negative hits are removed regardless of type, so once is enough
+	if (added)
+		ServerInstance->BanCache->RemoveEntries("", false);
+	return added;
+}
+
+bool XLineManager::InsertLine(XLine* line, User* user)
 {
 	if (line->duration && ServerInstance->Time() > line->expiry)
 		return false; // Don't apply expired XLines.
@@ -276,12 +779,11 @@ bool XLineManager::AddLine(XLine* line, User* user)
 	if (!xlf)
 		return false;
 
-	ServerInstance->BanCache->RemoveEntries(line->type, false); // XXX perhaps remove ELines here?
-
 	if (xlf->AutoApplyToUserList(line))
 		pending_lines.push_back(line);
 
 	lookup_lines[line->type][line->Displayable()] = line;
+	IndexLine(line);
 	line->OnAdd();
 
 	FOREACH_MOD(I_OnAddLine,OnAddLine(user, line));
@@ -310,98 +812,209 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 
 	FOREACH_MOD(I_OnDelLine,OnDelLine(user, y->second));
 
-	y->second->Unset();
-
-	std::vector<XLine*>::iterator pptr = std::find(pending_lines.begin(), pending_lines.end(), y->second);
+	XLine* line = y->second;
+	std::vector<XLine*>::iterator pptr = std::find(pending_lines.begin(), pending_lines.end(), line);
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
+	for (std::deque<XLineBatch*>::iterator i = apply_batches.begin(); i != apply_batches.end(); ++i)
+		(*i)->Remove(line);
 
-	delete y->second;
+	UnindexLine(line);
 	x->second.erase(y);
 
+	// Unset once the line is gone, so anything it rechecks is checked without it
+	line->Unset();
+	delete line;
+
 	return true;
 }
 
 
 void ELine::Unset()
 {
-	/* remove exempt from everyone and force recheck after deleting eline */
+	/* Only the users this line matches can lose their exemption; recheck them against the remaining elines */
 	for (LocalUserList::const_iterator u2 = ServerInstance->Users->local_users.begin(); u2 != ServerInstance->Users->local_users.end(); u2++)
 	{
 		User* u = (User*)(*u2);
+		if (!u->exempt)
+			continue;
+
 		u->exempt = false;
+		if (this->Matches(u))
+			ServerInstance->XLines->CheckELines(u);
+		else
+			u->exempt = true;
 	}
-
-	ServerInstance->XLines->CheckELines();
 }
 
-// returns a pointer to the reason if a nickname matches a qline, NULL if it didnt match
-
-XLine* XLineManager::MatchesLine(const std::string &type, User* user)
+void XLineManager::IndexLine(XLine* line)
 {
-	ContainerIter x = lookup_lines.find(type);
+	if (line->duration)
+		expiries.insert(std::make_pair(line->expiry, line));
 
-	if (x == lookup_lines.end())
-		return NULL;
+	irc::sockets::cidr_mask mask;
+	if (line->GetIPMask(mask))
+	{
+		XLineIPTree*& tree = ip_lines[line->type];
+		if (!tree)
+			tree = new XLineIPTree;
+		tree->Add(mask, line);
+		return;
+	}
 
-	const time_t current = ServerInstance->Time();
+	std::string hostmask;
+	if (line->GetHostMask(hostmask))
+	{
+		XLineHostIndex*& hosts = host_lines[line->type];
+		if (!hosts)
+			hosts = new XLineHostIndex;
+		if (hosts->Add(hostmask, line))
+			return;
+	}
 
-	LookupIter safei;
+	unindexed_lines[line->type][line->Displayable()] = line;
+}
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+void XLineManager::UnindexLine(XLine* line)
+{
+	if (line->duration && !expiries.erase(std::make_pair(line->expiry, line)))
 	{
-		safei = i;
-		safei++;
-
-		if (i->second->duration && current > i->second->expiry)
+		// The expiry time was changed after the line was added
+		for (ExpiryQueue::iterator i = expiries.begin(); i != expiries.end(); ++i)
 		{
-			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
-			i = safei;
-			continue;
+			if (i->second == line)
+			{
+				expiries.erase(i);
+				break;
+			}
 		}
+	}
+
+	irc::sockets::cidr_mask mask;
+	if (line->GetIPMask(mask))
+	{
+		std::map<std::string, XLineIPTree*>::iterator t = ip_lines.find(line->type);
+		if (t != ip_lines.end())
+			t->second->Remove(mask, line);
+		return;
+	}
 
-		if (i->second->Matches(user))
+	// Lines which were not put in the host index are simply not found in it
+	std::string hostmask;
+	if (line->GetHostMask(hostmask))
+	{
+		std::map<std::string, XLineHostIndex*>::iterator h = host_lines.find(line->type);
+		if (h != host_lines.end())
+			h->second->Remove(hostmask, line);
+	}
+
+	ContainerIter u = unindexed_lines.find(line->type);
+	if (u != unindexed_lines.end())
+		u->second.erase(line->Displayable());
+}
+
+XLine* XLineManager::MatchCandidates(const std::string& type, std::vector<XLine*>& candidates, bool unindexed, User* user, const std::string& pattern)
+{
+	/* Of all matching lines, the first one in lookup_lines order is returned, as if
+	 * every line had been tried in turn.
+	 */
+	XLine* found = NULL;
+	irc::string foundkey;
+
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	for (std::vector<XLine*>::iterator i = candidates.begin(); i != candidates.end(); ++i)
+	{
+		XLine* line = *i;
+		if (user ? line->Matches(user) : line->Matches(pattern))
 		{
-			return i->second;
+			irc::string key(line->Displayable());
+			if (!found || key < foundkey)
+			{
+				found = line;
+				foundkey = key;
+			}
 		}
+	}
+
+	ContainerIter u = unindexed_lines.find(type);
+	if (!unindexed || u == unindexed_lines.end())
+		return found;
+
+	for (LookupIter i = u->second.begin(); i != u->second.end(); ++i)
+	{
+		if (found && !(i->first < foundkey))
+			break;
 
-		i = safei;
+		XLine* line = i->second;
+		if (user ? line->Matches(user) : line->Matches(pattern))
+			return line;
 	}
-	return NULL;
+	return found;
 }
 
-XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pattern)
+// returns a pointer to the reason if a nickname matches a qline, NULL if it didnt match
+
+XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 {
+	ExpireLines();
+
 	ContainerIter x = lookup_lines.find(type);
 
 	if (x == lookup_lines.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
+	std::vector<XLine*> candidates;
+	std::map<std::string, XLineIPTree*>::iterator t = ip_lines.find(type);
+	std::map<std::string, XLineHostIndex*>::iterator h = host_lines.find(type);
+	FindCandidates(t != ip_lines.end() ? t->second : NULL, h != host_lines.end() ? h->second : NULL, user, candidates);
 
-	 LookupIter safei;
+	return MatchCandidates(type, candidates, true, user, "");
+}
+
+XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pattern)
+{
+	ExpireLines();
+
+	ContainerIter x = lookup_lines.find(type);
 
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	if (x == lookup_lines.end())
+		return NULL;
+
+	/* Patterns are matched as a whole, so a wildcard in the ident part of a line
+	 * could swallow an '@' and leave the host part matching less than the text
+	 * after the last one. With at most one '@', the indexed lines which can match
+	 * are those found for the host part, or (for lines without an ident part)
+	 * for the whole pattern. The index is only valid while the casemapping is
+	 * no looser than the map it was built with.
+	 */
+	std::string::size_type at = pattern.find('@');
+	if (at == pattern.rfind('@') &&
+		(national_case_insensitive_map == rfc_case_insensitive_map || national_case_insensitive_map == ascii_case_insensitive_map))
 	{
-		safei = i;
-		safei++;
+		std::string host = (at == std::string::npos) ? pattern : pattern.substr(at + 1);
+		std::vector<XLine*> candidates;
 
-		if (i->second->Matches(pattern))
+		std::map<std::string, XLineIPTree*>::iterator t = ip_lines.find(type);
+		irc::sockets::sockaddrs sa;
+		if (t != ip_lines.end() && ParseAddress(host, sa))
+			t->second->Find(sa, candidates);
+
+		std::map<std::string, XLineHostIndex*>::iterator h = host_lines.find(type);
+		if (h != host_lines.end())
 		{
-			if (i->second->duration && current > i->second->expiry)
-			{
-				/* Expire the line, return nothing */
-				ExpireLine(x, i);
-				/* See above */
-				i = safei;
-				continue;
-			}
-			else
-				return i->second;
+			h->second->Find(host, candidates);
+			if (at != std::string::npos)
+				h->second->Find(pattern, candidates);
 		}
 
-		i = safei;
+		return MatchCandidates(type, candidates, true, NULL, pattern);
+	}
+
+	for (LookupIter i = x->second.begin(); i != x->second.end(); ++i)
+	{
+		if (i->second->Matches(pattern))
+			return i->second;
 	}
 	return NULL;
 }
@@ -412,68 +1025,115 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 	FOREACH_MOD(I_OnExpireLine, OnExpireLine(item->second));
 
 	item->second->DisplayExpiry();
-	item->second->Unset();
 
 	/* TODO: Can we skip this loop by having a 'pending' field in the XLine class, which is set when a line
 	 * is pending, cleared when it is no longer pending, so we skip over this loop if its not pending?
 	 * -- Brain
 	 */
-	std::vector<XLine*>::iterator pptr = std::find(pending_lines.begin(), pending_lines.end(), item->second);
+	XLine* line = item->second;
+	std::vector<XLine*>::iterator pptr = std::find(pending_lines.begin(), pending_lines.end(), line);
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
+	for (std::deque<XLineBatch*>::iterator i = apply_batches.begin(); i != apply_batches.end(); ++i)
+		(*i)->Remove(line);
 
-	delete item->second;
+	UnindexLine(line);
 	container->second.erase(item);
+
+	line->Unset();
+	delete line;
 }
 
 
+void XLineManager::ExpireLines()
+{
+	const time_t current = ServerInstance->Time();
+	while (!expiries.empty() && expiries.begin()->first < current)
+	{
+		XLine* line = expiries.begin()->second;
+		ContainerIter x = lookup_lines.find(line->type);
+		ExpireLine(x, x->second.find(line->Displayable()));
+	}
+}
+
 // applies lines, removing clients and changing nicks etc as applicable
 void XLineManager::ApplyLines()
 {
-	LocalUserList::reverse_iterator u2 = ServerInstance->Users->local_users.rbegin();
-	while (u2 != ServerInstance->Users->local_users.rend())
+	if (!pending_lines.empty())
 	{
-		User* u = *u2++;
+		XLineBatch* batch = new XLineBatch;
+		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+			batch->Add(*i);
 
-		// Don't ban people who are exempt.
-		if (u->exempt)
-			continue;
+		std::set<std::string> remaining;
+		if (!apply_batches.empty())
+		{
+			/* A batch is already part way through the users. The ones it has yet
+			 * to check are checked against the new lines as part of it; everyone
+			 * else gets a batch of just the new lines.
+			 */
+			XLineBatch* current = apply_batches.front();
+			for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+				current->Add(*i);
+			remaining.insert(current->users.begin() + current->next, current->users.end());
+		}
 
-		for (std::vector<XLine *>::iterator i = pending_lines.begin(); i != pending_lines.end(); i++)
+		const LocalUserList& users = ServerInstance->Users->local_users;
+		batch->users.reserve(users.size());
+		for (LocalUserList::const_reverse_iterator u = users.rbegin(); u != users.rend(); ++u)
 		{
-			XLine *x = *i;
-			if (x->Matches(u))
-				x->Apply(u);
+			if (remaining.empty() || !remaining.count((*u)->uuid))
+				batch->users.push_back((*u)->uuid);
 		}
+
+		pending_lines.clear();
+		if (batch->users.empty())
+			delete batch;
+		else
+			apply_batches.push_back(batch);
 	}
 
-	pending_lines.clear();
+	ContinueApplying();
 }
 
-void XLineManager::InvokeStats(const std::string &type, int numeric, User* user, string_list &results)
+bool XLineManager::ContinueApplying()
 {
-	ContainerIter n = lookup_lines.find(type);
+	size_t budget = APPLY_SLICE_MATCHES;
+	while (!apply_batches.empty())
+	{
+		XLineBatch* batch = apply_batches.front();
+		while (batch->next < batch->users.size())
+		{
+			if (!budget)
+				return true;
+
+			User* u = ServerInstance->FindUUID(batch->users[batch->next++]);
+			if (!u || !IS_LOCAL(u) || u->quitting || u->exempt)
+				continue;
+
+			size_t cost = batch->Apply(u);
+			budget -= std::min(budget, cost);
+		}
+
+		apply_batches.pop_front();
+		delete batch;
+	}
+	return false;
+}
 
-	time_t current = ServerInstance->Time();
+void XLineManager::InvokeStats(const std::string &type, int numeric, User* user, string_list &results)
+{
+	ExpireLines();
 
-	LookupIter safei;
+	ContainerIter n = lookup_lines.find(type);
 
 	if (n != lookup_lines.end())
 	{
 		XLineLookup& list = n->second;
-		for (LookupIter i = list.begin(); i != list.end(); )
+		for (LookupIter i = list.begin(); i != list.end(); ++i)
 		{
-			safei = i;
-			safei++;
-
-			if (i->second->duration && current > i->second->expiry)
-			{
-				ExpireLine(n, i);
-			}
-			else
-				results.push_back(ServerInstance->Config->ServerName+" "+ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
-					ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
-			i = safei;
+			results.push_back(ServerInstance->Config->ServerName+" "+ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
+				ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
 		}
 	}
 }
@@ -518,6 +1178,13 @@ XLineManager::~XLineManager()
 			delete j->second;
 		}
 	}
+
+	for (std::map<std::string, XLineIPTree*>::iterator i = ip_lines.begin(); i != ip_lines.end(); ++i)
+		delete i->second;
+	for (std::map<std::string, XLineHostIndex*>::iterator i = host_lines.begin(); i != host_lines.end(); ++i)
+		delete i->second;
+	for (std::deque<XLineBatch*>::iterator i = apply_batches.begin(); i != apply_batches.end(); ++i)
+		delete *i;
 }
 
 void XLine::Apply(User* u)
@@ -544,11 +1211,15 @@ void XLine::DefaultApply(User* u, const std::string &line, bool bancache)
 
 	if (bancache)
 	{
-		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCache: Adding positive hit (" + line + ") for " + u->GetIPString());
-		if (this->duration > 0)
-			ServerInstance->BanCache->AddHit(u->GetIPString(), this->type, line + "-Lined: " + this->reason, this->duration);
-		else
-			ServerInstance->BanCache->AddHit(u->GetIPString(), this->type, line + "-Lined: " + this->reason);
+		/* If this line bans the user's whole IPv6 prefix, cache the prefix rather than the address */
+		irc::sockets::cidr_mask range(u->client_sa, 128);
+		irc::sockets::cidr_mask mask;
+		const unsigned int prefix = ServerInstance->Config->BanCachePrefix6;
+		if (prefix && range.type == AF_INET6 && GetIPMask(mask) && mask.type == AF_INET6 && mask.length <= prefix)
+			range = irc::sockets::cidr_mask(u->client_sa, prefix);
+
+		ServerInstance->Logs->Log("BANCACHE", DEBUG, "BanCache: Adding positive hit (" + line + ") for " + range.str());
+		ServerInstance->BanCache->AddHit(range, this->type, line + "-Lined: " + this->reason, this->duration);
 	}
 }
 
@@ -557,10 +1228,10 @@ bool KLine::Matches(User *u)
 	if (u->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identmatch.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostcidr.match(u->client_sa) || hostmatch.Match(u->host) ||
+		    hostmatch.Match(u->GetIPString()))
 		{
 			return true;
 		}
@@ -579,10 +1250,10 @@ bool GLine::Matches(User *u)
 	if (u->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identmatch.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostcidr.match(u->client_sa) || hostmatch.Match(u->host) ||
+		    hostmatch.Match(u->GetIPString()))
 		{
 			return true;
 		}
@@ -601,10 +1272,10 @@ bool ELine::Matches(User *u)
 	if (u->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identmatch.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostcidr.match(u->client_sa) || hostmatch.Match(u->host) ||
+		    hostmatch.Match(u->GetIPString()))
 		{
 			return true;
 		}
@@ -618,7 +1289,7 @@ bool ZLine::Matches(User *u)
 	if (u->exempt)
 		return false;
 
-	if (InspIRCd::MatchCIDR(u->GetIPString(), this->ipaddr))
+	if (ipcidr.match(u->client_sa) || ipmatch.Match(u->GetIPString()))
 		return true;
 	else
 		return false;
@@ -632,7 +1303,7 @@ void ZLine::Apply(User* u)
 
 bool QLine::Matches(User *u)
 {
-	if (InspIRCd::Match(u->nick, this->nick))
+	if (nickmatch.Match(u->nick))
 		return true;
 
 	return false;
@@ -647,7 +1318,7 @@ void QLine::Apply(User* u)
 
 bool ZLine::Matches(const std::string &str)
 {
-	if (InspIRCd::MatchCIDR(str, this->ipaddr))
+	if (MatchCIDR(str, this->ipaddr, ipmatch))
 		return true;
 	else
 		return false;
@@ -655,7 +1326,7 @@ bool ZLine::Matches(const std::string &str)
 
 bool QLine::Matches(const std::string &str)
 {
-	if (InspIRCd::Match(str, this->nick))
+	if (nickmatch.Match(str))
 		return true;
 
 	return false;
@@ -663,28 +1334,17 @@ bool QLine::Matches(const std::string &str)
 
 bool ELine::Matches(const std::string &str)
 {
-	return (InspIRCd::MatchCIDR(str, matchtext));
+	return MatchCIDR(str, matchtext, textmatch);
 }
 
 bool KLine::Matches(const std::string &str)
 {
-	return (InspIRCd::MatchCIDR(str.c_str(), matchtext));
+	return MatchCIDR(str, matchtext, textmatch);
 }
 
 bool GLine::Matches(const std::string &str)
 {
-	return (InspIRCd::MatchCIDR(str, matchtext));
-}
-
-void ELine::OnAdd()
-{
-	/* When adding one eline, only check the one eline */
-	for (LocalUserList::const_iterator u2 = ServerInstance->Users->local_users.begin(); u2 != ServerInstance->Users->local_users.end(); u2++)
-	{
-		User* u = (User*)(*u2);
-		if (this->Matches(u))
-			u->exempt = true;
-	}
+	return MatchCIDR(str, matchtext, textmatch);
 }
 
 void ELine::DisplayExpiry()
@@ -747,6 +1407,50 @@ bool KLine::IsBurstable()
 	return false;
 }
 
+bool KLine::GetIPMask(irc::sockets::cidr_mask& mask)
+{
+	return ParseIPMask(hostmask, mask);
+}
+
+bool GLine::GetIPMask(irc::sockets::cidr_mask& mask)
+{
+	return ParseIPMask(hostmask, mask);
+}
+
+bool ELine::GetIPMask(irc::sockets::cidr_mask& mask)
+{
+	return ParseIPMask(hostmask, mask);
+}
+
+bool ZLine::GetIPMask(irc::sockets::cidr_mask& mask)
+{
+	return ParseIPMask(ipaddr, mask);
+}
+
+bool KLine::GetHostMask(std::string& mask)
+{
+	mask = hostmask;
+	return true;
+}
+
+bool GLine::GetHostMask(std::string& mask)
+{
+	mask = hostmask;
+	return true;
+}
+
+bool ELine::GetHostMask(std::string& mask)
+{
+	mask = hostmask;
+	return true;
+}
+
+bool ZLine::GetHostMask(std::string& mask)
+{
+	mask = ipaddr;
+	return true;
+}
+
 bool XLineManager::RegisterFactory(XLineFactory* xlf)
 {
 	XLineFactMap::iterator n = line_factory.find(xlf->GetType());